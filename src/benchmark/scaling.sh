@@ -0,0 +1,185 @@
+#!/bin/bash
+# Strong and weak scaling of the programs over the amount of MPI processes.
+#
+# Every run is timed from launch to exit (the whole mpirun), `repetitions`
+# times per process count, and the median is kept. Strong scaling keeps the
+# problem size fixed, weak scaling grows it with the processes so that each
+# one keeps the same work:
+#
+#     workload  program                             size                   weak growth
+#     primes    prime_number_search SIZE            range end              np
+#     count     prime_number_search SIZE --count    x                      np^1.5 (O(x^2/3) work)
+#     log       log_taylor_aproximation 1500000 SIZE  series terms         np
+#     matrix    matrix_multiplication SIZE          matrix size            np^(1/3)
+#     pattern   pattern_match                       text bytes             np
+#
+# Speedup is T(1) / T(np) and efficiency speedup / np for strong scaling, and
+# T(1) / T(np) for weak scaling. The first process count is the baseline.
+#
+# Usage: scaling.sh [options] workload
+#   -b DIR     directory of the compiled programs (default build)
+#   -n LIST    process counts, quoted (default "1 2 4")
+#   -m MODE    strong or weak (default strong)
+#   -s SIZE    problem size of the baseline (default per workload)
+#   -r N       repetitions per process count (default 3)
+#   -t N       --threads of every process (default 1)
+#   -f FILE    hostfile, otherwise the processes run locally with oversubscription
+#   -l LABEL   stored with every result, e.g. the commit (default git rev-parse --short HEAD)
+#   -o PREFIX  writes PREFIX.csv and PREFIX.json (default scaling_{workload}_{mode})
+
+BUILD_DIR="build"
+PROCESS_COUNTS="1 2 4"
+MODE="strong"
+SIZE=""
+REPETITIONS=3
+THREADS=1
+HOSTFILE=""
+LABEL="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+OUTPUT=""
+
+while getopts "b:n:m:s:r:t:f:l:o:" option; do
+    case "$option" in
+        b) BUILD_DIR="$OPTARG" ;;
+        n) PROCESS_COUNTS="$OPTARG" ;;
+        m) MODE="$OPTARG" ;;
+        s) SIZE="$OPTARG" ;;
+        r) REPETITIONS="$OPTARG" ;;
+        t) THREADS="$OPTARG" ;;
+        f) HOSTFILE="$OPTARG" ;;
+        l) LABEL="$OPTARG" ;;
+        o) OUTPUT="$OPTARG" ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ "$#" -ne 1 ] || { [ "$MODE" != "strong" ] && [ "$MODE" != "weak" ]; }; then
+    echo "Usage: scaling.sh [-b build_dir] [-n \"1 2 4\"] [-m strong|weak] [-s size] [-r repetitions]"
+    echo "                  [-t threads] [-f hostfile] [-l label] [-o output_prefix] primes|count|log|matrix|pattern"
+    exit 1
+fi
+
+WORKLOAD="$1"
+case "$WORKLOAD" in
+    primes) PROGRAM="prime_number_search"; DEFAULT_SIZE=200000000; GROWTH=1 ;;
+    count) PROGRAM="prime_number_search"; DEFAULT_SIZE=1000000000000; GROWTH=1.5 ;;
+    log) PROGRAM="log_taylor_aproximation"; DEFAULT_SIZE=200000000; GROWTH=1 ;;
+    matrix) PROGRAM="matrix_multiplication"; DEFAULT_SIZE=2048; GROWTH=0.333333333333 ;;
+    pattern) PROGRAM="pattern_match"; DEFAULT_SIZE=500000000; GROWTH=1 ;;
+    *) echo "Unknown workload $WORKLOAD"; exit 1 ;;
+esac
+SIZE="${SIZE:-$DEFAULT_SIZE}"
+OUTPUT="${OUTPUT:-scaling_${WORKLOAD}_${MODE}}"
+
+if [ ! -x "$BUILD_DIR/$PROGRAM" ]; then
+    echo "The program $BUILD_DIR/$PROGRAM does not exist, compile it first."
+    exit 1
+fi
+
+# Runs locally unless a hostfile is given. Open MPI refuses to run as root without the flag
+MPIRUN=(mpirun)
+if [ -n "$HOSTFILE" ]; then
+    MPIRUN+=(--hostfile "$HOSTFILE")
+else
+    MPIRUN+=(--oversubscribe)
+fi
+if [ "$(id -u)" -eq 0 ]; then
+    MPIRUN+=(--allow-run-as-root)
+fi
+
+# Inputs of the pattern workload, in a directory removed on exit. With a
+# hostfile it must be on a filesystem shared by every node
+WORK_DIR="$(mktemp -d "${TMPDIR:-/tmp}/scaling.XXXXXX")"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# Writes a text of $1 bytes and the patterns searched in it
+make_pattern_inputs() {
+    printf "needle\nhaystack\nacgtacgt\nzz\n" > "$WORK_DIR/patterns.txt"
+    head -c "$1" /dev/urandom | tr -dc 'a-z\n' > "$WORK_DIR/text_raw.txt"
+    # tr drops about 90% of the bytes, repeat the result up to the requested size
+    while [ "$(stat -c %s "$WORK_DIR/text_raw.txt")" -lt "$1" ]; do
+        cat "$WORK_DIR/text_raw.txt" "$WORK_DIR/text_raw.txt" > "$WORK_DIR/text_double.txt"
+        mv "$WORK_DIR/text_double.txt" "$WORK_DIR/text_raw.txt"
+    done
+    head -c "$1" "$WORK_DIR/text_raw.txt" > "$WORK_DIR/text.txt"
+}
+
+# Prints the arguments of the program for a problem of size $1
+program_arguments() {
+    case "$WORKLOAD" in
+        primes) echo "$1" ;;
+        count) echo "$1 --count" ;;
+        log) echo "1500000 $1" ;;
+        matrix) echo "$1" ;;
+        pattern) echo "$WORK_DIR/patterns.txt $WORK_DIR/text.txt" ;;
+    esac
+}
+
+# Prints the median of the numbers of its arguments
+median() {
+    printf "%s\n" "$@" | sort -g | awk '{ values[NR] = $1 } END { if (NR % 2) print values[(NR + 1) / 2]; else print (values[NR / 2] + values[NR / 2 + 1]) / 2 }'
+}
+
+echo "label,workload,mode,processes,threads,size,repetitions,median_s,min_s,max_s,speedup,efficiency" > "$OUTPUT.csv"
+JSON_RECORDS=()
+BASE_PROCESSES=""
+BASE_TIME=""
+
+printf "%-10s %-16s %-12s %-10s %-10s\n" "processes" "size" "median s" "speedup" "efficiency"
+for PROCESSES in $PROCESS_COUNTS; do
+    BASE_PROCESSES="${BASE_PROCESSES:-$PROCESSES}"
+    if [ "$MODE" = "weak" ]; then
+        RUN_SIZE=$(awk -v size="$SIZE" -v np="$PROCESSES" -v base="$BASE_PROCESSES" -v growth="$GROWTH" \
+            'BEGIN { printf "%.0f", size * (np / base) ^ growth }')
+    else
+        RUN_SIZE="$SIZE"
+    fi
+    if [ "$WORKLOAD" = "pattern" ]; then
+        make_pattern_inputs "$RUN_SIZE"
+    fi
+
+    TIMES=()
+    for ((REPETITION = 0; REPETITION < REPETITIONS; REPETITION++)); do
+        START=$(date +%s.%N)
+        # shellcheck disable=SC2046
+        if ! "${MPIRUN[@]}" -np "$PROCESSES" "$BUILD_DIR/$PROGRAM" $(program_arguments "$RUN_SIZE") --threads "$THREADS" > "$WORK_DIR/output.txt" 2>&1; then
+            echo "The run with $PROCESSES processes failed:"
+            tail -n 20 "$WORK_DIR/output.txt"
+            exit 1
+        fi
+        END=$(date +%s.%N)
+        TIMES+=("$(awk -v start="$START" -v end="$END" 'BEGIN { printf "%.6f", end - start }')")
+    done
+
+    MEDIAN=$(median "${TIMES[@]}")
+    MINIMUM=$(printf "%s\n" "${TIMES[@]}" | sort -g | head -n 1)
+    MAXIMUM=$(printf "%s\n" "${TIMES[@]}" | sort -g | tail -n 1)
+    BASE_TIME="${BASE_TIME:-$MEDIAN}"
+    SPEEDUP=$(awk -v base="$BASE_TIME" -v time="$MEDIAN" 'BEGIN { printf "%.4f", base / time }')
+    if [ "$MODE" = "weak" ]; then
+        EFFICIENCY="$SPEEDUP"
+    else
+        EFFICIENCY=$(awk -v speedup="$SPEEDUP" -v np="$PROCESSES" -v base="$BASE_PROCESSES" 'BEGIN { printf "%.4f", speedup * base / np }')
+    fi
+
+    printf "%-10s %-16s %-12s %-10s %-10s\n" "$PROCESSES" "$RUN_SIZE" "$MEDIAN" "$SPEEDUP" "$EFFICIENCY"
+    echo "$LABEL,$WORKLOAD,$MODE,$PROCESSES,$THREADS,$RUN_SIZE,$REPETITIONS,$MEDIAN,$MINIMUM,$MAXIMUM,$SPEEDUP,$EFFICIENCY" >> "$OUTPUT.csv"
+    JSON_RECORDS+=("{\"processes\": $PROCESSES, \"threads\": $THREADS, \"size\": $RUN_SIZE, \"median_s\": $MEDIAN, \"seconds\": [$(IFS=,; echo "${TIMES[*]}")], \"speedup\": $SPEEDUP, \"efficiency\": $EFFICIENCY}")
+done
+
+{
+    echo "{"
+    echo "  \"label\": \"$LABEL\", \"workload\": \"$WORKLOAD\", \"mode\": \"$MODE\", \"repetitions\": $REPETITIONS,"
+    echo "  \"results\": ["
+    for ((I = 0; I < ${#JSON_RECORDS[@]}; I++)); do
+        SEPARATOR=","
+        if [ "$I" -eq $((${#JSON_RECORDS[@]} - 1)) ]; then
+            SEPARATOR=""
+        fi
+        echo "    ${JSON_RECORDS[$I]}$SEPARATOR"
+    done
+    echo "  ]"
+    echo "}"
+} > "$OUTPUT.json"
+
+echo "Results written to $OUTPUT.csv and $OUTPUT.json"
@@ -0,0 +1,201 @@
+/* Compilation
+mpic++ -std=c++17 -O3 -pthread -o build/benchmark_kernels src/benchmark_kernels.cpp
+
+Single core benchmarks of the kernels behind every program, over a sweep of
+sizes. No MPI, run it directly:
+
+    build/benchmark_kernels --csv kernels.csv --label $(git rev-parse --short HEAD)
+
+Inputs come from fixed seeds, so two commits measure exactly the same work.
+*/
+
+#include "common/benchmark.h"
+#include "common/options.h"
+#include "common/thread_pool.h"
+#include "log/log_batch.h"
+#include "log/log_series.h"
+#include "matrix/gemm.h"
+#include "matrix/matrix.h"
+#include "pattern/pattern_counter.h"
+#include "prime/miller_rabin.h"
+#include "prime/sieve.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/// Text of `size` bytes drawn from `alphabet`
+std::string random_text(std::size_t size, const std::string& alphabet, uint64_t seed)
+{
+    std::mt19937_64 generator(seed);
+    std::string text(size, ' ');
+    for (char& c : text)
+        c = alphabet[generator() % alphabet.size()];
+    return text;
+}
+
+void benchmark_gemm(BenchmarkSuite& suite)
+{
+    for (std::size_t n : { 64, 256, 512, 1024 }) {
+        Matrix a(n, n), b(n, n), c(n, n);
+        a.fill(0.1f);
+        b.fill(0.2f);
+        const std::string parameters = "n=" + std::to_string(n) + " " + gemm_kernel_best().name;
+        suite.run("gemm", parameters, 2.0 * n * n * n, "FLOP", [&] {
+            c.fill(0.0f);
+            gemm(a.view(), b.view(), c.view());
+            do_not_optimize(c[0][0]);
+        });
+    }
+}
+
+void benchmark_patterns(BenchmarkSuite& suite)
+{
+    const std::size_t text_size = 16 << 20;
+    const std::string text = random_text(text_size, "abcdefghijklmnopqrstuvwxyz", 1);
+
+    auto run = [&](const std::string& parameters, const std::vector<std::string>& patterns, MatchMode mode) {
+        PatternCounter counter(patterns, mode);
+        suite.run("pattern_count", parameters + " " + counter.method(), text_size, "B", [&] {
+            PatternCounter::Scan scan = counter.start_scan();
+            counter.count(scan, text.data(), text.size(), 0);
+            do_not_optimize(scan);
+        });
+    };
+
+    // Patterns taken from the text, so they do occur
+    std::vector<std::string> patterns;
+    for (std::size_t count : { 1, 4, 64 }) {
+        patterns.clear();
+        for (std::size_t i = 0; i < count; i++)
+            patterns.push_back(text.substr(i * 7919 % (text_size - 16), 8 + i % 8));
+        run("patterns=" + std::to_string(count), patterns, {});
+    }
+    run("patterns=1 mismatches=1", { text.substr(1000, 12) }, { MatchKind::mismatches, 1 });
+    run("patterns=1 edits=2", { text.substr(1000, 12) }, { MatchKind::edits, 2 });
+}
+
+void benchmark_primes(BenchmarkSuite& suite)
+{
+    for (uint64_t bits : { 32, 64 }) {
+        std::mt19937_64 generator(bits);
+        std::vector<uint64_t> numbers(1 << 18);
+        for (uint64_t& number : numbers)
+            number = (bits == 64 ? generator() : generator() >> 32) | 1;
+        suite.run("is_prime", "random odd " + std::to_string(bits) + " bit", numbers.size(), "numbers", [&] {
+            uint64_t primes = 0;
+            for (uint64_t number : numbers)
+                primes += is_prime(number);
+            do_not_optimize(primes);
+        });
+    }
+
+    // Only primes, the worst case: every base runs
+    std::vector<uint64_t> primes;
+    for (uint64_t n = 1000000000000000003ULL; primes.size() < 4096; n += 2) {
+        if (is_prime(n))
+            primes.push_back(n);
+    }
+    suite.run("is_prime", "primes near 1e18", primes.size(), "numbers", [&] {
+        uint64_t count = 0;
+        for (uint64_t prime : primes)
+            count += is_prime(prime);
+        do_not_optimize(count);
+    });
+
+    for (uint64_t start : { uint64_t(0), uint64_t(1000000000000) }) {
+        for (uint64_t length : { uint64_t(10000000), uint64_t(100000000) }) {
+            const SegmentedSieve sieve(start + length);
+            const std::string parameters = "[" + std::to_string(start) + ", +" + std::to_string(length) + ")";
+            suite.run("sieve_count", parameters, length, "numbers", [&] {
+                do_not_optimize(sieve.count(start, start + length));
+            });
+            suite.run("sieve_for_each_prime", parameters, length, "numbers", [&] {
+                uint64_t last = 0;
+                sieve.for_each_prime(start, start + length, [&](uint64_t prime) { last = prime; });
+                do_not_optimize(last);
+            });
+        }
+    }
+}
+
+void benchmark_logarithms(BenchmarkSuite& suite)
+{
+    for (long double x : { 2.0L, 1000.0L, 1000000.0L }) {
+        const uint64_t terms = terms_for_tolerance(x, 1e-15L);
+        std::ostringstream parameters;
+        parameters << "x=" << static_cast<double>(x) << " terms=" << terms;
+        suite.run("log_terms", parameters.str(), terms, "terms", [&] {
+            do_not_optimize(log_terms(0, x, 0, terms));
+        });
+    }
+
+    std::mt19937_64 generator(3);
+    std::uniform_real_distribution<double> exponent(-50, 50);
+    std::vector<double> values(1 << 20), hi(values.size()), lo(values.size());
+    for (double& value : values)
+        value = std::pow(10.0, exponent(generator));
+
+    suite.run("log_batch", "double", values.size(), "logs", [&] {
+        log_batch_kernel()(values.data(), hi.data(), values.size());
+        do_not_optimize(hi[0]);
+    });
+    suite.run("log_batch", "double-double", values.size(), "logs", [&] {
+        log_batch_double_double_kernel()(values.data(), hi.data(), lo.data(), values.size());
+        do_not_optimize(hi[0]);
+    });
+}
+
+int main(int argc, char** argv)
+{
+    BenchmarkSettings settings;
+    const char* repetitions_option = take_option(argc, argv, "--repetitions");
+    const char* warmup_option = take_option(argc, argv, "--warmup");
+    const char* filter_option = take_option(argc, argv, "--filter");
+    const char* label_option = take_option(argc, argv, "--label");
+    const char* csv_option = take_option(argc, argv, "--csv");
+    const char* json_option = take_option(argc, argv, "--json");
+
+    if (argc != 1) {
+        std::cout << "The program expects no arguments. Options:\n"
+                  << "  --repetitions N  timed runs of every benchmark, 10 by default\n"
+                  << "  --warmup N       untimed runs before them, 2 by default\n"
+                  << "  --filter TEXT    only runs the benchmarks whose name contains TEXT\n"
+                  << "  --label TEXT     stored with every result, e.g. the commit\n"
+                  << "  --csv FILE       writes the results as CSV\n"
+                  << "  --json FILE      writes the results as JSON" << std::endl;
+        return 1;
+    }
+    if (repetitions_option)
+        settings.repetitions = std::max(1L, atol(repetitions_option));
+    if (warmup_option)
+        settings.warmup = atol(warmup_option);
+    if (filter_option)
+        settings.filter = filter_option;
+    if (label_option)
+        settings.label = label_option;
+
+    // A single core, the scaling over cores and nodes is measured by benchmark/scaling.sh
+    ThreadPool::configure(1);
+
+    BenchmarkSuite suite(settings);
+    suite.print_header();
+    benchmark_gemm(suite);
+    benchmark_patterns(suite);
+    benchmark_primes(suite);
+    benchmark_logarithms(suite);
+
+    bool written = true;
+    if (csv_option && !suite.write_csv(csv_option)) {
+        std::cerr << "Error writing " << csv_option << std::endl;
+        written = false;
+    }
+    if (json_option && !suite.write_json(json_option)) {
+        std::cerr << "Error writing " << json_option << std::endl;
+        written = false;
+    }
+    return written ? 0 : 1;
+}
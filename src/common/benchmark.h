@@ -0,0 +1,187 @@
+#pragma once
+
+/* Timing of kernels on a single core.
+
+Each benchmark runs its body a few times to warm the caches and the branch
+predictors, then times `repetitions` samples with steady_clock, a sample
+being one run or, for runs under a millisecond, the average of enough
+consecutive runs to last one. The
+median and percentiles of those runs are reported rather than the mean, so a
+run disturbed by the OS doesn't move the result. `items` is what one run
+processes (bytes, numbers, FLOPs...), giving a throughput that can be compared
+across sizes.
+
+Results go to a table on stdout and optionally to CSV and JSON, one record per
+benchmark with the label of the run (e.g. the commit) so files of several
+commits can be concatenated and compared.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Shortest time measured at once, faster runs are repeated within a sample
+constexpr double BENCHMARK_MIN_SAMPLE_SECONDS = 1e-3;
+
+/// Keeps the compiler from optimizing away the computation of `value`
+template <typename T>
+inline void do_not_optimize(const T& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/// `value` with an SI prefix, e.g. "12.35 M"
+inline std::string format_scaled(double value)
+{
+    const char* prefixes[] = { "", "K", "M", "G", "T" };
+    int prefix = 0;
+    while (value >= 1000 && prefix < 4) {
+        value /= 1000;
+        prefix++;
+    }
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2) << value << " " << prefixes[prefix];
+    return text.str();
+}
+
+/// `seconds` in the largest unit under which it is at least 1, e.g. "3.10 ms"
+inline std::string format_duration(double seconds)
+{
+    const char* units[] = { "s", "ms", "us", "ns" };
+    int unit = 0;
+    while (seconds < 1 && unit < 3) {
+        seconds *= 1000;
+        unit++;
+    }
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(2) << seconds << " " << units[unit];
+    return text.str();
+}
+
+struct BenchmarkResult {
+    std::string name;
+    std::string parameters;
+    std::string unit; // Of the items, e.g. "bytes"
+    double items = 0; // Processed by one run
+    std::vector<double> seconds; // Of every timed run, sorted
+
+    /// Value at `fraction` of the sorted times, interpolated
+    double percentile(double fraction) const
+    {
+        if (seconds.empty())
+            return 0;
+        double position = fraction * (seconds.size() - 1);
+        std::size_t below = static_cast<std::size_t>(position);
+        std::size_t above = std::min(below + 1, seconds.size() - 1);
+        return seconds[below] + (seconds[above] - seconds[below]) * (position - below);
+    }
+
+    inline double median() const { return percentile(0.5); }
+    /// Items per second of the median run
+    inline double throughput() const { return items / std::max(median(), 1e-12); }
+};
+
+struct BenchmarkSettings {
+    uint32_t warmup = 2;
+    uint32_t repetitions = 10;
+    std::string filter; // Only the benchmarks whose name contains it run
+    std::string label; // Stored with every result
+};
+
+class BenchmarkSuite {
+    BenchmarkSettings settings;
+    std::vector<BenchmarkResult> results;
+
+public:
+    explicit BenchmarkSuite(BenchmarkSettings settings)
+        : settings(std::move(settings))
+    {
+    }
+
+    inline bool enabled(const std::string& name) const
+    {
+        return name.find(settings.filter) != std::string::npos;
+    }
+
+    /// Times `body`, which processes `items` units each run, and prints a row
+    template <typename Body>
+    void run(const std::string& name, const std::string& parameters, double items, const std::string& unit, Body&& body)
+    {
+        if (!enabled(name))
+            return;
+
+        auto time_runs = [&](uint32_t runs) {
+            auto start = std::chrono::steady_clock::now();
+            for (uint32_t i = 0; i < runs; i++)
+                body();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            return elapsed.count() / runs;
+        };
+
+        for (uint32_t i = 0; i < settings.warmup; i++)
+            body();
+
+        // Runs shorter than the clock can resolve well are timed in batches
+        const double estimate = time_runs(1);
+        const uint32_t batch = estimate >= BENCHMARK_MIN_SAMPLE_SECONDS
+            ? 1
+            : static_cast<uint32_t>(std::min(1e6, std::ceil(BENCHMARK_MIN_SAMPLE_SECONDS / std::max(estimate, 1e-9))));
+
+        BenchmarkResult result { name, parameters, unit, items, {} };
+        for (uint32_t i = 0; i < settings.repetitions; i++)
+            result.seconds.push_back(time_runs(batch));
+        std::sort(result.seconds.begin(), result.seconds.end());
+
+        std::cout << std::left << std::setw(22) << name << std::setw(36) << parameters << std::right
+                  << std::setw(12) << format_duration(result.median()) << std::setw(12) << format_duration(result.percentile(0.1))
+                  << std::setw(12) << format_duration(result.percentile(0.9)) << "  " << format_scaled(result.throughput()) + unit + "/s"
+                  << std::endl;
+        results.push_back(std::move(result));
+    }
+
+    void print_header() const
+    {
+        std::cout << std::left << std::setw(22) << "benchmark" << std::setw(36) << "parameters" << std::right
+                  << std::setw(12) << "median" << std::setw(12) << "p10" << std::setw(12) << "p90" << "  throughput\n";
+    }
+
+    bool write_csv(const std::string& path) const
+    {
+        std::ofstream file(path);
+        file << "label,benchmark,parameters,unit,items,repetitions,median_s,p10_s,p90_s,min_s,max_s,items_per_s\n";
+        for (const BenchmarkResult& result : results) {
+            file << settings.label << "," << result.name << ",\"" << result.parameters << "\"," << result.unit << ","
+                 << std::setprecision(12) << result.items << "," << result.seconds.size() << "," << result.median() << ","
+                 << result.percentile(0.1) << "," << result.percentile(0.9) << "," << result.seconds.front() << ","
+                 << result.seconds.back() << "," << result.throughput() << "\n";
+        }
+        return static_cast<bool>(file);
+    }
+
+    bool write_json(const std::string& path) const
+    {
+        std::ofstream file(path);
+        file << "{\n  \"label\": \"" << settings.label << "\",\n  \"results\": [";
+        for (std::size_t i = 0; i < results.size(); i++) {
+            const BenchmarkResult& result = results[i];
+            file << (i ? "," : "") << "\n    {\"benchmark\": \"" << result.name << "\", \"parameters\": \""
+                 << result.parameters << "\", \"unit\": \"" << result.unit << "\", \"items\": " << std::setprecision(12)
+                 << result.items << ", \"median_s\": " << result.median() << ", \"p10_s\": " << result.percentile(0.1)
+                 << ", \"p90_s\": " << result.percentile(0.9) << ", \"items_per_s\": " << result.throughput()
+                 << ", \"seconds\": [";
+            for (std::size_t run = 0; run < result.seconds.size(); run++)
+                file << (run ? ", " : "") << result.seconds[run];
+            file << "]}";
+        }
+        file << "\n  ]\n}\n";
+        return static_cast<bool>(file);
+    }
+};
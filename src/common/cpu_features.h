@@ -0,0 +1,74 @@
+#pragma once
+
+/* Instruction set detection done at runtime, so a single binary compiled on the
+head node picks the fastest code path available on every node of the cluster.
+Vectorized kernels are compiled with `__attribute__((target(...)))` and must only
+be called after checking the matching flag here.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include <cstdint>
+
+struct CpuFeatures {
+    bool sse2 = false;
+    bool popcnt = false;
+    bool avx2 = false;
+    bool fma = false;
+    bool avx512f = false;
+    bool avx512bw = false;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+/// Reads the extended control register, which tells which register states the
+/// OS saves on context switches
+__attribute__((target("xsave"))) inline uint64_t read_xcr0()
+{
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+}
+#endif
+
+inline CpuFeatures detect_cpu_features()
+{
+    CpuFeatures features;
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return features;
+
+    features.sse2 = edx & bit_SSE2;
+    features.popcnt = ecx & bit_POPCNT;
+    bool osxsave = ecx & bit_OSXSAVE;
+    bool avx = ecx & bit_AVX;
+    bool fma = ecx & bit_FMA;
+
+    if (!osxsave || !avx)
+        return features;
+
+    // XMM and YMM state (bits 1, 2) must be enabled for AVX, plus the opmask
+    // and ZMM state (bits 5, 6, 7) for AVX-512
+    uint64_t xcr0 = read_xcr0();
+    bool ymm_enabled = (xcr0 & 0x6) == 0x6;
+    bool zmm_enabled = (xcr0 & 0xe6) == 0xe6;
+
+    if (!ymm_enabled || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return features;
+
+    features.avx2 = ebx & bit_AVX2;
+    features.fma = fma;
+    features.avx512f = zmm_enabled && (ebx & bit_AVX512F);
+    features.avx512bw = zmm_enabled && (ebx & bit_AVX512BW);
+#endif
+    return features;
+}
+
+/// Features of the CPU the process is running on, detected once
+inline const CpuFeatures& cpu_features()
+{
+    static const CpuFeatures features = detect_cpu_features();
+    return features;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+/* Double-double arithmetic (Dekker, Knuth): a value is the unevaluated sum
+hi + lo of two doubles, |lo| <= ulp(hi) / 2, about 32 significant digits.
+Products split the factors in halves instead of relying on a fused
+multiply-add, so every x86-64 CPU gets the same bits. That only holds in code
+compiled without FMA: with it the compiler contracts a * b + c and the
+splitting breaks, so FMA target functions must call these through a
+non-inlined function (see log_batch.h).
+*/
+
+#include <cstddef>
+
+struct DoubleDouble {
+    double hi;
+    double lo;
+};
+
+inline DoubleDouble two_sum(double a, double b)
+{
+    double sum = a + b;
+    double b_part = sum - a;
+    return { sum, (a - (sum - b_part)) + (b - b_part) };
+}
+
+inline DoubleDouble quick_two_sum(double a, double b)
+{
+    double sum = a + b;
+    return { sum, b - (sum - a) };
+}
+
+inline DoubleDouble two_product(double a, double b)
+{
+    constexpr double split = 134217729.0; // 2^27 + 1
+    double product = a * b;
+    double a_big = split * a, b_big = split * b;
+    double a_hi = a_big - (a_big - a), b_hi = b_big - (b_big - b);
+    double a_lo = a - a_hi, b_lo = b - b_hi;
+    return { product, ((a_hi * b_hi - product) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo };
+}
+
+inline DoubleDouble dd_add(DoubleDouble a, DoubleDouble b)
+{
+    DoubleDouble sum = two_sum(a.hi, b.hi);
+    return quick_two_sum(sum.hi, sum.lo + a.lo + b.lo);
+}
+
+inline DoubleDouble dd_multiply(DoubleDouble a, DoubleDouble b)
+{
+    DoubleDouble product = two_product(a.hi, b.hi);
+    return quick_two_sum(product.hi, product.lo + a.hi * b.lo + a.lo * b.hi);
+}
+
+/// a / b for a double a
+inline DoubleDouble dd_divide(double a, DoubleDouble b)
+{
+    double q1 = a / b.hi;
+    DoubleDouble product = dd_multiply({ q1, 0 }, b);
+    DoubleDouble remainder = two_sum(a, -product.hi);
+    remainder.lo -= product.lo;
+    double q2 = (remainder.hi + remainder.lo) / b.hi;
+    return quick_two_sum(q1, q2);
+}
+
+/// a + b keeping the rounding error of both halves. dd_add is only accurate
+/// when a and b don't cancel, this one is for sums of arbitrary signs
+inline DoubleDouble dd_add_accurate(DoubleDouble a, DoubleDouble b)
+{
+    DoubleDouble high = two_sum(a.hi, b.hi);
+    DoubleDouble low = two_sum(a.lo, b.lo);
+    high = quick_two_sum(high.hi, high.lo + low.hi);
+    return quick_two_sum(high.hi, high.lo + low.lo);
+}
+
+/// Splits a long double into the nearest double-double, exact within the
+/// range of double
+inline DoubleDouble dd_from_long_double(long double value)
+{
+    double hi = static_cast<double>(value);
+    return { hi, static_cast<double>(value - hi) };
+}
+
+inline long double dd_to_long_double(DoubleDouble value)
+{
+    return static_cast<long double>(value.hi) + value.lo;
+}
+
+/// Running sum whose error doesn't grow with the amount of terms, like
+/// Kahan summation, with the running error kept as the low half
+class CompensatedSum {
+    DoubleDouble total = { 0, 0 };
+
+public:
+    inline void add(double value)
+    {
+        DoubleDouble sum = two_sum(total.hi, value);
+        total = quick_two_sum(sum.hi, sum.lo + total.lo);
+    }
+
+    inline void add(DoubleDouble value) { total = dd_add_accurate(total, value); }
+
+    inline DoubleDouble parts() const { return total; }
+    inline double value() const { return total.hi + total.lo; }
+
+    /// Sum of `count` values
+    template <typename T>
+    static DoubleDouble of(const T* values, std::size_t count)
+    {
+        CompensatedSum sum;
+        for (std::size_t i = 0; i < count; i++)
+            sum.add(static_cast<double>(values[i]));
+        return sum.parts();
+    }
+};
@@ -0,0 +1,411 @@
+#pragma once
+
+/* Per rank timeline of the phases of a run, and counters of the work done.
+
+A phase is a scope timed with MPI_Wtime:
+
+    {
+        INSTRUMENT_PHASE("broadcast", communication);
+        MPI_Bcast(...);
+    }
+    INSTRUMENT_COUNT("numbers tested", end - start);
+
+Phases are compute, communication (time spent in MPI, including waiting
+for the other ranks) or io. Counters are named sums, e.g. bytes sent or
+FLOPs. Both are recorded by the main thread only, the one that calls MPI.
+
+At the end `Instrumentation::report` gathers every rank's records on the
+root. It can write a Chrome trace (chrome://tracing, ui.perfetto.dev), with
+one process per rank, and print a summary: per phase the mean and max over
+the ranks, per rank compute vs communication vs io, and the max/mean ratio
+(1 is a perfect balance) of each phase and counter.
+
+Times are relative to `INSTRUMENT_START`, which every rank leaves
+together from a barrier, so the clocks of different nodes line up to within
+its latency.
+
+Compiling with -DDISABLE_INSTRUMENTATION turns the macros into nothing.
+*/
+
+#include "mpi_utils.h"
+#include "options.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mpi/mpi.h>
+#include <string>
+#include <vector>
+
+enum class PhaseKind : uint32_t {
+    compute,
+    communication,
+    io
+};
+
+constexpr const char* PHASE_KIND_NAMES[] = { "compute", "communication", "io" };
+
+struct PhaseEvent {
+    const char* name; // A string literal
+    PhaseKind kind;
+    double start;
+    double end;
+};
+
+class Instrumentation {
+    double origin = 0.0;
+    std::vector<PhaseEvent> events;
+    std::vector<std::pair<const char*, double>> counters;
+
+    /// Per rank records, as the root receives them
+    struct RankRecords {
+        std::vector<std::string> names;
+        std::vector<PhaseKind> kinds;
+        std::vector<double> times; // Start and end of every event
+        std::vector<std::string> counter_names;
+        std::vector<double> counter_values;
+    };
+
+    template <typename T>
+    static void append(std::vector<char>& bytes, const T* values, std::size_t count)
+    {
+        const char* data = reinterpret_cast<const char*>(values);
+        bytes.insert(bytes.end(), data, data + count * sizeof(T));
+    }
+
+    template <typename T>
+    static void extract(const char*& data, std::vector<T>& values, std::size_t count)
+    {
+        values.resize(count);
+        memcpy(values.data(), data, count * sizeof(T));
+        data += count * sizeof(T);
+    }
+
+    static std::vector<char> extract_bytes(const char*& data)
+    {
+        uint64_t size;
+        memcpy(&size, data, sizeof(size));
+        data += sizeof(size);
+        std::vector<char> bytes(data, data + size);
+        data += size;
+        return bytes;
+    }
+
+    std::vector<char> pack() const
+    {
+        std::vector<std::string> names, counter_names;
+        std::vector<uint32_t> kinds;
+        std::vector<double> times, counter_values;
+        for (const PhaseEvent& event : events) {
+            names.push_back(event.name);
+            kinds.push_back(static_cast<uint32_t>(event.kind));
+            times.push_back(event.start);
+            times.push_back(event.end);
+        }
+        for (const auto& counter : counters) {
+            counter_names.push_back(counter.first);
+            counter_values.push_back(counter.second);
+        }
+
+        std::vector<char> bytes;
+        uint64_t sizes[2] = { events.size(), counters.size() };
+        append(bytes, sizes, 2);
+        append(bytes, kinds.data(), kinds.size());
+        append(bytes, times.data(), times.size());
+        append(bytes, counter_values.data(), counter_values.size());
+        for (const std::vector<char>& packed : { pack_strings(names.data(), names.data() + names.size()),
+                 pack_strings(counter_names.data(), counter_names.data() + counter_names.size()) }) {
+            uint64_t size = packed.size();
+            append(bytes, &size, 1);
+            append(bytes, packed.data(), packed.size());
+        }
+        return bytes;
+    }
+
+    static RankRecords unpack(const char* data)
+    {
+        RankRecords records;
+        std::vector<uint64_t> sizes;
+        extract(data, sizes, 2);
+        std::vector<uint32_t> kinds;
+        extract(data, kinds, sizes[0]);
+        for (uint32_t kind : kinds)
+            records.kinds.push_back(static_cast<PhaseKind>(kind));
+        extract(data, records.times, 2 * sizes[0]);
+        extract(data, records.counter_values, sizes[1]);
+        records.names = unpack_strings(extract_bytes(data));
+        records.counter_names = unpack_strings(extract_bytes(data));
+        return records;
+    }
+
+    /// Escapes `text` for a JSON string
+    static std::string json_string(const std::string& text)
+    {
+        std::string escaped = "\"";
+        for (char c : text) {
+            if (c == '"' || c == '\\')
+                escaped += '\\';
+            escaped += c;
+        }
+        return escaped + "\"";
+    }
+
+    static bool write_trace(const std::string& path, const std::vector<RankRecords>& ranks)
+    {
+        std::ofstream file(path);
+        file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        bool first = true;
+        auto separator = [&] {
+            file << (first ? "\n" : ",\n");
+            first = false;
+        };
+        file << std::fixed << std::setprecision(3);
+        for (std::size_t rank = 0; rank < ranks.size(); rank++) {
+            const RankRecords& records = ranks[rank];
+            separator();
+            file << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << rank << ", \"args\": {\"name\": \"rank "
+                 << rank << "\"}}";
+
+            double last_end = 0.0;
+            for (std::size_t i = 0; i < records.names.size(); i++) {
+                double start = records.times[2 * i], end = records.times[2 * i + 1];
+                last_end = std::max(last_end, end);
+                separator();
+                file << "{\"name\": " << json_string(records.names[i]) << ", \"cat\": \""
+                     << PHASE_KIND_NAMES[static_cast<uint32_t>(records.kinds[i])] << "\", \"ph\": \"X\", \"pid\": "
+                     << rank << ", \"tid\": 0, \"ts\": " << start * 1e6 << ", \"dur\": " << (end - start) * 1e6 << "}";
+            }
+            for (std::size_t i = 0; i < records.counter_names.size(); i++) {
+                separator();
+                file << "{\"name\": " << json_string(records.counter_names[i]) << ", \"ph\": \"C\", \"pid\": " << rank
+                     << ", \"ts\": " << last_end * 1e6 << ", \"args\": {\"value\": " << records.counter_values[i] << "}}";
+            }
+        }
+        file << "\n]}\n";
+        return static_cast<bool>(file);
+    }
+
+    /// Prints one row: the mean and max over the ranks of `values`, and their ratio
+    static void print_spread(const std::string& name, const std::vector<double>& values)
+    {
+        double sum = 0.0, max = 0.0;
+        for (double value : values) {
+            sum += value;
+            max = std::max(max, value);
+        }
+        double mean = sum / values.size();
+        std::cout << "  " << std::left << std::setw(28) << name << std::right << std::setw(14) << mean << std::setw(14)
+                  << max << std::setw(10) << (mean > 0.0 ? max / mean : 1.0) << "\n";
+    }
+
+    static void print_summary(const std::vector<RankRecords>& ranks)
+    {
+        // Per phase and counter name, in the order they first appear, the total of every rank
+        std::vector<std::string> phase_names, counter_names;
+        std::vector<std::vector<double>> phase_totals, counter_totals;
+        std::vector<std::vector<double>> kind_totals(ranks.size(), std::vector<double>(3, 0.0));
+        auto slot = [&](std::vector<std::string>& names, std::vector<std::vector<double>>& totals, const std::string& name) {
+            std::size_t index = std::find(names.begin(), names.end(), name) - names.begin();
+            if (index == names.size()) {
+                names.push_back(name);
+                totals.emplace_back(ranks.size(), 0.0);
+            }
+            return index;
+        };
+
+        for (std::size_t rank = 0; rank < ranks.size(); rank++) {
+            const RankRecords& records = ranks[rank];
+            for (std::size_t i = 0; i < records.names.size(); i++) {
+                double duration = records.times[2 * i + 1] - records.times[2 * i];
+                phase_totals[slot(phase_names, phase_totals, records.names[i])][rank] += duration;
+                kind_totals[rank][static_cast<uint32_t>(records.kinds[i])] += duration;
+            }
+            for (std::size_t i = 0; i < records.counter_names.size(); i++)
+                counter_totals[slot(counter_names, counter_totals, records.counter_names[i])][rank] += records.counter_values[i];
+        }
+
+        auto print_header = [](const char* title) {
+            std::cout << std::left << std::setw(30) << title << std::right << std::setw(14) << "mean" << std::setw(14)
+                      << "max" << std::setw(10) << "max/mean" << "\n";
+        };
+
+        std::cout << std::setprecision(6);
+        print_header("Phases (s)");
+        for (std::size_t i = 0; i < phase_names.size(); i++)
+            print_spread(phase_names[i], phase_totals[i]);
+        for (uint32_t kind = 0; kind < 3; kind++) {
+            std::vector<double> values;
+            for (const std::vector<double>& totals : kind_totals)
+                values.push_back(totals[kind]);
+            print_spread(std::string("all ") + PHASE_KIND_NAMES[kind], values);
+        }
+
+        if (!counter_names.empty()) {
+            print_header("Counters");
+            for (std::size_t i = 0; i < counter_names.size(); i++)
+                print_spread(counter_names[i], counter_totals[i]);
+        }
+
+        std::cout << std::left << std::setw(17) << "Per rank (s)" << std::right << std::setw(14) << "compute"
+                  << std::setw(15) << "communication" << std::setw(14) << "io" << std::setw(10) << "waiting" << "\n";
+        for (std::size_t rank = 0; rank < ranks.size(); rank++) {
+            const std::vector<double>& totals = kind_totals[rank];
+            double total = totals[0] + totals[1] + totals[2];
+            std::cout << "  rank " << std::left << std::setw(10) << rank << std::right << std::setw(14) << totals[0]
+                      << std::setw(15) << totals[1] << std::setw(14) << totals[2] << std::setw(9)
+                      << std::setprecision(3) << (total > 0.0 ? 100.0 * totals[1] / total : 0.0) << "%"
+                      << std::setprecision(6) << "\n";
+        }
+        std::cout << std::flush;
+    }
+
+public:
+    /// Records of the calling process
+    static Instrumentation& instance()
+    {
+        static Instrumentation instrumentation;
+        return instrumentation;
+    }
+
+    /// Starts the clock of every rank of `comm` at the same time. Collective
+    void start(MPI_Comm comm)
+    {
+        MPI_Barrier(comm);
+        origin = MPI_Wtime();
+        events.clear();
+        counters.clear();
+    }
+
+    inline double now() const { return MPI_Wtime() - origin; }
+
+    inline void record(const char* name, PhaseKind kind, double start, double end)
+    {
+        events.push_back({ name, kind, start, end });
+    }
+
+    inline void add(const char* counter, double amount)
+    {
+        for (auto& entry : counters) {
+            if (entry.first == counter || strcmp(entry.first, counter) == 0) {
+                entry.second += amount;
+                return;
+            }
+        }
+        counters.emplace_back(counter, amount);
+    }
+
+    /// Gathers the records of every rank on `root`, which writes them into
+    /// `trace_path` (unless null) and prints the summary when `summary` is
+    /// set. Collective, returns whether the trace was written
+    bool report(const char* trace_path, bool summary, int root, MPI_Comm comm) const
+    {
+        int rank, size;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+
+#ifdef DISABLE_INSTRUMENTATION
+        if (rank == root)
+            std::cerr << "Instrumentation was disabled at compile time, there is nothing to report" << std::endl;
+        return false;
+#endif
+
+        const std::vector<char> bytes = pack();
+        int32_t byte_count = bytes.size();
+        std::vector<int32_t> counts(rank == root ? size : 0), displacements(rank == root ? size : 0);
+        MPI_Gather(&byte_count, 1, MPI_INT32_T, counts.data(), 1, MPI_INT32_T, root, comm);
+
+        std::vector<char> all_bytes;
+        if (rank == root) {
+            int32_t offset = 0;
+            for (int i = 0; i < size; i++) {
+                displacements[i] = offset;
+                offset += counts[i];
+            }
+            all_bytes.resize(offset);
+        }
+        MPI_Gatherv(bytes.data(), byte_count, MPI_CHAR, all_bytes.data(), counts.data(), displacements.data(), MPI_CHAR, root, comm);
+
+        if (rank != root)
+            return true;
+
+        std::vector<RankRecords> ranks;
+        for (int i = 0; i < size; i++)
+            ranks.push_back(unpack(all_bytes.data() + displacements[i]));
+
+        if (summary)
+            print_summary(ranks);
+        if (trace_path) {
+            if (!write_trace(trace_path, ranks)) {
+                std::cerr << "Error writing " << trace_path << std::endl;
+                return false;
+            }
+            std::cout << "Trace written to " << trace_path << std::endl;
+        }
+        return true;
+    }
+};
+
+/// Records the phase `name` from its construction to its destruction
+class ScopedPhase {
+    const char* name;
+    PhaseKind kind;
+    double start;
+
+public:
+    ScopedPhase(const char* name, PhaseKind kind)
+        : name(name)
+        , kind(kind)
+        , start(Instrumentation::instance().now())
+    {
+    }
+
+    ~ScopedPhase()
+    {
+        Instrumentation& instrumentation = Instrumentation::instance();
+        instrumentation.record(name, kind, start, instrumentation.now());
+    }
+};
+
+#ifdef DISABLE_INSTRUMENTATION
+#define INSTRUMENT_START(comm) ((void)0)
+#define INSTRUMENT_PHASE(name, kind) ((void)0)
+#define INSTRUMENT_COUNT(counter, amount) ((void)0)
+#else
+#define INSTRUMENT_CONCATENATE_(a, b) a##b
+#define INSTRUMENT_CONCATENATE(a, b) INSTRUMENT_CONCATENATE_(a, b)
+/// Starts the clocks, right after MPI is initialized. Collective
+#define INSTRUMENT_START(comm) Instrumentation::instance().start(comm)
+/// Times the rest of the enclosing scope as the phase `name` of kind
+/// compute, communication or io
+#define INSTRUMENT_PHASE(name, kind) \
+    ScopedPhase INSTRUMENT_CONCATENATE(instrumented_phase_, __LINE__)(name, PhaseKind::kind)
+/// Adds `amount` to the counter `name`
+#define INSTRUMENT_COUNT(counter, amount) Instrumentation::instance().add(counter, static_cast<double>(amount))
+#endif
+
+/// The --trace FILE and --profile options every program takes
+struct InstrumentationOptions {
+    const char* trace_path = nullptr;
+    bool profile = false;
+
+    inline bool requested() const { return trace_path || profile; }
+
+    /// Reports if the options ask for it. Collective
+    void report(int root, MPI_Comm comm) const
+    {
+        if (requested())
+            Instrumentation::instance().report(trace_path, profile || !trace_path, root, comm);
+    }
+};
+
+/// Takes the --trace and --profile options out of argv
+inline InstrumentationOptions take_instrumentation_options(int& argc, char** argv)
+{
+    InstrumentationOptions options;
+    options.trace_path = take_option(argc, argv, "--trace");
+    options.profile = take_flag(argc, argv, "--profile");
+    return options;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <mpi/mpi.h>
+#include <string>
+#include <vector>
+
+/// Broadcasts a string from `root`. The other ranks resize theirs to fit
+inline void broadcast_string(std::string& value, int root, MPI_Comm comm)
+{
+    // Broadcast the length of the string first
+    uint64_t length = value.size();
+    MPI_Bcast(&length, 1, MPI_UINT64_T, root, comm);
+
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (rank != root)
+        value.resize(length);
+
+    // Broadcast the actual string data (as a char array)
+    MPI_Bcast(&value[0], length, MPI_CHAR, root, comm);
+}
+
+/// Broadcasts a list of strings from `root` as their lengths followed by all
+/// their bytes back to back. The other ranks replace theirs
+inline void broadcast_strings(std::vector<std::string>& values, int root, MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    uint64_t count = values.size();
+    MPI_Bcast(&count, 1, MPI_UINT64_T, root, comm);
+
+    std::vector<uint64_t> lengths(count);
+    std::string data;
+    if (rank == root) {
+        for (uint64_t i = 0; i < count; i++) {
+            lengths[i] = values[i].size();
+            data += values[i];
+        }
+    }
+    MPI_Bcast(lengths.data(), count, MPI_UINT64_T, root, comm);
+    broadcast_string(data, root, comm);
+
+    if (rank != root) {
+        values.clear();
+        uint64_t offset = 0;
+        for (uint64_t length : lengths) {
+            values.push_back(data.substr(offset, length));
+            offset += length;
+        }
+    }
+}
+
+/// Packs strings into one message: their count and lengths (uint32) followed
+/// by all their bytes back to back. No padding, so mixed lengths cost nothing
+inline std::vector<char> pack_strings(const std::string* first, const std::string* last)
+{
+    std::vector<uint32_t> header;
+    header.push_back(last - first);
+    for (const std::string* value = first; value != last; value++)
+        header.push_back(value->size());
+
+    std::vector<char> packed(header.size() * sizeof(uint32_t));
+    memcpy(packed.data(), header.data(), packed.size());
+    for (const std::string* value = first; value != last; value++)
+        packed.insert(packed.end(), value->begin(), value->end());
+    return packed;
+}
+
+/// Reverse of `pack_strings`. An empty message holds no strings
+inline std::vector<std::string> unpack_strings(const std::vector<char>& packed)
+{
+    std::vector<std::string> values;
+    if (packed.size() < sizeof(uint32_t))
+        return values;
+
+    uint32_t count;
+    memcpy(&count, packed.data(), sizeof(count));
+
+    const char* lengths = packed.data() + sizeof(uint32_t);
+    const char* data = lengths + count * sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t length;
+        memcpy(&length, lengths + i * sizeof(uint32_t), sizeof(length));
+        values.emplace_back(data, length);
+        data += length;
+    }
+    return values;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+/* Helpers for optional command line flags. They remove what they consume from
+argv, so each program can keep validating its positional arguments with a plain
+`argc` check afterwards.
+*/
+
+#include <cstring>
+
+/// Removes `argv[index]` and the `count - 1` arguments after it
+inline void remove_arguments(int& argc, char** argv, int index, int count)
+{
+    for (int i = index; i + count <= argc; i++)
+        argv[i] = argv[i + count];
+    argc -= count;
+}
+
+/// Returns whether the flag `name` was present, removing it from argv
+inline bool take_flag(int& argc, char** argv, const char* name)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            remove_arguments(argc, argv, i, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Returns the value that follows `name` (e.g. `--threads 8`) or `nullptr`
+/// when the option is missing. Both are removed from argv
+inline const char* take_option(int& argc, char** argv, const char* name)
+{
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            const char* value = argv[i + 1];
+            remove_arguments(argc, argv, i, 2);
+            return value;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+/* Sums over the ranks of a communicator, with MPI_Reduce and MPI_Allreduce
+so that they take O(log p) steps instead of a gather into the root and a
+loop over p values.
+
+Integer sums are exact in any order. Floating point values are summed as
+double-doubles (see double_double.h) with a user-defined operation, so the
+rounding of every partial sum stays about 2^-106 of the total and the float,
+double or long double result is correctly rounded but in extreme
+cancellations. The operation is declared non-commutative, which obliges MPI
+to combine the ranks in their order: with the same amount of ranks, a run
+gives the same bits as every other one.
+*/
+
+#include "double_double.h"
+
+#include <cstdint>
+#include <mpi/mpi.h>
+#include <type_traits>
+
+/// MPI datatype of T. The fixed width integers map to their exact MPI types,
+/// instead of MPI_LONG_LONG and friends whose width depends on the platform
+template <typename T>
+inline MPI_Datatype mpi_datatype();
+
+template <>
+inline MPI_Datatype mpi_datatype<int32_t>() { return MPI_INT32_T; }
+template <>
+inline MPI_Datatype mpi_datatype<uint32_t>() { return MPI_UINT32_T; }
+template <>
+inline MPI_Datatype mpi_datatype<int64_t>() { return MPI_INT64_T; }
+template <>
+inline MPI_Datatype mpi_datatype<uint64_t>() { return MPI_UINT64_T; }
+template <>
+inline MPI_Datatype mpi_datatype<float>() { return MPI_FLOAT; }
+template <>
+inline MPI_Datatype mpi_datatype<double>() { return MPI_DOUBLE; }
+template <>
+inline MPI_Datatype mpi_datatype<long double>() { return MPI_LONG_DOUBLE; }
+
+/// The double-double type, two contiguous doubles. Created once
+inline MPI_Datatype double_double_datatype()
+{
+    static const MPI_Datatype datatype = [] {
+        MPI_Datatype contiguous;
+        MPI_Type_contiguous(2, MPI_DOUBLE, &contiguous);
+        MPI_Type_commit(&contiguous);
+        return contiguous;
+    }();
+    return datatype;
+}
+
+/// inout[i] = in[i] + inout[i], MPI passes the lower ranks as `in`
+inline void double_double_sum(void* in, void* inout, int* length, MPI_Datatype*)
+{
+    const DoubleDouble* lower = static_cast<const DoubleDouble*>(in);
+    DoubleDouble* upper = static_cast<DoubleDouble*>(inout);
+    for (int i = 0; i < *length; i++)
+        upper[i] = dd_add_accurate(lower[i], upper[i]);
+}
+
+/// Double-double sum, non-commutative so the ranks are combined in order. Created once
+inline MPI_Op double_double_sum_op()
+{
+    static const MPI_Op op = [] {
+        MPI_Op created;
+        MPI_Op_create(double_double_sum, 0, &created);
+        return created;
+    }();
+    return op;
+}
+
+/// Sum of the `value` of every rank, on `root`. The other ranks get an unspecified value
+inline DoubleDouble reduce_sum(DoubleDouble value, int root, MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    DoubleDouble sum = { 0, 0 };
+    MPI_Reduce(&value, &sum, 1, double_double_datatype(), double_double_sum_op(), root, comm);
+    return rank == root ? sum : value;
+}
+
+/// Sum of the `value` of every rank, on every rank
+inline DoubleDouble allreduce_sum(DoubleDouble value, MPI_Comm comm)
+{
+    DoubleDouble sum;
+    MPI_Allreduce(&value, &sum, 1, double_double_datatype(), double_double_sum_op(), comm);
+    return sum;
+}
+
+/// Sum of the `value` of every rank, on `root`. Floating point values are
+/// added as double-doubles and rounded once. The other ranks get an
+/// unspecified value
+template <typename T>
+inline T reduce_sum(T value, int root, MPI_Comm comm)
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        return static_cast<T>(dd_to_long_double(reduce_sum(dd_from_long_double(value), root, comm)));
+    } else {
+        int rank;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Reduce(rank == root ? MPI_IN_PLACE : &value, &value, 1, mpi_datatype<T>(), MPI_SUM, root, comm);
+        return value;
+    }
+}
+
+/// Sum of the `value` of every rank, on every rank
+template <typename T>
+inline T allreduce_sum(T value, MPI_Comm comm)
+{
+    if constexpr (std::is_floating_point<T>::value) {
+        return static_cast<T>(dd_to_long_double(allreduce_sum(dd_from_long_double(value), comm)));
+    } else {
+        MPI_Allreduce(MPI_IN_PLACE, &value, 1, mpi_datatype<T>(), MPI_SUM, comm);
+        return value;
+    }
+}
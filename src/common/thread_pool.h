@@ -0,0 +1,240 @@
+#pragma once
+
+/* Work stealing thread pool shared by the programs, so a single rank per node
+(or per socket) can use every core instead of launching one rank per core.
+
+Each thread owns a deque of tasks. Owners pop from the back (most recently
+pushed, still hot in cache) and idle threads steal from the front of the other
+deques, which balances ranges whose cost is uneven (e.g. larger numbers are
+slower to test for primality).
+
+Only the thread that called MPI_Init_thread runs MPI calls
+(MPI_THREAD_FUNNELED); the workers only ever compute.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+    using Task = std::function<void()>;
+
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // Queue 0 belongs to the thread that calls `parallel_for`, the rest to the workers
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<std::size_t> queued_tasks { 0 };
+    std::mutex sleep_mutex;
+    std::condition_variable wake_up;
+    bool stopping = false;
+
+    // Cores the calling thread could run on before the pool pinned it
+    cpu_set_t process_cpus;
+
+    static inline thread_local bool s_inside_worker = false;
+
+public:
+    /// `thread_count` includes the calling thread. 0 uses every core the
+    /// process is allowed to run on
+    explicit ThreadPool(std::size_t thread_count, bool pin_threads = true)
+    {
+        CPU_ZERO(&process_cpus);
+        if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) != 0)
+            CPU_ZERO(&process_cpus);
+
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &process_cpus))
+                cpus.push_back(cpu);
+        }
+        if (thread_count == 0)
+            thread_count = cpus.empty() ? std::thread::hardware_concurrency() : cpus.size();
+        if (thread_count == 0)
+            thread_count = 1;
+
+        for (std::size_t i = 0; i < thread_count; i++)
+            queues.push_back(std::make_unique<TaskQueue>());
+
+        for (std::size_t i = 1; i < thread_count; i++) {
+            workers.emplace_back([this, i] { worker_loop(i); });
+            if (pin_threads && !cpus.empty())
+                pin(workers.back().native_handle(), cpus[i % cpus.size()]);
+        }
+
+        // The calling thread is pinned last, otherwise the workers would inherit its mask
+        if (pin_threads && thread_count > 1 && !cpus.empty())
+            pin(pthread_self(), cpus[0]);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake_up.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Lets `thread` run on every core the process could before the pool
+    /// pinned the calling thread. Threads the caller starts later (e.g. a read
+    /// ahead thread) would otherwise inherit its single core and compete with
+    /// the pool's first thread
+    void unpin(pthread_t thread) const
+    {
+        if (CPU_COUNT(&process_cpus) > 0)
+            pthread_setaffinity_np(thread, sizeof(process_cpus), &process_cpus);
+    }
+
+    /// Amount of threads that run tasks, including the calling thread
+    inline std::size_t size() const { return queues.size(); }
+
+    /// Runs `body(chunk_begin, chunk_end)` over [begin, end) split in chunks of
+    /// at most `grain` elements, and returns once every chunk is done. The
+    /// calling thread works on the chunks too. Calls made from inside a task
+    /// run serially
+    template <typename F>
+    void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, F&& body)
+    {
+        if (begin >= end)
+            return;
+        if (grain == 0)
+            grain = 1;
+
+        // Serial calls keep the chunks too, callers size their buffers by `grain`
+        std::size_t chunk_count = (end - begin + grain - 1) / grain;
+        if (size() == 1 || chunk_count == 1 || s_inside_worker) {
+            std::size_t chunk_begin = begin;
+            for (; end - chunk_begin > grain; chunk_begin += grain)
+                body(chunk_begin, chunk_begin + grain);
+            body(chunk_begin, end);
+            return;
+        }
+
+        std::atomic<std::size_t> remaining { chunk_count };
+        queued_tasks.fetch_add(chunk_count);
+
+        // Consecutive chunks go to the same queue, so neighbouring data stays on
+        // one thread unless it gets stolen
+        std::size_t chunks_per_queue = (chunk_count + size() - 1) / size();
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++) {
+            std::size_t chunk_begin = begin + chunk * grain;
+            std::size_t chunk_end = std::min(end, chunk_begin + grain);
+            TaskQueue& queue = *queues[chunk / chunks_per_queue];
+
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.emplace_back([&body, &remaining, chunk_begin, chunk_end] {
+                body(chunk_begin, chunk_end);
+                remaining.fetch_sub(1, std::memory_order_release);
+            });
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake_up.notify_all();
+
+        s_inside_worker = true;
+        Task task;
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            if (take_task(0, task))
+                task();
+            else
+                std::this_thread::yield();
+        }
+        s_inside_worker = false;
+    }
+
+    /// Pool used by the programs, 1 thread unless `configure` was called
+    static ThreadPool& instance()
+    {
+        std::unique_ptr<ThreadPool>& pool = instance_slot();
+        if (!pool)
+            pool = std::make_unique<ThreadPool>(1);
+        return *pool;
+    }
+
+    /// Replaces the shared pool. Must be called before any task is running
+    static void configure(std::size_t thread_count, bool pin_threads = true)
+    {
+        instance_slot().reset();
+        instance_slot() = std::make_unique<ThreadPool>(thread_count, pin_threads);
+    }
+
+private:
+    static std::unique_ptr<ThreadPool>& instance_slot()
+    {
+        static std::unique_ptr<ThreadPool> pool;
+        return pool;
+    }
+
+    static void pin(pthread_t thread, int cpu)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(thread, sizeof(set), &set);
+    }
+
+    /// Pops from the back of the own queue, otherwise steals from the front of another
+    bool take_task(std::size_t index, Task& task)
+    {
+        {
+            TaskQueue& own = *queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued_tasks.fetch_sub(1);
+                return true;
+            }
+        }
+
+        for (std::size_t offset = 1; offset < queues.size(); offset++) {
+            TaskQueue& victim = *queues[(index + offset) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued_tasks.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void worker_loop(std::size_t index)
+    {
+        s_inside_worker = true;
+        Task task;
+        while (true) {
+            if (take_task(index, task)) {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake_up.wait(lock, [this] { return stopping || queued_tasks.load() > 0; });
+            if (stopping && queued_tasks.load() == 0)
+                return;
+        }
+    }
+};
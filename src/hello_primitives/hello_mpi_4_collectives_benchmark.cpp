@@ -0,0 +1,558 @@
+/* Compilation
+mpic++ -std=c++17 -O3 -o build/benchmark_collectives src/hello_primitives/hello_mpi_4_collectives_benchmark.cpp
+
+Latency and bandwidth of the MPI collectives the programs use. Where the
+examples before it broadcast and gather a single long long, this one sweeps
+Bcast, Scatter(v), Gather(v), Reduce and Allreduce and their non-blocking
+variants over message sizes from 8 B to 256 MB and over root placements.
+Locally and on the cluster:
+
+    mpirun -np 4 --oversubscribe build/benchmark_collectives
+    mpirun -np 16 --hostfile src/cluster_setup/hostfile build/benchmark_collectives --csv collectives.csv
+
+The size is what every rank contributes or receives, as in the OSU
+benchmarks: the whole buffer of Bcast, Reduce and Allreduce, and the block of
+each rank in Scatter and Gather (Scatterv and Gatherv give rank i about
+2 (i + 1) / (p + 1) blocks). Data are doubles.
+
+Every run starts from a barrier and takes the time of its slowest rank; the
+median and percentiles of the runs are reported. The bus bandwidth divides
+by that time the bytes some rank's link has to carry whatever the algorithm,
+so it compares across collectives and with the link: 1 GbE carries ~117 MB/s
+of payload. The non-blocking variants are also run around a computation as
+long as the collective: their overlap is the part of the communication that
+happened during it, 0% if the library only progresses inside MPI_Wait.
+*/
+
+#include "../common/benchmark.h"
+#include "../common/options.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mpi/mpi.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Bytes moved by the timed runs of each message size, which sets how many there are
+constexpr uint64_t COLLECTIVE_ITERATION_BYTES = 64 << 20;
+constexpr uint32_t COLLECTIVE_MIN_ITERATIONS = 5;
+constexpr uint32_t COLLECTIVE_MAX_ITERATIONS = 1000;
+
+enum class CollectiveKind {
+    bcast,
+    scatter,
+    scatterv,
+    gather,
+    gatherv,
+    reduce,
+    allreduce
+};
+
+struct Collective {
+    const char* name;
+    CollectiveKind kind;
+    bool non_blocking;
+};
+
+constexpr Collective COLLECTIVES[] = {
+    { "bcast", CollectiveKind::bcast, false },
+    { "scatter", CollectiveKind::scatter, false },
+    { "scatterv", CollectiveKind::scatterv, false },
+    { "gather", CollectiveKind::gather, false },
+    { "gatherv", CollectiveKind::gatherv, false },
+    { "reduce", CollectiveKind::reduce, false },
+    { "allreduce", CollectiveKind::allreduce, false },
+    { "ibcast", CollectiveKind::bcast, true },
+    { "iscatter", CollectiveKind::scatter, true },
+    { "iscatterv", CollectiveKind::scatterv, true },
+    { "igather", CollectiveKind::gather, true },
+    { "igatherv", CollectiveKind::gatherv, true },
+    { "ireduce", CollectiveKind::reduce, true },
+    { "iallreduce", CollectiveKind::allreduce, true },
+};
+
+/// Element `index` of the data of `rank`. Small integers, so sums are exact
+inline double element_value(int rank, uint64_t index)
+{
+    return rank * 7 + index % 13;
+}
+
+/// Buffers of one collective for one message size of `count` doubles, filled
+/// so that the result can be checked
+class CollectiveRun {
+    Collective collective;
+    int root;
+    int rank;
+    int size;
+    MPI_Comm comm;
+    uint64_t count;
+    std::vector<int32_t> counts; // Of every rank, for the scatters and gathers
+    std::vector<int32_t> displacements;
+    uint64_t total = 0;
+    std::vector<double> send;
+    std::vector<double> receive;
+
+    inline bool scatters() const
+    {
+        return collective.kind == CollectiveKind::scatter || collective.kind == CollectiveKind::scatterv;
+    }
+
+    inline bool gathers() const
+    {
+        return collective.kind == CollectiveKind::gather || collective.kind == CollectiveKind::gatherv;
+    }
+
+    inline bool reduces() const
+    {
+        return collective.kind == CollectiveKind::reduce || collective.kind == CollectiveKind::allreduce;
+    }
+
+    /// Elements the calling rank has before (send) and after (receive) the collective
+    std::pair<uint64_t, uint64_t> buffer_sizes() const
+    {
+        if (collective.kind == CollectiveKind::bcast)
+            return { 0, count };
+        if (scatters())
+            return { rank == root ? total : 0, static_cast<uint64_t>(counts[rank]) };
+        if (gathers())
+            return { static_cast<uint64_t>(counts[rank]), rank == root ? total : 0 };
+        return { count, collective.kind == CollectiveKind::allreduce || rank == root ? count : 0 };
+    }
+
+public:
+    CollectiveRun(const Collective& collective, int root, uint64_t count, MPI_Comm comm)
+        : collective(collective)
+        , root(root)
+        , comm(comm)
+        , count(count)
+    {
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        counts.resize(size);
+        displacements.resize(size);
+        for (int i = 0; i < size; i++) {
+            bool uneven = collective.kind == CollectiveKind::scatterv || collective.kind == CollectiveKind::gatherv;
+            counts[i] = uneven ? count * 2 * (i + 1) / (size + 1) : count;
+            displacements[i] = total;
+            total += counts[i];
+        }
+    }
+
+    /// Bytes of the buffers of the calling rank
+    inline uint64_t memory_bytes() const
+    {
+        auto [send_count, receive_count] = buffer_sizes();
+        return (send_count + receive_count) * sizeof(double);
+    }
+
+    /// Bytes that some rank has to send or receive, whatever the algorithm
+    double bus_bytes() const
+    {
+        if (scatters() || gathers())
+            return static_cast<double>(total - counts[root]) * sizeof(double);
+        if (collective.kind == CollectiveKind::allreduce)
+            return 2.0 * (size - 1) / size * count * sizeof(double);
+        return static_cast<double>(count) * sizeof(double);
+    }
+
+    /// Allocates the buffers and fills them with the data of the calling rank
+    void fill()
+    {
+        auto [send_count, receive_count] = buffer_sizes();
+        send.assign(send_count, 0.0);
+        receive.assign(receive_count, 0.0);
+
+        if (collective.kind == CollectiveKind::bcast) {
+            if (rank == root) {
+                for (uint64_t i = 0; i < count; i++)
+                    receive[i] = element_value(root, i);
+            }
+        } else if (scatters()) {
+            for (int block = 0; block < size && rank == root; block++) {
+                for (int32_t i = 0; i < counts[block]; i++)
+                    send[displacements[block] + i] = element_value(block, i);
+            }
+        } else {
+            for (uint64_t i = 0; i < send.size(); i++)
+                send[i] = element_value(rank, i);
+        }
+    }
+
+    /// Whether the calling rank received what it should have
+    bool check() const
+    {
+        if (collective.kind == CollectiveKind::bcast || scatters()) {
+            const int source = collective.kind == CollectiveKind::bcast ? root : rank;
+            for (uint64_t i = 0; i < receive.size(); i++) {
+                if (receive[i] != element_value(source, i))
+                    return false;
+            }
+        } else if (gathers()) {
+            for (int block = 0; block < size && rank == root; block++) {
+                for (int32_t i = 0; i < counts[block]; i++) {
+                    if (receive[displacements[block] + i] != element_value(block, i))
+                        return false;
+                }
+            }
+        } else {
+            for (uint64_t i = 0; i < receive.size(); i++) {
+                if (receive[i] != 7.0 * size * (size - 1) / 2 + size * static_cast<double>(i % 13))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    /// Runs the blocking collective, or posts the non-blocking one and returns its request
+    MPI_Request start()
+    {
+        MPI_Request request = MPI_REQUEST_NULL;
+        MPI_Request* pending = collective.non_blocking ? &request : nullptr;
+        const int own = counts[rank];
+
+        switch (collective.kind) {
+        case CollectiveKind::bcast:
+            pending ? MPI_Ibcast(receive.data(), count, MPI_DOUBLE, root, comm, pending)
+                    : MPI_Bcast(receive.data(), count, MPI_DOUBLE, root, comm);
+            break;
+        case CollectiveKind::scatter:
+            pending ? MPI_Iscatter(send.data(), count, MPI_DOUBLE, receive.data(), count, MPI_DOUBLE, root, comm, pending)
+                    : MPI_Scatter(send.data(), count, MPI_DOUBLE, receive.data(), count, MPI_DOUBLE, root, comm);
+            break;
+        case CollectiveKind::scatterv:
+            pending ? MPI_Iscatterv(send.data(), counts.data(), displacements.data(), MPI_DOUBLE, receive.data(), own, MPI_DOUBLE, root, comm, pending)
+                    : MPI_Scatterv(send.data(), counts.data(), displacements.data(), MPI_DOUBLE, receive.data(), own, MPI_DOUBLE, root, comm);
+            break;
+        case CollectiveKind::gather:
+            pending ? MPI_Igather(send.data(), count, MPI_DOUBLE, receive.data(), count, MPI_DOUBLE, root, comm, pending)
+                    : MPI_Gather(send.data(), count, MPI_DOUBLE, receive.data(), count, MPI_DOUBLE, root, comm);
+            break;
+        case CollectiveKind::gatherv:
+            pending ? MPI_Igatherv(send.data(), own, MPI_DOUBLE, receive.data(), counts.data(), displacements.data(), MPI_DOUBLE, root, comm, pending)
+                    : MPI_Gatherv(send.data(), own, MPI_DOUBLE, receive.data(), counts.data(), displacements.data(), MPI_DOUBLE, root, comm);
+            break;
+        case CollectiveKind::reduce:
+            pending ? MPI_Ireduce(send.data(), receive.data(), count, MPI_DOUBLE, MPI_SUM, root, comm, pending)
+                    : MPI_Reduce(send.data(), receive.data(), count, MPI_DOUBLE, MPI_SUM, root, comm);
+            break;
+        case CollectiveKind::allreduce:
+            pending ? MPI_Iallreduce(send.data(), receive.data(), count, MPI_DOUBLE, MPI_SUM, comm, pending)
+                    : MPI_Allreduce(send.data(), receive.data(), count, MPI_DOUBLE, MPI_SUM, comm);
+            break;
+        }
+        return request;
+    }
+};
+
+/// Busy work for `seconds` that never calls into MPI, standing for the
+/// computation a non-blocking collective overlaps with
+void compute_for(double seconds)
+{
+    const double start = MPI_Wtime();
+    double value = 1.0;
+    while (MPI_Wtime() - start < seconds) {
+        for (int i = 0; i < 1000; i++)
+            value = value * 1.000000001 + 1e-9;
+    }
+    do_not_optimize(value);
+}
+
+/// Times `iterations` runs after `warmup` untimed ones, every one started by
+/// all the ranks together from a barrier, with `compute_seconds` of
+/// computation between posting and waiting. On rank 0 returns the time of
+/// the slowest rank of every run, sorted
+std::vector<double> time_runs(CollectiveRun& run, uint32_t warmup, uint32_t iterations, double compute_seconds, MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    std::vector<double> seconds;
+    for (uint32_t i = 0; i < warmup + iterations; i++) {
+        MPI_Barrier(comm);
+        const double start = MPI_Wtime();
+        MPI_Request request = run.start();
+        if (compute_seconds > 0)
+            compute_for(compute_seconds);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        const double elapsed = MPI_Wtime() - start;
+        if (i >= warmup)
+            seconds.push_back(elapsed);
+    }
+
+    MPI_Reduce(rank == 0 ? MPI_IN_PLACE : seconds.data(), seconds.data(), iterations, MPI_DOUBLE, MPI_MAX, 0, comm);
+    std::sort(seconds.begin(), seconds.end());
+    return seconds;
+}
+
+struct CollectiveResult {
+    BenchmarkResult timing; // Items are the bus bytes
+    std::string collective;
+    int root; // -1 for Allreduce
+    uint64_t bytes;
+    double overlap; // Percent, negative for the blocking collectives
+    bool verified;
+};
+
+/// Parses a byte count with an optional binary K, M or G suffix, e.g. "256M"
+bool parse_size(const char* text, uint64_t& bytes)
+{
+    char* end;
+    bytes = strtoull(text, &end, 10);
+    if (end == text)
+        return false;
+    const std::string suffix = end;
+    if (suffix == "K" || suffix == "KB" || suffix == "KiB")
+        bytes <<= 10;
+    else if (suffix == "M" || suffix == "MB" || suffix == "MiB")
+        bytes <<= 20;
+    else if (suffix == "G" || suffix == "GB" || suffix == "GiB")
+        bytes <<= 30;
+    else if (!suffix.empty() && suffix != "B")
+        return false;
+    return true;
+}
+
+/// Bytes with a binary prefix, e.g. "64 KiB"
+std::string format_bytes(uint64_t bytes)
+{
+    const char* units[] = { "B", "KiB", "MiB", "GiB" };
+    int unit = 0;
+    while (bytes >= 1024 && bytes % 1024 == 0 && unit < 3) {
+        bytes /= 1024;
+        unit++;
+    }
+    return std::to_string(bytes) + " " + units[unit];
+}
+
+/// Splits `text` at its commas
+std::vector<std::string> split_list(const std::string& text)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+/// Ranks of the root placements "first", "middle", "last" or rank numbers, without repetitions
+bool parse_roots(const std::string& text, int size, std::vector<int>& roots)
+{
+    for (const std::string& item : split_list(text)) {
+        int root;
+        if (item == "first")
+            root = 0;
+        else if (item == "middle")
+            root = size / 2;
+        else if (item == "last")
+            root = size - 1;
+        else {
+            char* end;
+            root = strtol(item.c_str(), &end, 10);
+            if (item.empty() || *end != '\0' || root < 0 || root >= size)
+                return false;
+        }
+        if (std::find(roots.begin(), roots.end(), root) == roots.end())
+            roots.push_back(root);
+    }
+    return !roots.empty();
+}
+
+/// Prints how the ranks are spread over the hosts, which decides what the links carry
+void print_layout(int rank, int size)
+{
+    char name[MPI_MAX_PROCESSOR_NAME] = {};
+    int length;
+    MPI_Get_processor_name(name, &length);
+
+    std::vector<char> names(rank == 0 ? size * MPI_MAX_PROCESSOR_NAME : 0);
+    MPI_Gather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR, names.data(), MPI_MAX_PROCESSOR_NAME, MPI_CHAR, 0, MPI_COMM_WORLD);
+    if (rank != 0)
+        return;
+
+    std::map<std::string, std::vector<int>> hosts;
+    for (int i = 0; i < size; i++)
+        hosts[names.data() + i * MPI_MAX_PROCESSOR_NAME].push_back(i);
+    std::cout << size << " processes on " << hosts.size() << " hosts\n";
+    for (const auto& [host, ranks] : hosts) {
+        std::cout << "  " << host << ": ranks";
+        for (int host_rank : ranks)
+            std::cout << " " << host_rank;
+        std::cout << "\n";
+    }
+}
+
+void print_header()
+{
+    std::cout << std::left << std::setw(12) << "collective" << std::setw(6) << "root" << std::right << std::setw(10)
+              << "size" << std::setw(7) << "runs" << std::setw(12) << "median" << std::setw(12) << "p10" << std::setw(12)
+              << "p90" << std::setw(14) << "bus bw" << std::setw(9) << "overlap" << "\n";
+}
+
+void print_result(const CollectiveResult& result)
+{
+    std::ostringstream overlap;
+    if (result.overlap >= 0)
+        overlap << std::fixed << std::setprecision(0) << result.overlap << "%";
+    const BenchmarkResult& timing = result.timing;
+    std::cout << std::left << std::setw(12) << result.collective << std::setw(6)
+              << (result.root < 0 ? std::string("-") : std::to_string(result.root)) << std::right << std::setw(10)
+              << format_bytes(result.bytes) << std::setw(7) << timing.seconds.size() << std::setw(12)
+              << format_duration(timing.median()) << std::setw(12) << format_duration(timing.percentile(0.1))
+              << std::setw(12) << format_duration(timing.percentile(0.9)) << std::setw(14)
+              << format_scaled(timing.throughput()) + "B/s" << std::setw(9) << overlap.str()
+              << (result.verified ? "" : "  WRONG RESULT") << std::endl;
+}
+
+bool write_csv(const std::string& path, const std::vector<CollectiveResult>& results, const std::string& label, int size)
+{
+    std::ofstream file(path);
+    file << "label,collective,root,processes,bytes,iterations,median_s,p10_s,p90_s,min_s,max_s,bus_bytes_per_s,"
+            "overlap_percent,verified\n";
+    for (const CollectiveResult& result : results) {
+        const BenchmarkResult& timing = result.timing;
+        file << label << "," << result.collective << "," << result.root << "," << size << "," << result.bytes << ","
+             << timing.seconds.size() << "," << std::setprecision(9) << timing.median() << "," << timing.percentile(0.1)
+             << "," << timing.percentile(0.9) << "," << timing.seconds.front() << "," << timing.seconds.back() << ","
+             << timing.throughput() << "," << (result.overlap >= 0 ? std::to_string(result.overlap) : "") << ","
+             << result.verified << "\n";
+    }
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char** argv)
+{
+    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
+        std::cout << "Error while initializing MPI" << std::endl;
+        return 1;
+    }
+
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Every rank receives the same arguments, so they are parsed locally
+    const char* collectives_option = take_option(argc, argv, "--collectives");
+    const char* roots_option = take_option(argc, argv, "--roots");
+    const char* min_size_option = take_option(argc, argv, "--min-size");
+    const char* max_size_option = take_option(argc, argv, "--max-size");
+    const char* iterations_option = take_option(argc, argv, "--iterations");
+    const char* warmup_option = take_option(argc, argv, "--warmup");
+    const char* max_memory_option = take_option(argc, argv, "--max-memory");
+    const char* label_option = take_option(argc, argv, "--label");
+    const char* csv_option = take_option(argc, argv, "--csv");
+
+    std::vector<const Collective*> collectives;
+    for (const std::string& name : split_list(collectives_option ? collectives_option : "")) {
+        for (const Collective& collective : COLLECTIVES) {
+            if (name == collective.name)
+                collectives.push_back(&collective);
+        }
+    }
+    if (!collectives_option) {
+        for (const Collective& collective : COLLECTIVES)
+            collectives.push_back(&collective);
+    }
+
+    std::vector<int> roots;
+    uint64_t min_size = 8, max_size = 256 << 20, max_memory = 1ULL << 30;
+    bool valid = argc == 1 && !collectives.empty() && parse_roots(roots_option ? roots_option : "first,last", size, roots)
+        && (!min_size_option || parse_size(min_size_option, min_size))
+        && (!max_size_option || parse_size(max_size_option, max_size))
+        && (!max_memory_option || parse_size(max_memory_option, max_memory))
+        && min_size >= sizeof(double) && min_size <= max_size;
+    if (!valid) {
+        if (rank == 0) {
+            std::cout << "The program expects no arguments. Options:\n"
+                      << "  --collectives LIST  comma separated, of bcast scatter scatterv gather gatherv reduce allreduce\n"
+                      << "                      and their non-blocking versions ibcast iscatter ... iallreduce. All by default\n"
+                      << "  --roots LIST        root placements, first, middle, last or rank numbers (default first,last)\n"
+                      << "  --min-size BYTES    smallest message, with an optional K, M or G suffix (default 8)\n"
+                      << "  --max-size BYTES    largest message, the sizes double from the smallest (default 256M)\n"
+                      << "  --iterations N      timed runs of every size, by default from 5 to 1000 depending on it\n"
+                      << "  --warmup N          untimed runs before them, by default a tenth of them\n"
+                      << "  --max-memory BYTES  skips the sizes whose buffers would take more on a rank (default 1G)\n"
+                      << "  --label TEXT        stored with every result, e.g. the network\n"
+                      << "  --csv FILE          writes the results as CSV" << std::endl;
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    print_layout(rank, size);
+
+    std::vector<CollectiveResult> results;
+    bool verified = true;
+    for (const Collective* collective : collectives) {
+        if (rank == 0) {
+            std::cout << "\n";
+            print_header();
+        }
+        const bool rooted = collective->kind != CollectiveKind::allreduce;
+        for (int root : rooted ? roots : std::vector<int> { 0 }) {
+            for (uint64_t bytes = min_size; bytes <= max_size; bytes *= 2) {
+                CollectiveRun run(*collective, root, bytes / sizeof(double), MPI_COMM_WORLD);
+
+                // Every rank decides the same, from the largest buffers of any rank
+                uint64_t memory = run.memory_bytes();
+                MPI_Allreduce(MPI_IN_PLACE, &memory, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+                if (memory > max_memory) {
+                    if (rank == 0)
+                        std::cout << std::left << std::setw(12) << collective->name << std::setw(6) << root << std::right
+                                  << std::setw(10) << format_bytes(bytes) << "  skipped, needs " << format_bytes(memory)
+                                  << " on a rank" << std::endl;
+                    continue;
+                }
+
+                const uint32_t iterations = iterations_option
+                    ? std::max(1L, atol(iterations_option))
+                    : std::clamp<uint64_t>(COLLECTIVE_ITERATION_BYTES / bytes, COLLECTIVE_MIN_ITERATIONS, COLLECTIVE_MAX_ITERATIONS);
+                const uint32_t warmup = warmup_option ? atol(warmup_option) : std::max<uint32_t>(1, iterations / 10);
+
+                // Checks one run before timing them
+                run.fill();
+                MPI_Request request = run.start();
+                MPI_Wait(&request, MPI_STATUS_IGNORE);
+                int32_t correct = run.check();
+                MPI_Allreduce(MPI_IN_PLACE, &correct, 1, MPI_INT32_T, MPI_LAND, MPI_COMM_WORLD);
+                verified &= correct;
+
+                CollectiveResult result { { collective->name, "", "B", run.bus_bytes(), {} }, collective->name,
+                    rooted ? root : -1, bytes, -1.0, correct != 0 };
+                result.timing.seconds = time_runs(run, warmup, iterations, 0.0, MPI_COMM_WORLD);
+
+                if (collective->non_blocking) {
+                    double median = result.timing.median();
+                    MPI_Bcast(&median, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+                    BenchmarkResult overlapped { "", "", "", 0, time_runs(run, warmup, iterations, median, MPI_COMM_WORLD) };
+                    result.overlap = median > 0 ? std::clamp(100.0 * (1.0 - (overlapped.median() - median) / median), 0.0, 100.0) : 0.0;
+                }
+
+                if (rank == 0) {
+                    print_result(result);
+                    results.push_back(std::move(result));
+                }
+            }
+        }
+    }
+
+    bool written = true;
+    if (rank == 0 && csv_option && !write_csv(csv_option, results, label_option ? label_option : "", size)) {
+        std::cerr << "Error writing " << csv_option << std::endl;
+        written = false;
+    }
+    if (rank == 0 && !verified)
+        std::cerr << "Some collectives delivered wrong data" << std::endl;
+
+    if (MPI_Finalize() != MPI_SUCCESS) {
+        std::cout << "Error finalizing MPI" << std::endl;
+        return 1;
+    }
+    return written && verified ? 0 : 1;
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+/* Natural logarithms of many values at once.
+
+Each value is range reduced like frexp does, x = m * 2^e with m in
+[sqrt(1/2), sqrt(2)), so that
+
+    ln x = e * ln 2 + 2 * atanh(s),   s = (m - 1) / (m + 1),  |s| < 0.172
+
+and the series 2 * (s + s^3 / 3 + s^5 / 5 + ...) converges fast: 12 terms
+reach double precision and 22 reach double-double (about 32 digits),
+instead of the millions the Taylor series of log_terms needs far from 1.
+
+In double, with f = m - 1 (exact) and s = f / (2 + f), the sum is taken as
+f - s * (f - R), R = 2 * (s^2 / 3 + s^4 / 5 + ...), since f - 2s = s * f.
+The rounding of s then only reaches the small correction, keeping the
+result within about an ulp.
+
+    double         AVX-512F (8 lanes) or AVX2 + FMA (4 lanes), scalar otherwise
+    double-double  AVX2 + FMA (4 lanes), scalar otherwise. The result is
+                   an unevaluated sum hi + lo
+
+The vector kernels take the exponent straight from the bits. Lanes that
+aren't positive normal numbers (0, negatives, subnormals, infinities, NaN)
+send their whole vector through the scalar code, which uses frexp and
+handles them like std::log.
+*/
+
+#include "../common/cpu_features.h"
+#include "../common/double_double.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOG_BATCH_X86_KERNELS 1
+#endif
+
+using LogBatchFn = void (*)(const double* x, double* result, std::size_t count);
+using LogBatchDoubleDoubleFn = void (*)(const double* x, double* hi, double* lo, std::size_t count);
+
+constexpr int LOG_SERIES_TERMS = 12;
+constexpr int LOG_SERIES_TERMS_DOUBLE_DOUBLE = 22;
+constexpr double LOG_SQRT_HALF = 0.70710678118654752440;
+
+/// ln 2 split so that e * LN2_HI is exact for every exponent
+constexpr double LN2_HI = 6.93147180369123816490e-01;
+constexpr double LN2_LO = 1.90821492927058770002e-10;
+/// ln 2 as a double-double
+constexpr double LN2_DD_HI = 6.93147180559945286227e-01;
+constexpr double LN2_DD_LO = 2.31904681384629955842e-17;
+
+/// 1 / (2k + 1), the coefficients of the atanh series in s^2
+struct LogSeries {
+    double hi[LOG_SERIES_TERMS_DOUBLE_DOUBLE];
+    double lo[LOG_SERIES_TERMS_DOUBLE_DOUBLE]; // Rounding error of hi, for double-double
+};
+
+inline const LogSeries& log_series()
+{
+    static const LogSeries series = [] {
+        LogSeries coefficients;
+        for (int k = 0; k < LOG_SERIES_TERMS_DOUBLE_DOUBLE; k++) {
+            double divisor = 2 * k + 1;
+            coefficients.hi[k] = 1.0 / divisor;
+            coefficients.lo[k] = std::fma(-coefficients.hi[k], divisor, 1.0) / divisor;
+        }
+        return coefficients;
+    }();
+    return series;
+}
+
+/// ln of the values that aren't positive finite numbers, like std::log.
+/// Returns false for the rest
+inline bool log_special(double x, double& result)
+{
+    if (std::isnan(x) || x < 0)
+        result = std::numeric_limits<double>::quiet_NaN();
+    else if (x == 0)
+        result = -std::numeric_limits<double>::infinity();
+    else if (std::isinf(x))
+        result = x;
+    else
+        return false;
+    return true;
+}
+
+/// m in [sqrt(1/2), sqrt(2)) and e with x = m * 2^e, for a positive finite x
+inline void log_reduce(double x, double& m, int& e)
+{
+    m = std::frexp(x, &e);
+    if (m < LOG_SQRT_HALF) {
+        m *= 2;
+        e--;
+    }
+}
+
+inline void log_batch_scalar(const double* x, double* result, std::size_t count)
+{
+    const LogSeries& series = log_series();
+    for (std::size_t i = 0; i < count; i++) {
+        if (log_special(x[i], result[i]))
+            continue;
+
+        double m;
+        int e;
+        log_reduce(x[i], m, e);
+        double f = m - 1;
+        double s = f / (2 + f);
+        double z = s * s;
+        double p = series.hi[LOG_SERIES_TERMS - 1];
+        for (int k = LOG_SERIES_TERMS - 2; k >= 1; k--)
+            p = p * z + series.hi[k];
+        double logarithm = f - s * (f - 2 * z * p);
+        result[i] = e * LN2_HI + (e * LN2_LO + logarithm);
+    }
+}
+
+/// Never inlined: the AVX2 kernel calls it for its irregular lanes and its
+/// tail, and inlined into that FMA target code the compiler would contract
+/// the products of two_product, losing the low half
+__attribute__((noinline)) inline void log_batch_double_double_scalar(const double* x, double* hi, double* lo, std::size_t count)
+{
+    const LogSeries& series = log_series();
+    for (std::size_t i = 0; i < count; i++) {
+        lo[i] = 0;
+        if (log_special(x[i], hi[i]))
+            continue;
+
+        double m;
+        int e;
+        log_reduce(x[i], m, e);
+
+        // m - 1 is exact, m + 1 is kept with its rounding error
+        DoubleDouble s = dd_divide(m - 1, two_sum(m, 1));
+        DoubleDouble s2 = dd_multiply(s, s);
+        DoubleDouble p = { series.hi[LOG_SERIES_TERMS_DOUBLE_DOUBLE - 1], series.lo[LOG_SERIES_TERMS_DOUBLE_DOUBLE - 1] };
+        for (int k = LOG_SERIES_TERMS_DOUBLE_DOUBLE - 2; k >= 0; k--)
+            p = dd_add(dd_multiply(p, s2), { series.hi[k], series.lo[k] });
+
+        DoubleDouble logarithm = dd_multiply({ 2 * s.hi, 2 * s.lo }, p);
+        logarithm = dd_add(dd_multiply({ LN2_DD_HI, LN2_DD_LO }, { static_cast<double>(e), 0 }), logarithm);
+        hi[i] = logarithm.hi;
+        lo[i] = logarithm.lo;
+    }
+}
+
+#ifdef LOG_BATCH_X86_KERNELS
+
+__attribute__((target("avx2,fma"))) inline void log_batch_avx2(const double* x, double* result, std::size_t count)
+{
+    const LogSeries& series = log_series();
+    const __m256i mantissa_mask = _mm256_set1_epi64x(0x000fffffffffffffLL);
+    const __m256i half_exponent = _mm256_set1_epi64x(0x3fe0000000000000LL);
+    const __m256i magic = _mm256_set1_epi64x(0x4330000000000000LL); // 2^52, its mantissa holds an integer
+    const __m256d magic_bias = _mm256_set1_pd(4503599627370496.0 + 1022);
+    const __m256d one = _mm256_set1_pd(1.0);
+
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d normal = _mm256_and_pd(
+            _mm256_cmp_pd(v, _mm256_set1_pd(DBL_MIN), _CMP_GE_OQ),
+            _mm256_cmp_pd(v, _mm256_set1_pd(DBL_MAX), _CMP_LE_OQ));
+        if (_mm256_movemask_pd(normal) != 0xf) {
+            log_batch_scalar(x + i, result + i, 4);
+            continue;
+        }
+
+        // frexp: m in [1/2, 1) and its exponent, then m in [sqrt(1/2), sqrt(2))
+        __m256i bits = _mm256_castpd_si256(v);
+        __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, mantissa_mask), half_exponent));
+        __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), magic)), magic_bias);
+        __m256d small = _mm256_cmp_pd(m, _mm256_set1_pd(LOG_SQRT_HALF), _CMP_LT_OQ);
+        m = _mm256_blendv_pd(m, _mm256_add_pd(m, m), small);
+        e = _mm256_sub_pd(e, _mm256_and_pd(small, one));
+
+        __m256d f = _mm256_sub_pd(m, one);
+        __m256d s = _mm256_div_pd(f, _mm256_add_pd(f, _mm256_set1_pd(2.0)));
+        __m256d z = _mm256_mul_pd(s, s);
+        __m256d p = _mm256_set1_pd(series.hi[LOG_SERIES_TERMS - 1]);
+        for (int k = LOG_SERIES_TERMS - 2; k >= 1; k--)
+            p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(series.hi[k]));
+
+        __m256d r = _mm256_mul_pd(_mm256_add_pd(z, z), p);
+        __m256d logarithm = _mm256_fnmadd_pd(s, _mm256_sub_pd(f, r), f);
+        logarithm = _mm256_fmadd_pd(e, _mm256_set1_pd(LN2_LO), logarithm);
+        _mm256_storeu_pd(result + i, _mm256_fmadd_pd(e, _mm256_set1_pd(LN2_HI), logarithm));
+    }
+    log_batch_scalar(x + i, result + i, count - i);
+}
+
+__attribute__((target("avx512f"))) inline void log_batch_avx512(const double* x, double* result, std::size_t count)
+{
+    const LogSeries& series = log_series();
+    const __m512i mantissa_mask = _mm512_set1_epi64(0x000fffffffffffffLL);
+    const __m512i half_exponent = _mm512_set1_epi64(0x3fe0000000000000LL);
+    const __m512i magic = _mm512_set1_epi64(0x4330000000000000LL);
+    const __m512d magic_bias = _mm512_set1_pd(4503599627370496.0 + 1022);
+    const __m512d one = _mm512_set1_pd(1.0);
+
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512d v = _mm512_loadu_pd(x + i);
+        __mmask8 normal = _mm512_cmp_pd_mask(v, _mm512_set1_pd(DBL_MIN), _CMP_GE_OQ)
+            & _mm512_cmp_pd_mask(v, _mm512_set1_pd(DBL_MAX), _CMP_LE_OQ);
+        if (normal != 0xff) {
+            log_batch_scalar(x + i, result + i, 8);
+            continue;
+        }
+
+        __m512i bits = _mm512_castpd_si512(v);
+        __m512d m = _mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(bits, mantissa_mask), half_exponent));
+        __m512d e = _mm512_sub_pd(_mm512_castsi512_pd(_mm512_or_si512(_mm512_maskz_srli_epi64(0xff, bits, 52), magic)), magic_bias);
+        __mmask8 small = _mm512_cmp_pd_mask(m, _mm512_set1_pd(LOG_SQRT_HALF), _CMP_LT_OQ);
+        m = _mm512_mask_add_pd(m, small, m, m);
+        e = _mm512_mask_sub_pd(e, small, e, one);
+
+        __m512d f = _mm512_sub_pd(m, one);
+        __m512d s = _mm512_div_pd(f, _mm512_add_pd(f, _mm512_set1_pd(2.0)));
+        __m512d z = _mm512_mul_pd(s, s);
+        __m512d p = _mm512_set1_pd(series.hi[LOG_SERIES_TERMS - 1]);
+        for (int k = LOG_SERIES_TERMS - 2; k >= 1; k--)
+            p = _mm512_fmadd_pd(p, z, _mm512_set1_pd(series.hi[k]));
+
+        __m512d r = _mm512_mul_pd(_mm512_add_pd(z, z), p);
+        __m512d logarithm = _mm512_fnmadd_pd(s, _mm512_sub_pd(f, r), f);
+        logarithm = _mm512_fmadd_pd(e, _mm512_set1_pd(LN2_LO), logarithm);
+        _mm512_storeu_pd(result + i, _mm512_fmadd_pd(e, _mm512_set1_pd(LN2_HI), logarithm));
+    }
+    log_batch_scalar(x + i, result + i, count - i);
+}
+
+/// Double-double lanes, products made exact with a fused multiply-add
+struct Avx2DoubleDouble {
+    __m256d hi;
+    __m256d lo;
+};
+
+__attribute__((target("avx2,fma"))) inline Avx2DoubleDouble avx2_two_sum(__m256d a, __m256d b)
+{
+    __m256d sum = _mm256_add_pd(a, b);
+    __m256d b_part = _mm256_sub_pd(sum, a);
+    __m256d error = _mm256_add_pd(_mm256_sub_pd(a, _mm256_sub_pd(sum, b_part)), _mm256_sub_pd(b, b_part));
+    return { sum, error };
+}
+
+__attribute__((target("avx2,fma"))) inline Avx2DoubleDouble avx2_quick_two_sum(__m256d a, __m256d b)
+{
+    __m256d sum = _mm256_add_pd(a, b);
+    return { sum, _mm256_sub_pd(b, _mm256_sub_pd(sum, a)) };
+}
+
+__attribute__((target("avx2,fma"))) inline Avx2DoubleDouble avx2_dd_add(Avx2DoubleDouble a, Avx2DoubleDouble b)
+{
+    Avx2DoubleDouble sum = avx2_two_sum(a.hi, b.hi);
+    return avx2_quick_two_sum(sum.hi, _mm256_add_pd(sum.lo, _mm256_add_pd(a.lo, b.lo)));
+}
+
+__attribute__((target("avx2,fma"))) inline Avx2DoubleDouble avx2_dd_multiply(Avx2DoubleDouble a, Avx2DoubleDouble b)
+{
+    __m256d product = _mm256_mul_pd(a.hi, b.hi);
+    __m256d error = _mm256_fmsub_pd(a.hi, b.hi, product);
+    error = _mm256_fmadd_pd(a.hi, b.lo, _mm256_fmadd_pd(a.lo, b.hi, error));
+    return avx2_quick_two_sum(product, error);
+}
+
+__attribute__((target("avx2,fma"))) inline void log_batch_double_double_avx2(
+    const double* x,
+    double* hi,
+    double* lo,
+    std::size_t count)
+{
+    const LogSeries& series = log_series();
+    const __m256i mantissa_mask = _mm256_set1_epi64x(0x000fffffffffffffLL);
+    const __m256i half_exponent = _mm256_set1_epi64x(0x3fe0000000000000LL);
+    const __m256i magic = _mm256_set1_epi64x(0x4330000000000000LL);
+    const __m256d magic_bias = _mm256_set1_pd(4503599627370496.0 + 1022);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d zero = _mm256_setzero_pd();
+
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_loadu_pd(x + i);
+        __m256d normal = _mm256_and_pd(
+            _mm256_cmp_pd(v, _mm256_set1_pd(DBL_MIN), _CMP_GE_OQ),
+            _mm256_cmp_pd(v, _mm256_set1_pd(DBL_MAX), _CMP_LE_OQ));
+        if (_mm256_movemask_pd(normal) != 0xf) {
+            log_batch_double_double_scalar(x + i, hi + i, lo + i, 4);
+            continue;
+        }
+
+        __m256i bits = _mm256_castpd_si256(v);
+        __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, mantissa_mask), half_exponent));
+        __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), magic)), magic_bias);
+        __m256d small = _mm256_cmp_pd(m, _mm256_set1_pd(LOG_SQRT_HALF), _CMP_LT_OQ);
+        m = _mm256_blendv_pd(m, _mm256_add_pd(m, m), small);
+        e = _mm256_sub_pd(e, _mm256_and_pd(small, one));
+
+        // s = (m - 1) / (m + 1): a first quotient, then the remainder divided again
+        __m256d numerator = _mm256_sub_pd(m, one);
+        Avx2DoubleDouble denominator = avx2_two_sum(m, one);
+        __m256d q1 = _mm256_div_pd(numerator, denominator.hi);
+        Avx2DoubleDouble product = avx2_dd_multiply({ q1, zero }, denominator);
+        Avx2DoubleDouble remainder = avx2_two_sum(numerator, _mm256_sub_pd(zero, product.hi));
+        __m256d q2 = _mm256_div_pd(_mm256_add_pd(remainder.hi, _mm256_sub_pd(remainder.lo, product.lo)), denominator.hi);
+        Avx2DoubleDouble s = avx2_quick_two_sum(q1, q2);
+
+        Avx2DoubleDouble s2 = avx2_dd_multiply(s, s);
+        Avx2DoubleDouble p = {
+            _mm256_set1_pd(series.hi[LOG_SERIES_TERMS_DOUBLE_DOUBLE - 1]),
+            _mm256_set1_pd(series.lo[LOG_SERIES_TERMS_DOUBLE_DOUBLE - 1])
+        };
+        for (int k = LOG_SERIES_TERMS_DOUBLE_DOUBLE - 2; k >= 0; k--)
+            p = avx2_dd_add(avx2_dd_multiply(p, s2), { _mm256_set1_pd(series.hi[k]), _mm256_set1_pd(series.lo[k]) });
+
+        Avx2DoubleDouble logarithm = avx2_dd_multiply({ _mm256_add_pd(s.hi, s.hi), _mm256_add_pd(s.lo, s.lo) }, p);
+        Avx2DoubleDouble exponent_part = avx2_dd_multiply({ _mm256_set1_pd(LN2_DD_HI), _mm256_set1_pd(LN2_DD_LO) }, { e, zero });
+        logarithm = avx2_dd_add(exponent_part, logarithm);
+        _mm256_storeu_pd(hi + i, logarithm.hi);
+        _mm256_storeu_pd(lo + i, logarithm.lo);
+    }
+    log_batch_double_double_scalar(x + i, hi + i, lo + i, count - i);
+}
+
+#endif
+
+/// The widest double kernel the CPU supports, chosen once
+inline LogBatchFn log_batch_kernel()
+{
+    static const LogBatchFn kernel = [] {
+#ifdef LOG_BATCH_X86_KERNELS
+        const CpuFeatures& features = cpu_features();
+        if (features.avx512f)
+            return log_batch_avx512;
+        if (features.avx2 && features.fma)
+            return log_batch_avx2;
+#endif
+        return log_batch_scalar;
+    }();
+    return kernel;
+}
+
+/// The widest double-double kernel the CPU supports, chosen once
+inline LogBatchDoubleDoubleFn log_batch_double_double_kernel()
+{
+    static const LogBatchDoubleDoubleFn kernel = [] {
+#ifdef LOG_BATCH_X86_KERNELS
+        const CpuFeatures& features = cpu_features();
+        if (features.avx2 && features.fma)
+            return log_batch_double_double_avx2;
+#endif
+        return log_batch_double_double_scalar;
+    }();
+    return kernel;
+}
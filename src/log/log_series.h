@@ -0,0 +1,76 @@
+#pragma once
+
+/* The series of log_taylor_aproximation:
+
+    ln(x) = 2 * sum over n >= 0 of b^(2n + 1) / (2n + 1),   b = (x - 1) / (x + 1)
+
+and how many of its terms reach a tolerance.
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <math.h>
+
+/// Most terms a run may need, beyond it x is too far from 1 for the series
+constexpr uint64_t LOG_MAX_TERMS = uint64_t(1) << 62;
+
+/// Bound of what the terms from `terms` on add to ln(x), pow_base = (x - 1) / (x + 1).
+/// Each term is below pow_base^(2n + 1) / (2 terms + 1), a geometric series of ratio pow_base^2
+inline long double series_tail_bound(long double pow_base, uint64_t terms)
+{
+    if (pow_base == 0)
+        return 0;
+    long double exponent = 2.0L * terms + 1;
+    long double ratio = pow_base * pow_base;
+    return expl(logl(2) + exponent * logl(fabsl(pow_base)) - logl(exponent) - log1pl(-ratio));
+}
+
+/// Fewest terms whose tail bound is within `tolerance`, or LOG_MAX_TERMS when
+/// that many aren't enough
+inline uint64_t terms_for_tolerance(long double x, long double tolerance)
+{
+    long double pow_base = (x - 1.0) / (x + 1.0);
+    if (fabsl(pow_base) >= 1 || series_tail_bound(pow_base, LOG_MAX_TERMS) > tolerance)
+        return LOG_MAX_TERMS;
+
+    // The bound decreases with the terms
+    uint64_t low = 0, high = LOG_MAX_TERMS;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (series_tail_bound(pow_base, middle) <= tolerance)
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return low;
+}
+
+/// Sum of the terms in [first_term, end_term) of ln(x) = 2 * sum of
+/// pow_base^(2n + 1) / (2n + 1). Only the first power is a pow, each next
+/// one is the previous times pow_base^2
+inline long double log_terms(
+    uint64_t rank,
+    long double x,
+    uint64_t first_term,
+    uint64_t end_term)
+{
+    long double sum = 0.0;
+    if (first_term >= end_term)
+        return sum;
+
+    // Extracts the pow base to avoid computing in the for loop
+    long double pow_base = (x - 1.0) / (x + 1.0);
+    long double ratio = pow_base * pow_base;
+    long double power = powf64x(pow_base, 2.0 * first_term + 1.0);
+
+    // n ranges in [first, end)
+    for (uint64_t n = first_term; n < end_term; n++) {
+        // The divisor and the pow exponent are the same
+        long double divisor = 2.0 * n + 1.0;
+        sum += power / divisor;
+        power *= ratio;
+    }
+
+    // Saves result in vector
+    return 2.0f * sum;
+}
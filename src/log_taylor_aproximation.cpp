@@ -19,35 +19,145 @@ Complete guide for setting up and running.
 // arguments can be specified when executing the cluster
 // mpirun -np 4 --hostfile hostfile ./your_program arg1, arg2, ..., argn > output.txt
 
+#include "common/instrumentation.h"
+#include "common/options.h"
+#include "common/reduction.h"
+#include "common/thread_pool.h"
+#include "log/log_batch.h"
+#include "log/log_series.h"
+
 #include <math.h>
 #include <mpi/mpi.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cfloat>
 #include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <string>
 #include <vector>
 
-long double log_terms(
-    uint64_t rank,
-    long double x,
-    uint64_t start_term_inclusive,
-    uint64_t end_term_inclusive)
+/// Reads the whitespace separated decimal numbers of `path` into `values`.
+/// Returns false if the file can't be read or holds anything else
+bool read_values(const char* path, std::vector<double>& values)
 {
-    long double sum = 0.0;
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    const char* position = text.c_str();
+    while (true) {
+        while (isspace(static_cast<unsigned char>(*position)))
+            position++;
+        if (*position == '\0')
+            return true;
+
+        char* value_end;
+        values.push_back(strtod(position, &value_end));
+        if (value_end == position)
+            return false;
+        position = value_end;
+    }
+}
+
+/// Computes ln of every value of `path`. The root reads them, every rank
+/// evaluates a slice over its threads with the vector kernels of
+/// log/log_batch.h, and the root gathers the logarithms and prints them or
+/// writes them into `output_path`, one "x ln(x)" line per value. In
+/// double-double each line has "x hi lo", ln(x) being hi + lo
+bool log_values_file(const char* path, const char* output_path, bool double_double, int rank, int size, int root_rank)
+{
+    std::vector<double> values;
+    int32_t readable;
+    {
+        INSTRUMENT_PHASE("read values", io);
+        readable = rank != root_rank || read_values(path, values);
+    }
+    MPI_Bcast(&readable, 1, MPI_INT32_T, root_rank, MPI_COMM_WORLD);
+    if (!readable) {
+        if (rank == root_rank)
+            std::cerr << "Error reading " << path << ", it must only hold decimal numbers" << std::endl;
+        return false;
+    }
 
-    // Extracts the pow base to avoid computing in the for loop
-    long double pow_base = (x - 1.0) / (x + 1.0);
+    uint64_t total = values.size();
+    MPI_Bcast(&total, 1, MPI_UINT64_T, root_rank, MPI_COMM_WORLD);
 
-    // n ranges in [start, end]
-    for (uint64_t n = start_term_inclusive; n <= end_term_inclusive; n++) {
-        // The divisor and the pow exponent are the same
-        long double divisor = 2.0 * n + 1.0;
-        sum += powf64x(pow_base, divisor) / divisor;
+    std::vector<int32_t> counts(size), displacements(size);
+    for (int i = 0; i < size; i++) {
+        displacements[i] = total * i / size;
+        counts[i] = total * (i + 1) / size - displacements[i];
     }
 
-    // Saves result in vector
-    return 2.0f * sum;
+    std::vector<double> local_values(counts[rank]);
+    {
+        INSTRUMENT_PHASE("scatter values", communication);
+        MPI_Scatterv(
+            values.data(),
+            counts.data(),
+            displacements.data(),
+            MPI_DOUBLE,
+            local_values.data(),
+            counts[rank],
+            MPI_DOUBLE,
+            root_rank,
+            MPI_COMM_WORLD);
+    }
+
+    const double start_time = MPI_Wtime();
+    std::vector<double> local_hi(local_values.size()), local_lo(double_double ? local_values.size() : 0);
+    {
+        INSTRUMENT_PHASE("logarithms", compute);
+        ThreadPool::instance().parallel_for(0, local_values.size(), 4096, [&](std::size_t first, std::size_t last) {
+            if (double_double)
+                log_batch_double_double_kernel()(local_values.data() + first, local_hi.data() + first, local_lo.data() + first, last - first);
+            else
+                log_batch_kernel()(local_values.data() + first, local_hi.data() + first, last - first);
+        });
+    }
+    INSTRUMENT_COUNT("logarithms computed", local_values.size());
+    double elapsed = MPI_Wtime() - start_time;
+    MPI_Reduce(rank == root_rank ? MPI_IN_PLACE : &elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, root_rank, MPI_COMM_WORLD);
+
+    std::vector<double> hi(rank == root_rank ? total : 0), lo(rank == root_rank && double_double ? total : 0);
+    INSTRUMENT_COUNT("bytes sent", (local_hi.size() + local_lo.size()) * sizeof(double));
+    {
+        INSTRUMENT_PHASE("gather logarithms", communication);
+        MPI_Gatherv(local_hi.data(), counts[rank], MPI_DOUBLE, hi.data(), counts.data(), displacements.data(), MPI_DOUBLE, root_rank, MPI_COMM_WORLD);
+        if (double_double)
+            MPI_Gatherv(local_lo.data(), counts[rank], MPI_DOUBLE, lo.data(), counts.data(), displacements.data(), MPI_DOUBLE, root_rank, MPI_COMM_WORLD);
+    }
+
+    if (rank != root_rank)
+        return true;
+
+    INSTRUMENT_PHASE("write output", io);
+    std::ofstream output_file;
+    if (output_path)
+        output_file.open(output_path);
+    std::ostream& output = output_path ? output_file : std::cout;
+    output << std::setprecision(17);
+    for (uint64_t i = 0; i < total; i++) {
+        output << values[i] << ' ' << hi[i];
+        if (double_double)
+            output << ' ' << lo[i];
+        output << '\n';
+    }
+    output.flush();
+    if (!output) {
+        std::cerr << "Error writing " << (output_path ? output_path : "the logarithms") << std::endl;
+        return false;
+    }
+
+    std::cout << "Computed " << total << " logarithms in " << elapsed << " s (" << total / std::max(elapsed, 1e-9) / 1e6
+              << " M/s)" << std::endl;
+    return true;
 }
 
 int main(int argc, char** argv)
@@ -57,9 +167,10 @@ int main(int argc, char** argv)
     long double x = 1.0;
     uint64_t term_count = 1;
 
-    // Initializes MPI
+    // Initializes MPI. Only the main thread calls MPI, the pool threads just compute
     // ----------------------------------------------------------------------
-    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
+    int thread_support;
+    if (MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support) != MPI_SUCCESS) {
         std::cout << "Error while initializing MPI" << std::endl;
         return 1;
     }
@@ -68,64 +179,101 @@ int main(int argc, char** argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+    const char* threads_option = take_option(argc, argv, "--threads");
+    ThreadPool::configure(threads_option ? atol(threads_option) : 1);
+    const char* batch_option = take_option(argc, argv, "--batch");
+    const char* output_option = take_option(argc, argv, "--output");
+    const bool double_double = take_flag(argc, argv, "--double-double");
+    const char* tolerance_option = take_option(argc, argv, "--tolerance");
+    const InstrumentationOptions instrumentation = take_instrumentation_options(argc, argv);
+    INSTRUMENT_START(MPI_COMM_WORLD);
+
     int root_rank = 0;
 
     if (rank == root_rank) {
-        if (argc != 3) {
-            std::cout << "The program expects 2 arguments. First X and then the amount of terms used for approximation\n";
+        if (argc != (batch_option ? 1 : tolerance_option ? 2 : 3) || ((output_option || double_double) && !batch_option)
+            || (tolerance_option && batch_option)) {
+            std::cout << "The program expects 2 arguments. First X and then the amount of terms used for approximation. Options:\n"
+                      << "  --batch FILE     instead of a single X, computes ln of every whitespace separated number\n"
+                      << "                   of FILE with range reduction, and prints \"x ln(x)\" lines\n"
+                      << "  --double-double  with --batch, prints \"x hi lo\" lines, ln(x) = hi + lo to about 32 digits\n"
+                      << "  --output FILE    with --batch, writes the lines into FILE\n"
+                      << "  --threads N      threads per node with --batch, 0 uses every available core\n"
+                      << "  --tolerance E    instead of the amount of terms, uses the fewest terms that bound the\n"
+                      << "                   error of the series within E\n"
+                      << "  --trace FILE     writes the phases of every node into FILE, as a Chrome trace\n"
+                      << "  --profile        prints the time of every phase and the imbalance between the nodes" << std::endl;
+            MPI_Finalize();
             return 1;
         }
 
-        x = atof(argv[1]);
-        term_count = atol(argv[2]);
+        if (!batch_option) {
+            x = atof(argv[1]);
+            term_count = tolerance_option ? terms_for_tolerance(x, strtold(tolerance_option, nullptr)) : atol(argv[2]);
+        }
+    }
+
+    if (batch_option) {
+        bool computed = log_values_file(batch_option, output_option, double_double, rank, size, root_rank);
+        instrumentation.report(root_rank, MPI_COMM_WORLD);
+        MPI_Finalize();
+        return computed ? 0 : 1;
     }
 
     // Broadcasts parameters to all processes
-    MPI_Bcast(&x, 1, MPI_LONG_DOUBLE, root_rank, MPI_COMM_WORLD);
-    MPI_Bcast(&term_count, 1, MPI_UNSIGNED_LONG, root_rank, MPI_COMM_WORLD);
+    {
+        INSTRUMENT_PHASE("broadcast", communication);
+        MPI_Bcast(&x, 1, MPI_LONG_DOUBLE, root_rank, MPI_COMM_WORLD);
+        MPI_Bcast(&term_count, 1, MPI_UINT64_T, root_rank, MPI_COMM_WORLD);
+    }
+
+    if (!(x > 0) || term_count >= LOG_MAX_TERMS) {
+        if (rank == root_rank)
+            std::cerr << "X must be positive" << (tolerance_option ? " and close enough to 1 to reach the tolerance" : "")
+                      << std::endl;
+        MPI_Finalize();
+        return 1;
+    }
 
-    // Each process calculates something using the broadcasted value
-    uint64_t terms_x_thread = term_count / size;
+    // Terms past the ones that bound the error within the smallest normal
+    // number add nothing, the powers underflow
+    term_count = std::min(term_count, terms_for_tolerance(x, LDBL_MIN));
+
+    // Each process sums a contiguous range of the terms, the first
+    // term_count % size ranks get one more
+    uint64_t first_term = term_count / size * rank + std::min<uint64_t>(rank, term_count % size);
+    uint64_t end_term = first_term + term_count / size + (static_cast<uint64_t>(rank) < term_count % size);
 
     // Calculates result
-    long double send_result = log_terms(
-        rank,
-        x,
-        rank * terms_x_thread,
-        rank * terms_x_thread + terms_x_thread - 1);
+    const double start_time = MPI_Wtime();
+    long double send_result;
+    {
+        INSTRUMENT_PHASE("series terms", compute);
+        send_result = log_terms(rank, x, first_term, end_term);
+    }
+    INSTRUMENT_COUNT("terms summed", end_term - first_term);
+    double elapsed = MPI_Wtime() - start_time;
+    MPI_Reduce(rank == root_rank ? MPI_IN_PLACE : &elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, root_rank, MPI_COMM_WORLD);
 
     std::cout << "Result in node of rank " << rank << ": " << std::setprecision(15) << send_result << std::endl;
 
-    // Allocate space in root to gather results from all processes
-    long double recv_buffer[size];
-
-    // Gather the results in the root process
-    int status = MPI_Gather(
-        &send_result,
-        1, // Each process sends one element
-        MPI_LONG_DOUBLE, // Data type of the sent element
-        recv_buffer, // Receive buffer (on root process)
-        1, // Number of elements received from each process
-        MPI_LONG_DOUBLE, // Data type of the received elements
-        root_rank, // Root process that gathers data
-        MPI_COMM_WORLD // MPI communicator
-    );
-
-    if (status != MPI_SUCCESS) {
-        std::cout << "Error while gathering...\n";
-        return 1;
+    // Adds up the results of all processes in the root process
+    long double result;
+    {
+        INSTRUMENT_PHASE("reduction", communication);
+        result = reduce_sum(send_result, root_rank, MPI_COMM_WORLD);
     }
 
     if (rank == root_rank) {
-
-        // Computes the result by adding all the terms
-        long double result = 0.0;
-        for (uint64_t process_rank = 0; process_rank < size; process_rank++) {
-            result += recv_buffer[process_rank];
-        }
         std::cout << "Result: " << std::setprecision(15) << result << std::endl;
+
+        long double pow_base = (x - 1.0) / (x + 1.0);
+        std::cout << "Summed " << term_count << " terms in " << elapsed << " s. Error bound of the series: "
+                  << series_tail_bound(pow_base, term_count) << ", difference from logl: " << fabsl(result - logl(x))
+                  << std::endl;
     }
 
+    instrumentation.report(root_rank, MPI_COMM_WORLD);
     if (MPI_Finalize() != MPI_SUCCESS) {
         std::cout << "Error finalizing MPI" << std::endl;
         return 1;
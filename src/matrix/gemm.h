@@ -0,0 +1,158 @@
+#pragma once
+
+/* Cache blocked matrix multiplication, following the usual GotoBLAS / BLIS
+loop structure:
+
+    for jc (nc columns of B, lives in L3)
+      for pc (kc rows of B, packed once per jc)
+        for ic (mc rows of A, packed block lives in L2)
+          for jr, ir -> micro kernel over an mr x nr tile of C
+
+Both operands are copied ("packed") into contiguous micro-panels, so the
+micro kernel only ever streams through memory with unit stride.
+*/
+
+#include "../common/thread_pool.h"
+#include "gemm_kernels.h"
+#include "matrix.h"
+
+#include <algorithm>
+#include <unistd.h>
+
+/// Block sizes for the three cache levels
+struct GemmBlocking {
+    std::size_t mc;
+    std::size_t kc;
+    std::size_t nc;
+};
+
+inline std::size_t cache_size_or(int name, std::size_t fallback)
+{
+    long size = sysconf(name);
+    return size > 0 ? static_cast<std::size_t>(size) : fallback;
+}
+
+/// Derives the block sizes from the cache sizes reported by the OS:
+/// - a kc x nr micro-panel of B fills about half of L1
+/// - the mc x kc packed block of A fills about half of L2
+/// - the kc x nc packed panel of B fills about half of L3 (capped, since L3 is shared)
+inline GemmBlocking gemm_blocking(const GemmKernel& kernel)
+{
+    static const std::size_t l1 = cache_size_or(_SC_LEVEL1_DCACHE_SIZE, 32 * 1024);
+    static const std::size_t l2 = cache_size_or(_SC_LEVEL2_CACHE_SIZE, 256 * 1024);
+    static const std::size_t l3 = std::min<std::size_t>(
+        cache_size_or(_SC_LEVEL3_CACHE_SIZE, 8 * 1024 * 1024), 16 * 1024 * 1024);
+
+    GemmBlocking blocking;
+    blocking.kc = std::max<std::size_t>(64, l1 / 2 / (kernel.nr * sizeof(float)));
+    blocking.kc = std::min<std::size_t>(blocking.kc, 512);
+
+    blocking.mc = l2 / 2 / (blocking.kc * sizeof(float));
+    blocking.mc = std::max(kernel.mr, blocking.mc / kernel.mr * kernel.mr);
+
+    blocking.nc = l3 / 2 / (blocking.kc * sizeof(float));
+    blocking.nc = std::max(kernel.nr, blocking.nc / kernel.nr * kernel.nr);
+    return blocking;
+}
+
+/// Copies an m x k block of A into consecutive mr-row micro-panels, each stored
+/// column by column. The last panel is zero padded up to mr rows
+inline void pack_a(
+    ConstMatrixView a,
+    std::size_t mr,
+    float* packed)
+{
+    for (std::size_t i = 0; i < a.rows; i += mr) {
+        std::size_t rows = std::min(mr, a.rows - i);
+        for (std::size_t p = 0; p < a.columns; p++) {
+            for (std::size_t r = 0; r < rows; r++)
+                packed[r] = a[i + r][p];
+            for (std::size_t r = rows; r < mr; r++)
+                packed[r] = 0.0f;
+            packed += mr;
+        }
+    }
+}
+
+/// Copies a k x n block of B into consecutive nr-column micro-panels, each
+/// stored row by row. The last panel is zero padded up to nr columns
+inline void pack_b(
+    ConstMatrixView b,
+    std::size_t nr,
+    float* packed)
+{
+    for (std::size_t j = 0; j < b.columns; j += nr) {
+        std::size_t columns = std::min(nr, b.columns - j);
+        for (std::size_t p = 0; p < b.rows; p++) {
+            const float* row = b[p] + j;
+            std::copy(row, row + columns, packed);
+            std::fill(packed + columns, packed + nr, 0.0f);
+            packed += nr;
+        }
+    }
+}
+
+/// C += A * B, spread over the threads of the shared pool. Blocks of A are
+/// split between the threads, each one packing its own block while the packed
+/// panel of B is shared
+inline void gemm(
+    ConstMatrixView a,
+    ConstMatrixView b,
+    MatrixView c,
+    const GemmKernel& kernel = gemm_kernel_best())
+{
+    const GemmBlocking blocking = gemm_blocking(kernel);
+    const std::size_t m = a.rows;
+    const std::size_t k = a.columns;
+    const std::size_t n = b.columns;
+
+    auto round_up = [](std::size_t value, std::size_t multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    };
+
+    ThreadPool& pool = ThreadPool::instance();
+
+    // Shrinks the blocks of A when needed so every thread gets at least one
+    const std::size_t mc_max = std::min(
+        blocking.mc,
+        std::max(kernel.mr, round_up((m + pool.size() - 1) / pool.size(), kernel.mr)));
+
+    std::vector<float, AlignedAllocator<float>> packed_b(
+        round_up(std::min(blocking.nc, n), kernel.nr) * blocking.kc);
+
+    for (std::size_t jc = 0; jc < n; jc += blocking.nc) {
+        std::size_t nc = std::min(blocking.nc, n - jc);
+
+        for (std::size_t pc = 0; pc < k; pc += blocking.kc) {
+            std::size_t kc = std::min(blocking.kc, k - pc);
+
+            // Packs B in groups of micro-panels
+            const std::size_t panel_group = 8 * kernel.nr;
+            pool.parallel_for(0, nc, panel_group, [&](std::size_t first, std::size_t last) {
+                pack_b(b.block(pc, jc + first, kc, last - first), kernel.nr, packed_b.data() + first * kc);
+            });
+
+            pool.parallel_for(0, m, mc_max, [&](std::size_t first, std::size_t last) {
+                thread_local std::vector<float, AlignedAllocator<float>> packed_a;
+                packed_a.resize(round_up(mc_max, kernel.mr) * blocking.kc);
+
+                std::size_t ic = first;
+                std::size_t mc = last - first;
+                pack_a(a.block(ic, pc, mc, kc), kernel.mr, packed_a.data());
+
+                for (std::size_t jr = 0; jr < nc; jr += kernel.nr) {
+                    for (std::size_t ir = 0; ir < mc; ir += kernel.mr) {
+                        kernel.micro_kernel(
+                            kc,
+                            packed_a.data() + ir * kc,
+                            packed_b.data() + jr * kc,
+                            c[ic + ir] + jc + jr,
+                            c.stride,
+                            std::min(kernel.mr, mc - ir),
+                            std::min(kernel.nr, nc - jr));
+                    }
+                }
+            });
+        }
+    }
+}
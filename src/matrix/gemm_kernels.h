@@ -0,0 +1,213 @@
+#pragma once
+
+/* Register blocked micro kernels for the blocked matrix multiplication in
+gemm.h. Each kernel keeps an mr x nr tile of C in registers and performs one
+rank-1 update per step of kc:
+
+    generic   4 x 8    portable C++, vectorized by the compiler
+    avx2      6 x 16   12 ymm accumulators, FMA
+    avx512    14 x 32  28 zmm accumulators, FMA
+
+The SIMD kernels are compiled with function level target attributes, so the
+program does not need to be built with -mavx2 / -march=native. The fastest one
+supported by the running CPU is selected by `gemm_kernel_best`.
+*/
+
+#include "../common/cpu_features.h"
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86_KERNELS 1
+#endif
+
+/// Multiplies an mr x kc packed panel of A by a kc x nr packed panel of B and
+/// accumulates the result into the top left `m x n` corner of the tile at `c`.
+/// `m <= mr` and `n <= nr` only differ on the matrix edges
+using MicroKernelFn = void (*)(
+    std::size_t kc,
+    const float* a,
+    const float* b,
+    float* c,
+    std::size_t ldc,
+    std::size_t m,
+    std::size_t n);
+
+struct GemmKernel {
+    const char* name;
+    std::size_t mr;
+    std::size_t nr;
+    MicroKernelFn micro_kernel;
+};
+
+/// Portable register blocked kernel. The accumulator array is small enough for
+/// the compiler to keep in registers and vectorize the inner loop
+template <std::size_t MR, std::size_t NR>
+void micro_kernel_generic(
+    std::size_t kc,
+    const float* a,
+    const float* b,
+    float* c,
+    std::size_t ldc,
+    std::size_t m,
+    std::size_t n)
+{
+    float acc[MR][NR] = {};
+
+    for (std::size_t p = 0; p < kc; p++) {
+        for (std::size_t i = 0; i < MR; i++) {
+            float a_value = a[p * MR + i];
+            for (std::size_t j = 0; j < NR; j++)
+                acc[i][j] += a_value * b[p * NR + j];
+        }
+    }
+
+    for (std::size_t i = 0; i < m; i++) {
+        for (std::size_t j = 0; j < n; j++)
+            c[i * ldc + j] += acc[i][j];
+    }
+}
+
+/// Adds a partial tile, stored with row stride `nr`, into C
+inline void add_partial_tile(
+    const float* tile,
+    std::size_t nr,
+    float* c,
+    std::size_t ldc,
+    std::size_t m,
+    std::size_t n)
+{
+    for (std::size_t i = 0; i < m; i++) {
+        for (std::size_t j = 0; j < n; j++)
+            c[i * ldc + j] += tile[i * nr + j];
+    }
+}
+
+#ifdef GEMM_X86_KERNELS
+
+__attribute__((target("avx2,fma"))) inline void micro_kernel_avx2_6x16(
+    std::size_t kc,
+    const float* a,
+    const float* b,
+    float* c,
+    std::size_t ldc,
+    std::size_t m,
+    std::size_t n)
+{
+    constexpr std::size_t MR = 6;
+    constexpr std::size_t NR = 16;
+
+    __m256 acc[MR][2];
+    for (std::size_t i = 0; i < MR; i++) {
+        acc[i][0] = _mm256_setzero_ps();
+        acc[i][1] = _mm256_setzero_ps();
+    }
+
+    for (std::size_t p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+
+        for (std::size_t i = 0; i < MR; i++) {
+            __m256 a_value = _mm256_broadcast_ss(a + i);
+            acc[i][0] = _mm256_fmadd_ps(a_value, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(a_value, b1, acc[i][1]);
+        }
+        a += MR;
+        b += NR;
+    }
+
+    if (m == MR && n == NR) {
+        for (std::size_t i = 0; i < MR; i++) {
+            float* row = c + i * ldc;
+            _mm256_storeu_ps(row, _mm256_add_ps(_mm256_loadu_ps(row), acc[i][0]));
+            _mm256_storeu_ps(row + 8, _mm256_add_ps(_mm256_loadu_ps(row + 8), acc[i][1]));
+        }
+        return;
+    }
+
+    alignas(32) float tile[MR * NR];
+    for (std::size_t i = 0; i < MR; i++) {
+        _mm256_store_ps(tile + i * NR, acc[i][0]);
+        _mm256_store_ps(tile + i * NR + 8, acc[i][1]);
+    }
+    add_partial_tile(tile, NR, c, ldc, m, n);
+}
+
+__attribute__((target("avx512f"))) inline void micro_kernel_avx512_14x32(
+    std::size_t kc,
+    const float* a,
+    const float* b,
+    float* c,
+    std::size_t ldc,
+    std::size_t m,
+    std::size_t n)
+{
+    constexpr std::size_t MR = 14;
+    constexpr std::size_t NR = 32;
+
+    __m512 acc[MR][2];
+    for (std::size_t i = 0; i < MR; i++) {
+        acc[i][0] = _mm512_setzero_ps();
+        acc[i][1] = _mm512_setzero_ps();
+    }
+
+    for (std::size_t p = 0; p < kc; p++) {
+        __m512 b0 = _mm512_load_ps(b);
+        __m512 b1 = _mm512_load_ps(b + 16);
+
+        for (std::size_t i = 0; i < MR; i++) {
+            __m512 a_value = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(a_value, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(a_value, b1, acc[i][1]);
+        }
+        a += MR;
+        b += NR;
+    }
+
+    if (m == MR && n == NR) {
+        for (std::size_t i = 0; i < MR; i++) {
+            float* row = c + i * ldc;
+            _mm512_storeu_ps(row, _mm512_add_ps(_mm512_loadu_ps(row), acc[i][0]));
+            _mm512_storeu_ps(row + 16, _mm512_add_ps(_mm512_loadu_ps(row + 16), acc[i][1]));
+        }
+        return;
+    }
+
+    alignas(64) float tile[MR * NR];
+    for (std::size_t i = 0; i < MR; i++) {
+        _mm512_store_ps(tile + i * NR, acc[i][0]);
+        _mm512_store_ps(tile + i * NR + 16, acc[i][1]);
+    }
+    add_partial_tile(tile, NR, c, ldc, m, n);
+}
+
+#endif
+
+inline const GemmKernel& gemm_kernel_generic()
+{
+    static const GemmKernel kernel { "generic", 4, 8, micro_kernel_generic<4, 8> };
+    return kernel;
+}
+
+/// Kernels the running CPU can execute, slowest first
+inline std::vector<GemmKernel> gemm_available_kernels()
+{
+    std::vector<GemmKernel> kernels { gemm_kernel_generic() };
+#ifdef GEMM_X86_KERNELS
+    const CpuFeatures& features = cpu_features();
+    if (features.avx2 && features.fma)
+        kernels.push_back({ "avx2", 6, 16, micro_kernel_avx2_6x16 });
+    if (features.avx512f)
+        kernels.push_back({ "avx512", 14, 32, micro_kernel_avx512_14x32 });
+#endif
+    return kernels;
+}
+
+/// The fastest kernel supported by the running CPU, chosen once
+inline const GemmKernel& gemm_kernel_best()
+{
+    static const GemmKernel kernel = gemm_available_kernels().back();
+    return kernel;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include "../common/double_double.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/// Allocator that returns memory aligned to `Alignment` bytes, so rows start
+/// on cache line (and vector register) boundaries
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+    T* allocate(std::size_t n)
+    {
+        // std::aligned_alloc requires the size to be a multiple of the alignment
+        std::size_t bytes = (n * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        void* ptr = std::aligned_alloc(Alignment, bytes == 0 ? Alignment : bytes);
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, std::size_t) { std::free(ptr); }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+/// Non owning window over a row-major block of floats. `stride` is the
+/// distance, in elements, between the start of two consecutive rows
+template <typename T>
+struct BasicMatrixView {
+    T* data = nullptr;
+    std::size_t rows = 0;
+    std::size_t columns = 0;
+    std::size_t stride = 0;
+
+    BasicMatrixView() = default;
+
+    BasicMatrixView(
+        T* data,
+        std::size_t rows,
+        std::size_t columns,
+        std::size_t stride)
+        : data(data)
+        , rows(rows)
+        , columns(columns)
+        , stride(stride)
+    {
+    }
+
+    /// Allows passing a mutable view where a read only one is expected
+    template <typename U, typename = std::enable_if_t<std::is_same_v<const U, T>>>
+    BasicMatrixView(const BasicMatrixView<U>& other)
+        : BasicMatrixView(other.data, other.rows, other.columns, other.stride)
+    {
+    }
+
+    inline T* operator[](std::size_t row) const { return data + row * stride; }
+
+    /// Returns the sub block that starts at (row, column)
+    BasicMatrixView block(
+        std::size_t row,
+        std::size_t column,
+        std::size_t block_rows,
+        std::size_t block_columns) const
+    {
+        return { data + row * stride + column, block_rows, block_columns, stride };
+    }
+};
+
+using MatrixView = BasicMatrixView<float>;
+using ConstMatrixView = BasicMatrixView<const float>;
+
+/// Row-major matrix stored in a single aligned buffer
+class Matrix {
+    std::size_t rows;
+    std::size_t columns;
+    std::vector<float, AlignedAllocator<float>> data;
+
+public:
+    Matrix(
+        std::size_t size)
+        : Matrix(size, size)
+    {
+    }
+
+    Matrix(
+        std::size_t rows,
+        std::size_t columns)
+        : rows(rows)
+        , columns(columns)
+        , data(rows * columns)
+    {
+    }
+
+    inline std::size_t nrows() const { return rows; }
+    inline std::size_t ncolumns() const { return columns; }
+    inline std::size_t stride() const { return columns; }
+
+    inline float* raw() { return data.data(); }
+    inline const float* raw() const { return data.data(); }
+
+    MatrixView view() { return { data.data(), rows, columns, columns }; }
+    ConstMatrixView view() const { return { data.data(), rows, columns, columns }; }
+
+    void print(uint32_t precision = 3) const
+    {
+        for (std::size_t row = 0; row < nrows(); row++) {
+            std::cout << "[ ";
+            for (std::size_t column = 0; column < ncolumns(); column++) {
+                std::cout << std::setprecision(precision) << (*this)[row][column];
+                if (column + 1 < ncolumns())
+                    std::cout << ", ";
+            }
+            std::cout << " ]" << std::endl;
+        }
+    }
+
+    void fill(float n)
+    {
+        data.assign(data.size(), n);
+    }
+
+    /// Returns a pointer to the start of the row, so `m[row][column]` works
+    inline float* operator[](std::size_t index)
+    {
+        return data.data() + index * columns;
+    }
+
+    inline const float* operator[](std::size_t index) const
+    {
+        return data.data() + index * columns;
+    }
+
+    /// Compensated sum, the error doesn't grow with the amount of elements.
+    /// Kept as a double-double so the sums of several blocks can be added up
+    /// without losing it
+    DoubleDouble sum_elements() const
+    {
+        return CompensatedSum::of(data.data(), data.size());
+    }
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+/* Binary matrix files read and written in parallel with MPI-IO.
+
+Layout: a 64 byte header followed by the elements in native byte order.
+
+    offset  size  field
+    0       8     magic "MPIMATRX"
+    8       4     version (1)
+    12      4     dtype (1 = float32)
+    16      8     rows
+    24      8     columns
+    32      4     tile rows      (0 x 0 means plain row-major, the only
+    36      4     tile columns    layout supported so far)
+    40      24    reserved, zero
+
+Every rank reads (and writes) only its own block: the file view is set to a
+datatype that selects the block and a collective read_at_all lets the MPI
+library merge the requests of all the ranks. No rank ever holds more than its
+block. The block is transferred as a single element of a contiguous block
+datatype, so its size never goes through an int count.
+
+When the file is not on a filesystem shared by all the nodes, each node is
+expected to have its own copy at the same path (see copy_files.sh). Ranks then
+read their block from the local copy with independent I/O and write their
+block of the result into the local output file, leaving the other blocks as
+holes.
+*/
+
+#include "matrix.h"
+#include "summa.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mpi/mpi.h>
+#include <string>
+#include <unistd.h>
+
+enum MatrixDtype : uint32_t {
+    MATRIX_DTYPE_FLOAT32 = 1
+};
+
+struct MatrixFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint64_t rows;
+    uint64_t columns;
+    uint32_t tile_rows;
+    uint32_t tile_columns;
+    uint8_t reserved[24];
+};
+
+static_assert(sizeof(MatrixFileHeader) == 64, "The matrix file header must be 64 bytes");
+
+constexpr char MATRIX_FILE_MAGIC[8] = { 'M', 'P', 'I', 'M', 'A', 'T', 'R', 'X' };
+constexpr uint32_t MATRIX_FILE_VERSION = 1;
+
+inline MatrixFileHeader make_matrix_header(uint64_t rows, uint64_t columns)
+{
+    MatrixFileHeader header {};
+    memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+    header.version = MATRIX_FILE_VERSION;
+    header.dtype = MATRIX_DTYPE_FLOAT32;
+    header.rows = rows;
+    header.columns = columns;
+    return header;
+}
+
+/// Reads and validates the header on `root` and broadcasts it. Returns false,
+/// on every rank, if the file can't be used
+inline bool read_matrix_header(
+    const std::string& path,
+    MatrixFileHeader& header,
+    int root,
+    MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    int32_t valid = 0;
+    if (rank == root) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            std::cerr << "Error reading the header of " << path << std::endl;
+        else if (memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != MATRIX_FILE_VERSION)
+            std::cerr << path << " is not a matrix file" << std::endl;
+        else if (header.dtype != MATRIX_DTYPE_FLOAT32)
+            std::cerr << path << " has an unsupported element type " << header.dtype << std::endl;
+        else if (header.tile_rows != 0 || header.tile_columns != 0)
+            std::cerr << path << " uses a tiled layout, only row-major files are supported" << std::endl;
+        else
+            valid = 1;
+    }
+
+    MPI_Bcast(&valid, 1, MPI_INT32_T, root, comm);
+    MPI_Bcast(&header, sizeof(header), MPI_BYTE, root, comm);
+    return valid;
+}
+
+/// Checks whether every rank sees the same file system at the directory of
+/// `path`, by having rank 0 create a probe file the others try to read
+inline bool path_is_shared(const std::string& path, MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    const std::string probe_path = path + ".shared_probe";
+    uint64_t token = 0;
+    if (rank == 0) {
+        token = (static_cast<uint64_t>(getpid()) << 32) ^ static_cast<uint64_t>(MPI_Wtime() * 1e6);
+        std::ofstream probe(probe_path);
+        probe << token;
+    }
+    MPI_Bcast(&token, 1, MPI_UINT64_T, 0, comm);
+
+    uint64_t seen = 0;
+    std::ifstream probe(probe_path);
+    probe >> seen;
+    probe.close();
+
+    int32_t shared = seen == token;
+    MPI_Allreduce(MPI_IN_PLACE, &shared, 1, MPI_INT32_T, MPI_LAND, comm);
+
+    MPI_Barrier(comm);
+    if (rank == 0)
+        remove(probe_path.c_str());
+    return shared;
+}
+
+/// Sets the view of `file` to the block of the matrix the rank owns. Ranks
+/// with an empty block get a plain view and transfer 0 elements
+inline void set_block_view(
+    MPI_File file,
+    uint64_t total_rows,
+    uint64_t total_columns,
+    const BlockRange& rows,
+    const BlockRange& columns)
+{
+    if (rows.count == 0 || columns.count == 0) {
+        MPI_File_set_view(file, sizeof(MatrixFileHeader), MPI_FLOAT, MPI_FLOAT, "native", MPI_INFO_NULL);
+        return;
+    }
+
+    MPI_Datatype block_type = create_block_type(total_rows, total_columns, rows, columns);
+    MPI_File_set_view(file, sizeof(MatrixFileHeader), MPI_FLOAT, block_type, "native", MPI_INFO_NULL);
+    MPI_Type_free(&block_type);
+}
+
+/// Checks on every rank of `comm` that its block fits the block datatypes.
+/// Returns false, on every rank, if one doesn't
+inline bool check_block_fits(
+    const std::string& path,
+    const BlockRange& rows,
+    const BlockRange& columns,
+    MPI_Comm comm)
+{
+    int32_t fits = block_fits_datatype(rows, columns);
+    if (!fits)
+        std::cerr << "The block of " << path << " has " << rows.count << " x " << columns.count
+                  << " elements, its sides must be below " << INT_MAX << std::endl;
+
+    MPI_Allreduce(MPI_IN_PLACE, &fits, 1, MPI_INT32_T, MPI_LAND, comm);
+    return fits;
+}
+
+/// Reads the block (rows, columns) of the total_rows x total_columns matrix at
+/// `path` into `block`. With `shared` every rank of `comm` reads collectively
+/// from the same file, otherwise each rank reads from its node's copy on its own
+inline bool read_matrix_block(
+    const std::string& path,
+    uint64_t total_rows,
+    uint64_t total_columns,
+    const BlockRange& rows,
+    const BlockRange& columns,
+    Matrix& block,
+    bool shared,
+    MPI_Comm comm)
+{
+    if (!check_block_fits(path, rows, columns, comm))
+        return false;
+
+    MPI_Comm file_comm = shared ? comm : MPI_COMM_SELF;
+    MPI_File file;
+    int status = MPI_File_open(file_comm, path.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file);
+
+    int32_t opened = status == MPI_SUCCESS;
+    MPI_Allreduce(MPI_IN_PLACE, &opened, 1, MPI_INT32_T, MPI_LAND, comm);
+    if (!opened) {
+        if (status == MPI_SUCCESS)
+            MPI_File_close(&file);
+        else
+            std::cerr << "Error opening " << path << std::endl;
+        return false;
+    }
+
+    block = Matrix(rows.count, columns.count);
+    set_block_view(file, total_rows, total_columns, rows, columns);
+
+    // Empty blocks transfer nothing, the others exactly one block_type
+    MPI_Datatype block_type = create_contiguous_block_type(rows.count, columns.count);
+    int count = rows.count > 0 && columns.count > 0;
+
+    MPI_Status read_status;
+    if (shared)
+        status = MPI_File_read_at_all(file, 0, block.raw(), count, block_type, &read_status);
+    else
+        status = MPI_File_read_at(file, 0, block.raw(), count, block_type, &read_status);
+
+    int blocks_read = 0;
+    if (status == MPI_SUCCESS)
+        MPI_Get_count(&read_status, block_type, &blocks_read);
+    MPI_File_close(&file);
+    MPI_Type_free(&block_type);
+
+    int32_t complete = status == MPI_SUCCESS && blocks_read == count;
+    MPI_Allreduce(MPI_IN_PLACE, &complete, 1, MPI_INT32_T, MPI_LAND, comm);
+    if (!complete)
+        std::cerr << "Error reading the block of " << path << std::endl;
+    return complete;
+}
+
+/// Writes `block`, the part (rows, columns) of a total_rows x total_columns
+/// matrix, into the file at `path`. See `read_matrix_block` for `shared`
+inline bool write_matrix_block(
+    const std::string& path,
+    uint64_t total_rows,
+    uint64_t total_columns,
+    const BlockRange& rows,
+    const BlockRange& columns,
+    const Matrix& block,
+    bool shared,
+    MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    if (!check_block_fits(path, rows, columns, comm))
+        return false;
+
+    MPI_Comm file_comm = shared ? comm : MPI_COMM_SELF;
+    MPI_File file;
+    int status = MPI_File_open(file_comm, path.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &file);
+
+    int32_t opened = status == MPI_SUCCESS;
+    MPI_Allreduce(MPI_IN_PLACE, &opened, 1, MPI_INT32_T, MPI_LAND, comm);
+    if (!opened) {
+        if (status == MPI_SUCCESS)
+            MPI_File_close(&file);
+        else
+            std::cerr << "Error creating " << path << std::endl;
+        return false;
+    }
+
+    // Drops any stale data past the end of the new matrix. Every rank sets the
+    // same size, so ranks sharing a local copy can't truncate each other's blocks
+    MPI_File_set_size(file, sizeof(MatrixFileHeader) + total_rows * total_columns * sizeof(float));
+
+    // On a shared file system only one rank writes the header, otherwise
+    // every node completes its own copy
+    bool writes_header = !shared || rank == 0;
+    if (writes_header) {
+        MatrixFileHeader header = make_matrix_header(total_rows, total_columns);
+        MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    set_block_view(file, total_rows, total_columns, rows, columns);
+
+    MPI_Datatype block_type = create_contiguous_block_type(rows.count, columns.count);
+    int count = rows.count > 0 && columns.count > 0;
+    if (shared)
+        status = MPI_File_write_at_all(file, 0, block.raw(), count, block_type, MPI_STATUS_IGNORE);
+    else
+        status = MPI_File_write_at(file, 0, block.raw(), count, block_type, MPI_STATUS_IGNORE);
+    MPI_File_close(&file);
+    MPI_Type_free(&block_type);
+
+    int32_t complete = status == MPI_SUCCESS;
+    MPI_Allreduce(MPI_IN_PLACE, &complete, 1, MPI_INT32_T, MPI_LAND, comm);
+    if (!complete)
+        std::cerr << "Error writing the block of " << path << std::endl;
+    return complete;
+}
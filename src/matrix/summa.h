@@ -0,0 +1,516 @@
+#pragma once
+
+/* SUMMA (Scalable Universal Matrix Multiplication Algorithm) over a 2D grid
+of processes.
+
+The ranks are arranged in a pr x pc grid and every matrix is split in blocks:
+rank (i, j) owns block (i, j) of A, B and C. C(i, j) is accumulated one panel
+of the inner dimension at a time:
+
+    for each panel k:
+        the grid column owning A(:, k) broadcasts it along every grid row
+        the grid row owning B(k, :) broadcasts it along every grid column
+        C(i, j) += A(i, k) * B(k, j)
+
+so no rank ever holds more than its own blocks plus two panels, O(n^2 / p).
+*/
+
+#include "../common/instrumentation.h"
+#include "gemm.h"
+#include "matrix.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mpi/mpi.h>
+#include <vector>
+
+/// Offset and length of one part of a dimension split as evenly as possible.
+/// The first `n % parts` parts get one extra element
+struct BlockRange {
+    uint64_t offset;
+    uint64_t count;
+
+    inline uint64_t end() const { return offset + count; }
+};
+
+inline BlockRange block_range(uint64_t n, uint64_t parts, uint64_t index)
+{
+    uint64_t base = n / parts;
+    uint64_t remainder = n % parts;
+    uint64_t offset = index * base + std::min(index, remainder);
+    return { offset, base + (index < remainder ? 1 : 0) };
+}
+
+/// Returns the index of the part that contains `element`
+inline uint64_t block_owner(uint64_t n, uint64_t parts, uint64_t element)
+{
+    uint64_t base = n / parts;
+    uint64_t remainder = n % parts;
+    uint64_t split = remainder * (base + 1);
+    if (element < split)
+        return element / (base + 1);
+    return remainder + (element - split) / base;
+}
+
+/// Whether the block (rows, columns) can be described by the datatypes below.
+/// Their counts are ints, but only the sides are, never the amount of elements
+inline bool block_fits_datatype(const BlockRange& rows, const BlockRange& columns)
+{
+    return rows.count <= INT_MAX && columns.count <= INT_MAX;
+}
+
+/// Committed datatype that selects the block (rows, columns) of a row-major
+/// `total_rows` x `total_columns` float matrix: rows.count runs of columns.count
+/// floats, placed with byte strides and offsets, and the extent of the whole
+/// matrix like a subarray. The block must not be empty and must fit
+/// `block_fits_datatype`
+inline MPI_Datatype create_block_type(
+    uint64_t total_rows,
+    uint64_t total_columns,
+    const BlockRange& rows,
+    const BlockRange& columns)
+{
+    MPI_Aint row_bytes = total_columns * sizeof(float);
+    MPI_Datatype runs_type;
+    MPI_Type_create_hvector(rows.count, columns.count, row_bytes, MPI_FLOAT, &runs_type);
+
+    int one = 1;
+    MPI_Aint offset = (rows.offset * total_columns + columns.offset) * sizeof(float);
+    MPI_Datatype placed_type;
+    MPI_Type_create_hindexed(1, &one, &offset, runs_type, &placed_type);
+
+    MPI_Datatype block_type;
+    MPI_Type_create_resized(placed_type, 0, total_rows * row_bytes, &block_type);
+    MPI_Type_commit(&block_type);
+
+    MPI_Type_free(&placed_type);
+    MPI_Type_free(&runs_type);
+    return block_type;
+}
+
+/// Committed datatype of a contiguous rows x columns float block, so a whole
+/// block is sent or read with count 1 however many elements it has. Both sides
+/// must fit an int
+inline MPI_Datatype create_contiguous_block_type(uint64_t rows, uint64_t columns)
+{
+    MPI_Datatype row_type;
+    MPI_Type_contiguous(columns, MPI_FLOAT, &row_type);
+
+    MPI_Datatype block_type;
+    MPI_Type_contiguous(rows, row_type, &block_type);
+    MPI_Type_commit(&block_type);
+
+    MPI_Type_free(&row_type);
+    return block_type;
+}
+
+/// 2D cartesian arrangement of the ranks plus the row and column communicators
+/// used for the panel broadcasts
+struct ProcessGrid {
+    MPI_Comm grid;
+    MPI_Comm row_comm; // Ranks in the same grid row, ranked by column
+    MPI_Comm column_comm; // Ranks in the same grid column, ranked by row
+    int rows;
+    int columns;
+    int row;
+    int column;
+
+    ProcessGrid(MPI_Comm comm)
+    {
+        int size;
+        MPI_Comm_size(comm, &size);
+
+        int dims[2] = { 0, 0 };
+        int periods[2] = { 0, 0 };
+        MPI_Dims_create(size, 2, dims);
+        MPI_Cart_create(comm, 2, dims, periods, 0, &grid);
+
+        int rank, coords[2];
+        MPI_Comm_rank(grid, &rank);
+        MPI_Cart_coords(grid, rank, 2, coords);
+        rows = dims[0];
+        columns = dims[1];
+        row = coords[0];
+        column = coords[1];
+
+        int keep_columns[2] = { 0, 1 };
+        int keep_rows[2] = { 1, 0 };
+        MPI_Cart_sub(grid, keep_columns, &row_comm);
+        MPI_Cart_sub(grid, keep_rows, &column_comm);
+    }
+
+    ~ProcessGrid()
+    {
+        MPI_Comm_free(&row_comm);
+        MPI_Comm_free(&column_comm);
+        MPI_Comm_free(&grid);
+    }
+
+    ProcessGrid(const ProcessGrid&) = delete;
+    ProcessGrid& operator=(const ProcessGrid&) = delete;
+
+    /// Rank, in `grid`, of the process at the given coordinates
+    int rank_of(int grid_row, int grid_column) const
+    {
+        int coords[2] = { grid_row, grid_column };
+        int rank;
+        MPI_Cart_rank(grid, coords, &rank);
+        return rank;
+    }
+};
+
+/// Global shape of C = A * B, with A: m x k and B: k x n
+struct GemmShape {
+    uint64_t m;
+    uint64_t k;
+    uint64_t n;
+};
+
+/// Shapes of the blocks owned by the calling rank
+struct LocalBlocks {
+    BlockRange a_rows, a_columns;
+    BlockRange b_rows, b_columns;
+    BlockRange c_rows, c_columns;
+
+    LocalBlocks(const ProcessGrid& grid, const GemmShape& shape)
+        : a_rows(block_range(shape.m, grid.rows, grid.row))
+        , a_columns(block_range(shape.k, grid.columns, grid.column))
+        , b_rows(block_range(shape.k, grid.rows, grid.row))
+        , b_columns(block_range(shape.n, grid.columns, grid.column))
+        , c_rows(a_rows)
+        , c_columns(b_columns)
+    {
+    }
+};
+
+/// One step of the inner dimension: columns [k, k + width) of A and rows
+/// [k, k + width) of B, together with the grid column / row that owns them
+struct SummaPanel {
+    uint64_t k;
+    uint64_t width;
+    int a_owner;
+    int b_owner;
+    uint64_t a_local_column; // First column of the panel inside the owner's A block
+    uint64_t b_local_row; // First row of the panel inside the owner's B block
+};
+
+/// Splits the inner dimension in panels at most `panel_width` wide that never
+/// cross the boundary between two owners
+inline std::vector<SummaPanel> summa_panels(
+    const ProcessGrid& grid,
+    const GemmShape& shape,
+    uint64_t panel_width)
+{
+    std::vector<SummaPanel> panels;
+    uint64_t k = 0;
+    while (k < shape.k) {
+        int a_owner = block_owner(shape.k, grid.columns, k);
+        int b_owner = block_owner(shape.k, grid.rows, k);
+        BlockRange a_owner_range = block_range(shape.k, grid.columns, a_owner);
+        BlockRange b_owner_range = block_range(shape.k, grid.rows, b_owner);
+
+        uint64_t next = std::min({ k + panel_width, a_owner_range.end(), b_owner_range.end() });
+        panels.push_back({ k, next - k, a_owner, b_owner, k - a_owner_range.offset, k - b_owner_range.offset });
+        k = next;
+    }
+    return panels;
+}
+
+/// Panel buffers of one step. Panels are stored densely with a `width` stride
+struct SummaPanelBuffers {
+    Matrix a;
+    Matrix b;
+
+    SummaPanelBuffers(uint64_t local_m, uint64_t local_n, uint64_t panel_width)
+        : a(local_m, panel_width)
+        , b(panel_width, local_n)
+    {
+    }
+
+    MatrixView a_view(uint64_t width) { return { a.raw(), a.nrows(), width, width }; }
+    MatrixView b_view(uint64_t width) { return { b.raw(), width, b.ncolumns(), b.ncolumns() }; }
+};
+
+/// Copies the parts of the panel owned by the calling rank into the buffers
+/// the broadcasts are sent from
+inline void copy_owned_panels(
+    const ProcessGrid& grid,
+    const SummaPanel& panel,
+    const Matrix& a_local,
+    const Matrix& b_local,
+    SummaPanelBuffers& buffers)
+{
+    if (grid.column == panel.a_owner) {
+        MatrixView a_view = buffers.a_view(panel.width);
+        for (uint64_t row = 0; row < a_view.rows; row++) {
+            const float* source = a_local[row] + panel.a_local_column;
+            std::copy(source, source + panel.width, a_view[row]);
+        }
+    }
+
+    if (grid.row == panel.b_owner) {
+        MatrixView b_view = buffers.b_view(panel.width);
+        const float* rows = b_local[panel.b_local_row];
+        std::copy(rows, rows + panel.width * b_view.columns, b_view.data);
+    }
+}
+
+/// Adds the FLOPs of C_local += a panel of `width` to the counters, and the
+/// bytes of the panels this rank broadcasts
+inline void count_summa_panel(
+    [[maybe_unused]] const ProcessGrid& grid,
+    [[maybe_unused]] const SummaPanel& panel,
+    [[maybe_unused]] const Matrix& c_local)
+{
+    INSTRUMENT_COUNT("FLOPs", 2.0 * c_local.nrows() * panel.width * c_local.ncolumns());
+    if (panel.a_owner == grid.column)
+        INSTRUMENT_COUNT("bytes sent", c_local.nrows() * panel.width * sizeof(float));
+    if (panel.b_owner == grid.row)
+        INSTRUMENT_COUNT("bytes sent", panel.width * c_local.ncolumns() * sizeof(float));
+}
+
+/// Where the time of a SUMMA multiplication went, for one rank
+struct SummaTimings {
+    double copy = 0.0; // Copying owned panels into the broadcast buffers
+    double compute = 0.0; // Local multiplications
+    double wait = 0.0; // Blocked on panel broadcasts: communication that was not hidden
+    double transfer = 0.0; // From starting a broadcast until it was seen complete
+    uint64_t panels = 0;
+
+    /// Part of the transfer time that overlapped with computation
+    inline double hidden() const { return transfer > wait ? transfer - wait : 0.0; }
+};
+
+/// C_local += the block of A * B owned by the calling rank. `a_local` and
+/// `b_local` are the blocks described by `LocalBlocks`. Every panel is
+/// broadcast with blocking calls before being multiplied
+inline void summa_multiply(
+    const ProcessGrid& grid,
+    const GemmShape& shape,
+    const Matrix& a_local,
+    const Matrix& b_local,
+    Matrix& c_local,
+    uint64_t panel_width = 256,
+    SummaTimings* timings = nullptr)
+{
+    SummaTimings local_timings;
+    SummaPanelBuffers buffers(c_local.nrows(), c_local.ncolumns(), panel_width);
+
+    for (const SummaPanel& panel : summa_panels(grid, shape, panel_width)) {
+        double start = MPI_Wtime();
+        {
+            INSTRUMENT_PHASE("copy panels", compute);
+            copy_owned_panels(grid, panel, a_local, b_local, buffers);
+        }
+        MatrixView a_view = buffers.a_view(panel.width);
+        MatrixView b_view = buffers.b_view(panel.width);
+
+        double broadcast_start = MPI_Wtime();
+        {
+            INSTRUMENT_PHASE("broadcast panels", communication);
+            MPI_Bcast(a_view.data, a_view.rows * panel.width, MPI_FLOAT, panel.a_owner, grid.row_comm);
+            MPI_Bcast(b_view.data, panel.width * b_view.columns, MPI_FLOAT, panel.b_owner, grid.column_comm);
+        }
+
+        double compute_start = MPI_Wtime();
+        {
+            INSTRUMENT_PHASE("gemm", compute);
+            gemm(a_view, b_view, c_local.view());
+        }
+        count_summa_panel(grid, panel, c_local);
+        double end = MPI_Wtime();
+
+        local_timings.copy += broadcast_start - start;
+        local_timings.wait += compute_start - broadcast_start;
+        local_timings.transfer += compute_start - broadcast_start;
+        local_timings.compute += end - compute_start;
+        local_timings.panels++;
+    }
+
+    if (timings)
+        *timings = local_timings;
+}
+
+/// Same result as `summa_multiply`, but the broadcasts of panel k + 1 run with
+/// MPI_Ibcast while panel k is multiplied, using two sets of panel buffers.
+/// The local multiplication is done in column strips and the pending
+/// broadcasts are tested between strips, so the MPI library keeps making
+/// progress without a progress thread
+inline void summa_multiply_pipelined(
+    const ProcessGrid& grid,
+    const GemmShape& shape,
+    const Matrix& a_local,
+    const Matrix& b_local,
+    Matrix& c_local,
+    uint64_t panel_width = 256,
+    SummaTimings* timings = nullptr)
+{
+    SummaTimings local_timings;
+    const std::vector<SummaPanel> panels = summa_panels(grid, shape, panel_width);
+    const uint64_t local_n = c_local.ncolumns();
+    const uint64_t strip_width = std::max<uint64_t>(256, (local_n + 7) / 8);
+
+    SummaPanelBuffers buffers[2] = {
+        { c_local.nrows(), local_n, panel_width },
+        { c_local.nrows(), local_n, panel_width }
+    };
+    MPI_Request requests[2][2];
+    double posted_at[2] = { 0.0, 0.0 };
+    bool completed[2] = { false, false };
+
+    auto post = [&](std::size_t index) {
+        const SummaPanel& panel = panels[index];
+        SummaPanelBuffers& target = buffers[index % 2];
+
+        double start = MPI_Wtime();
+        {
+            INSTRUMENT_PHASE("copy panels", compute);
+            copy_owned_panels(grid, panel, a_local, b_local, target);
+        }
+        MatrixView a_view = target.a_view(panel.width);
+        MatrixView b_view = target.b_view(panel.width);
+
+        posted_at[index % 2] = MPI_Wtime();
+        completed[index % 2] = false;
+        MPI_Ibcast(a_view.data, a_view.rows * panel.width, MPI_FLOAT, panel.a_owner, grid.row_comm, &requests[index % 2][0]);
+        MPI_Ibcast(b_view.data, panel.width * b_view.columns, MPI_FLOAT, panel.b_owner, grid.column_comm, &requests[index % 2][1]);
+        local_timings.copy += posted_at[index % 2] - start;
+    };
+
+    // Records the transfer time the first time the broadcasts are seen complete
+    auto poll = [&](std::size_t slot) {
+        if (completed[slot])
+            return;
+        int flag = 0;
+        MPI_Testall(2, requests[slot], &flag, MPI_STATUSES_IGNORE);
+        if (flag) {
+            completed[slot] = true;
+            local_timings.transfer += MPI_Wtime() - posted_at[slot];
+        }
+    };
+
+    if (!panels.empty())
+        post(0);
+
+    for (std::size_t index = 0; index < panels.size(); index++) {
+        const std::size_t slot = index % 2;
+        const bool has_next = index + 1 < panels.size();
+
+        // The other buffer set was consumed by the previous panel, so it can be refilled
+        if (has_next)
+            post(index + 1);
+
+        if (!completed[slot]) {
+            double wait_start = MPI_Wtime();
+            {
+                INSTRUMENT_PHASE("wait panels", communication);
+                MPI_Waitall(2, requests[slot], MPI_STATUSES_IGNORE);
+            }
+            double wait_end = MPI_Wtime();
+            local_timings.wait += wait_end - wait_start;
+            local_timings.transfer += wait_end - posted_at[slot];
+            completed[slot] = true;
+        }
+
+        const uint64_t width = panels[index].width;
+        MatrixView a_view = buffers[slot].a_view(width);
+        MatrixView b_view = buffers[slot].b_view(width);
+
+        double compute_start = MPI_Wtime();
+        {
+            INSTRUMENT_PHASE("gemm", compute);
+            for (uint64_t column = 0; column < local_n; column += strip_width) {
+                uint64_t columns = std::min(strip_width, local_n - column);
+                gemm(a_view, b_view.block(0, column, width, columns), c_local.view().block(0, column, c_local.nrows(), columns));
+                if (has_next)
+                    poll(1 - slot);
+            }
+        }
+        count_summa_panel(grid, panels[index], c_local);
+        local_timings.compute += MPI_Wtime() - compute_start;
+        local_timings.panels++;
+    }
+
+    if (timings)
+        *timings = local_timings;
+}
+
+/// Prints, on `root`, the mean and max over all ranks of every phase
+inline void report_summa_timings(
+    const SummaTimings& timings,
+    MPI_Comm comm,
+    int root)
+{
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    double values[5] = { timings.copy, timings.compute, timings.wait, timings.transfer, timings.hidden() };
+    double sums[5], maxima[5];
+    MPI_Reduce(values, sums, 5, MPI_DOUBLE, MPI_SUM, root, comm);
+    MPI_Reduce(values, maxima, 5, MPI_DOUBLE, MPI_MAX, root, comm);
+
+    if (rank != root)
+        return;
+
+    const char* names[5] = { "panel copy", "compute", "wait (exposed comm)", "transfer", "hidden comm" };
+    std::cout << std::fixed << std::setprecision(6);
+    std::cout << "Phase                   mean (s)      max (s)\n";
+    for (int i = 0; i < 5; i++) {
+        std::cout << std::left << std::setw(22) << names[i] << std::right
+                  << std::setw(11) << sums[i] / size << "  " << std::setw(11) << maxima[i] << "\n";
+    }
+
+    double hidden_percentage = sums[3] > 0.0 ? 100.0 * sums[4] / sums[3] : 0.0;
+    std::cout << "Communication hidden behind compute: " << std::setprecision(1) << hidden_percentage << "%\n";
+    std::cout << std::defaultfloat;
+}
+
+/// Assembles the full m x n C on `root` (a rank of `grid.grid`). Every rank
+/// sends its contiguous block and root receives it straight into place with a
+/// subarray datatype, so no reordering pass is needed. Returns an empty matrix
+/// on the other ranks
+inline Matrix gather_matrix(
+    const ProcessGrid& grid,
+    const GemmShape& shape,
+    const Matrix& c_local,
+    int root)
+{
+    int rank;
+    MPI_Comm_rank(grid.grid, &rank);
+
+    Matrix c(rank == root ? shape.m : 0, rank == root ? shape.n : 0);
+    std::vector<MPI_Request> requests;
+
+    if (rank == root) {
+        for (int grid_row = 0; grid_row < grid.rows; grid_row++) {
+            for (int grid_column = 0; grid_column < grid.columns; grid_column++) {
+                BlockRange rows = block_range(shape.m, grid.rows, grid_row);
+                BlockRange columns = block_range(shape.n, grid.columns, grid_column);
+                if (rows.count == 0 || columns.count == 0)
+                    continue;
+
+                MPI_Datatype block_type = create_block_type(shape.m, shape.n, rows, columns);
+
+                requests.emplace_back();
+                MPI_Irecv(c.raw(), 1, block_type, grid.rank_of(grid_row, grid_column), 0, grid.grid, &requests.back());
+
+                // Freeing only marks the type, it stays alive until the receive completes
+                MPI_Type_free(&block_type);
+            }
+        }
+    }
+
+    if (c_local.nrows() > 0 && c_local.ncolumns() > 0) {
+        MPI_Datatype local_type = create_contiguous_block_type(c_local.nrows(), c_local.ncolumns());
+        requests.emplace_back();
+        MPI_Isend(c_local.raw(), 1, local_type, root, 0, grid.grid, &requests.back());
+        MPI_Type_free(&local_type);
+    }
+
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    return c;
+}
@@ -4,110 +4,130 @@ cd build
 g++ -std=c++11 -pthread -O3 -o ejercicio3.out ../src/ejercicio3.cpp
 */
 
+#include "common/instrumentation.h"
+#include "common/mpi_utils.h"
+#include "common/options.h"
+#include "common/reduction.h"
+#include "common/thread_pool.h"
+#include "matrix/gemm.h"
+#include "matrix/matrix.h"
+#include "matrix/matrix_io.h"
+#include "matrix/summa.h"
+
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <mpi/mpi.h>
 #include <string.h>
-#include <thread>
+#include <string>
 #include <vector>
 
-class Matrix {
-    std::vector<std::vector<float>> data;
-
-public:
-    Matrix(
-        std::size_t size)
-        : data(size, std::vector<float>(size))
-    {
-    }
+struct MultiplicationOptions {
+    uint32_t matrix_size = 0; // Used when no input files are given
+    int32_t gather_result = 0;
+    int32_t blocking_broadcasts = 0;
+    std::string a_filepath;
+    std::string b_filepath;
+    std::string c_filepath;
+};
 
-    Matrix(
-        std::size_t rows,
-        std::size_t columns)
-        : data(rows, std::vector<float>(columns))
-    {
+/// Loads the blocks of A and B owned by this rank, either from the input files
+/// or filled with constants. Returns false if a file can't be used
+bool load_inputs(
+    const MultiplicationOptions& options,
+    const ProcessGrid& grid,
+    const GemmShape& shape,
+    Matrix& a,
+    Matrix& b)
+{
+    LocalBlocks blocks(grid, shape);
+
+    if (options.a_filepath.empty()) {
+        a = Matrix(blocks.a_rows.count, blocks.a_columns.count);
+        b = Matrix(blocks.b_rows.count, blocks.b_columns.count);
+        a.fill(0.1f);
+        b.fill(0.2f);
+        return true;
     }
 
-    ~Matrix()
-    {
-        data.clear();
-    }
+    return read_matrix_block(options.a_filepath, shape.m, shape.k, blocks.a_rows, blocks.a_columns, a,
+               path_is_shared(options.a_filepath, grid.grid), grid.grid)
+        && read_matrix_block(options.b_filepath, shape.k, shape.n, blocks.b_rows, blocks.b_columns, b,
+            path_is_shared(options.b_filepath, grid.grid), grid.grid);
+}
 
-    inline std::size_t nrows() const { return data.size(); }
-    inline std::size_t ncolumns() const { return data[0].size(); }
+/// Multiplies A and B with SUMMA over a grid made of all the ranks. Returns
+/// the sum of the elements of the block of C owned by this rank
+DoubleDouble multiply_distributed(
+    const MultiplicationOptions& options,
+    const GemmShape& shape,
+    int root_rank)
+{
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
-    void print(uint32_t precision = 3)
-    {
-        for (uint32_t row = 0; row < nrows(); row++) {
-            std::cout << "[ ";
-            for (uint32_t column = 0; column < ncolumns(); column++) {
-                std::cout << std::setprecision(precision) << data[row][column];
-                if (column + 1 < ncolumns())
-                    std::cout << ", ";
-            }
-            std::cout << " ]" << std::endl;
-        }
-    }
+    // Each node only holds its own block of A, B and C
+    ProcessGrid grid(MPI_COMM_WORLD);
+    LocalBlocks blocks(grid, shape);
 
-    void fill(float n)
+    Matrix a(0, 0), b(0, 0);
     {
-        for (uint32_t row = 0; row < nrows(); row++)
-            data[row].assign(ncolumns(), n);
+        INSTRUMENT_PHASE("load inputs", io);
+        if (!load_inputs(options, grid, shape, a, b))
+            MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
-    std::vector<float>& operator[](uint32_t index)
-    {
-        return data[index];
-    }
+    Matrix c(blocks.c_rows.count, blocks.c_columns.count);
+    c.fill(0.0f);
 
-    const std::vector<float>& operator[](uint32_t index) const
-    {
-        return data[index];
+    std::cout << "Node " << rank << " (" << grid.row << ", " << grid.column << ") of a "
+              << grid.rows << "x" << grid.columns << " grid is computing block rows: ["
+              << blocks.c_rows.offset << ", " << blocks.c_rows.end() << "), columns: ["
+              << blocks.c_columns.offset << ", " << blocks.c_columns.end() << ")"
+              << " with the " << gemm_kernel_best().name << " kernel and "
+              << ThreadPool::instance().size() << " threads\n";
+
+    SummaTimings timings;
+    if (options.blocking_broadcasts)
+        summa_multiply(grid, shape, a, b, c, 256, &timings);
+    else
+        summa_multiply_pipelined(grid, shape, a, b, c, 256, &timings);
+
+    report_summa_timings(timings, grid.grid, root_rank);
+
+    if (!options.c_filepath.empty()) {
+        INSTRUMENT_PHASE("write result", io);
+        bool shared = path_is_shared(options.c_filepath, grid.grid);
+        if (!write_matrix_block(options.c_filepath, shape.m, shape.n, blocks.c_rows, blocks.c_columns, c, shared, grid.grid))
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        if (rank == root_rank && !shared)
+            std::cout << "The output path is not shared, every node wrote its blocks to its own copy\n";
     }
 
-    float sum_elements()
-    {
-        float sum = 0.0f;
-        for (uint32_t row = 0; row < nrows(); row++) {
-            for (uint32_t column = 0; column < ncolumns(); column++)
-                sum += data[row][column];
+    if (options.gather_result) {
+        Matrix full_c(0, 0);
+        {
+            INSTRUMENT_PHASE("gather result", communication);
+            full_c = gather_matrix(grid, shape, c, root_rank);
         }
-        return sum;
-    }
-};
-
-Matrix matrix_mult_multithread(
-    const Matrix& a,
-    const Matrix& b,
-    uint32_t start_column,
-    uint32_t end_column)
-{
-
-    if (a.ncolumns() != b.nrows()) {
-        std::cout << "Can't multiply matrices. Incompatible rows and columns sizes" << std::endl;
-        return a;
-    }
-
-    Matrix c(a.nrows(), b.ncolumns());
-    c.fill(0.0f);
-
-    for (std::size_t row = 0; row < c.nrows(); row++) {
-        for (std::size_t column = start_column; column < end_column; column++) {
-            c[row][column] = 0.0f;
-            for (std::size_t i = 0; i < a.ncolumns(); i++) {
-                c[row][column] += a[row][i] * b[i][column];
-            }
+        if (rank == root_rank) {
+            DoubleDouble full_sum = full_c.sum_elements();
+            std::cout << "Gathered result sum: " << std::setprecision(15) << full_sum.hi + full_sum.lo << std::endl;
+            if (shape.m <= 16 && shape.n <= 16)
+                full_c.print();
         }
     }
 
-    return c;
+    return c.sum_elements();
 }
 
 int main(int argc, char** argv)
 {
 
+    // Only the main thread calls MPI, the pool threads just compute
     // ----------------------------------------------------------------------
-    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
+    int thread_support;
+    if (MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support) != MPI_SUCCESS) {
         std::cout << "Error while initializing MPI" << std::endl;
         return 1;
     }
@@ -116,65 +136,87 @@ int main(int argc, char** argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+    if (thread_support < MPI_THREAD_FUNNELED && rank == 0)
+        std::cout << "Warning: the MPI library does not support MPI_THREAD_FUNNELED\n";
+
+    // Every rank receives the same arguments, so the thread count is read locally
+    const char* threads_option = take_option(argc, argv, "--threads");
+    ThreadPool::configure(threads_option ? atol(threads_option) : 1);
+    const InstrumentationOptions instrumentation = take_instrumentation_options(argc, argv);
+    INSTRUMENT_START(MPI_COMM_WORLD);
+
     int root_rank = 0;
-    uint32_t matrix_size = 0;
+    MultiplicationOptions options;
     if (rank == root_rank) {
-        if (argc != 2) {
-            std::cout << "Node " << rank << " The program expects 1 argument. The matrix size\n";
-            MPI_Finalize();
-            return 1;
+        options.gather_result = take_flag(argc, argv, "--gather");
+        options.blocking_broadcasts = take_flag(argc, argv, "--blocking");
+        const char* a_option = take_option(argc, argv, "--a");
+        const char* b_option = take_option(argc, argv, "--b");
+        const char* c_option = take_option(argc, argv, "--c");
+
+        bool from_files = a_option && b_option;
+        if ((from_files && argc != 1) || (!from_files && argc != 2)) {
+            std::cout << "Node " << rank << " The program expects the matrix size, or the input files. Options:\n"
+                      << "  --a FILE --b FILE  read A and B from binary matrix files instead\n"
+                      << "  --c FILE           write the result to a binary matrix file\n"
+                      << "  --gather           assemble the full result matrix in the root node\n"
+                      << "  --blocking         wait for each panel broadcast instead of prefetching the next one\n"
+                      << "  --threads N        threads per node, 0 uses every available core\n"
+                      << "  --trace FILE       writes the phases of every node into FILE, as a Chrome trace\n"
+                      << "  --profile          prints the time of every phase and the imbalance between the nodes\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
-        matrix_size = atol(argv[1]);
-    }
-
-    // Broadcasts the matrix size
-    MPI_Bcast(&matrix_size, 1, MPI_UNSIGNED_LONG, root_rank, MPI_COMM_WORLD);
-
-    Matrix a(matrix_size);
-    Matrix b(matrix_size);
-    a.fill(0.1f);
-    b.fill(0.2f);
 
-    // Ceil operation
-    uint32_t columns_per_node = (matrix_size + size - 1) / size;
-
-    uint32_t start_column = rank * columns_per_node; // Closed interval
-    uint32_t end_column = (rank + 1) * columns_per_node; // Open interval
+        if (from_files) {
+            options.a_filepath = a_option;
+            options.b_filepath = b_option;
+        } else {
+            options.matrix_size = atol(argv[1]);
+        }
+        if (c_option)
+            options.c_filepath = c_option;
+    }
 
-    // For the last node, ensures that it doesn't try to compute extra columns
-    if (rank == size - 1)
-        end_column = matrix_size;
+    // Broadcasts the matrix size and options
+    {
+        INSTRUMENT_PHASE("broadcast", communication);
+        MPI_Bcast(&options.matrix_size, 1, MPI_UINT32_T, root_rank, MPI_COMM_WORLD);
+        MPI_Bcast(&options.gather_result, 1, MPI_INT32_T, root_rank, MPI_COMM_WORLD);
+        MPI_Bcast(&options.blocking_broadcasts, 1, MPI_INT32_T, root_rank, MPI_COMM_WORLD);
+        broadcast_string(options.a_filepath, root_rank, MPI_COMM_WORLD);
+        broadcast_string(options.b_filepath, root_rank, MPI_COMM_WORLD);
+        broadcast_string(options.c_filepath, root_rank, MPI_COMM_WORLD);
+    }
 
-    std::cout << "Node " << rank << " is computing column range: (" << start_column << ", " << end_column << ")\n";
+    // The shape comes from the headers of the input files, if any
+    GemmShape shape { options.matrix_size, options.matrix_size, options.matrix_size };
+    if (!options.a_filepath.empty()) {
+        MatrixFileHeader a_header, b_header;
+        if (!read_matrix_header(options.a_filepath, a_header, root_rank, MPI_COMM_WORLD)
+            || !read_matrix_header(options.b_filepath, b_header, root_rank, MPI_COMM_WORLD))
+            MPI_Abort(MPI_COMM_WORLD, 1);
+
+        if (a_header.columns != b_header.rows) {
+            if (rank == root_rank)
+                std::cout << "Can't multiply matrices. Incompatible rows and columns sizes" << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        shape = { a_header.rows, a_header.columns, b_header.columns };
+    }
 
     // Executes multiplication
-    Matrix c = matrix_mult_multithread(
-        a,
-        b,
-        start_column,
-        end_column);
-
-    // Sums the elements and gathers results
-    float elements_sum = c.sum_elements();
-
-    float sums[size];
-    MPI_Gather(
-        &elements_sum,
-        1,
-        MPI_FLOAT,
-        sums,
-        1,
-        MPI_FLOAT,
-        root_rank,
-        MPI_COMM_WORLD);
+    DoubleDouble elements_sum = multiply_distributed(options, shape, root_rank);
 
-    if (rank == root_rank) {
-        // Computes the result by adding all the terms
-        float result = 0.0f;
-        for (uint32_t i = 0; i < size; i++)
-            result += sums[i];
-        std::cout << "Result: " << std::setprecision(15) << result << std::endl;
+    // Adds up the sums of each block, low halves included
+    DoubleDouble result;
+    {
+        INSTRUMENT_PHASE("reduction", communication);
+        result = reduce_sum(elements_sum, root_rank, MPI_COMM_WORLD);
     }
+    if (rank == root_rank)
+        std::cout << "Result: " << std::setprecision(15) << result.hi + result.lo << std::endl;
+
+    instrumentation.report(root_rank, MPI_COMM_WORLD);
 
     if (MPI_Finalize() != MPI_SUCCESS) {
         std::cout << "Error finalizing MPI" << std::endl;
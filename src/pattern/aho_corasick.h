@@ -0,0 +1,153 @@
+#pragma once
+
+/* Aho-Corasick automaton that counts every occurrence (overlapping ones
+included) of a set of patterns in a single pass over the text.
+
+The automaton is stored as a full DFA over a compressed alphabet: only the
+bytes that appear in some pattern get their own column, every other byte maps
+to column 0 (which always leads back to the root). Rows are padded to a power
+of two and transitions store the offset of the target row, so each text byte
+costs one table load and no multiplication:
+
+    row = transitions[row + byte_class[byte]]
+
+Instead of walking output links on every byte, the scan only counts how many
+times each state was entered. Once the text is done, those visits are pushed
+up the failure links (deepest states first), which gives, for every state, the
+amount of positions where its string ends. The count of a pattern is that
+total at its terminal state.
+*/
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <vector>
+
+class AhoCorasick {
+    std::array<uint8_t, 256> byte_class {};
+    uint32_t row_shift = 0;
+    std::vector<uint32_t> transitions; // Row offsets, `state << row_shift`
+    std::vector<uint32_t> failure; // Failure link of every state
+    std::vector<uint32_t> bfs_order; // States sorted by depth
+    std::vector<int64_t> terminal; // State where each pattern ends, -1 for empty patterns
+    std::size_t longest_pattern = 0;
+
+public:
+    explicit AhoCorasick(const std::vector<std::string>& patterns)
+    {
+        // Compresses the alphabet to the bytes used by the patterns
+        uint32_t class_count = 1;
+        for (const std::string& pattern : patterns) {
+            for (unsigned char byte : pattern) {
+                if (byte_class[byte] == 0 && class_count < 256)
+                    byte_class[byte] = class_count++;
+            }
+        }
+        while ((1u << row_shift) < class_count)
+            row_shift++;
+        const uint32_t row_size = 1u << row_shift;
+
+        // Builds the trie. Missing edges are marked with `none` for now
+        const uint32_t none = UINT32_MAX;
+        transitions.assign(row_size, none);
+        terminal.assign(patterns.size(), -1);
+
+        for (std::size_t index = 0; index < patterns.size(); index++) {
+            const std::string& pattern = patterns[index];
+            if (pattern.empty())
+                continue;
+
+            uint32_t row = 0;
+            for (unsigned char byte : pattern) {
+                uint32_t edge = row + byte_class[byte];
+                if (transitions[edge] == none) {
+                    transitions[edge] = transitions.size();
+                    transitions.resize(transitions.size() + row_size, none);
+                }
+                row = transitions[edge];
+            }
+            terminal[index] = row >> row_shift;
+            longest_pattern = std::max(longest_pattern, pattern.size());
+        }
+
+        // Breadth first pass computing the failure links and turning the trie
+        // into a complete DFA
+        const std::size_t state_count = transitions.size() >> row_shift;
+        failure.assign(state_count, 0);
+        bfs_order.reserve(state_count);
+
+        std::queue<uint32_t> pending;
+        pending.push(0);
+        while (!pending.empty()) {
+            uint32_t state = pending.front();
+            pending.pop();
+            bfs_order.push_back(state);
+
+            uint32_t row = state << row_shift;
+            uint32_t failure_row = failure[state] << row_shift;
+            for (uint32_t column = 0; column < row_size; column++) {
+                uint32_t& next = transitions[row + column];
+                if (next == none || column == 0) {
+                    // Column 0 holds the bytes no pattern uses
+                    next = (state == 0 || column == 0) ? 0 : transitions[failure_row + column];
+                    continue;
+                }
+
+                uint32_t child = next >> row_shift;
+                failure[child] = state == 0 ? 0 : transitions[failure_row + column] >> row_shift;
+                pending.push(child);
+            }
+        }
+    }
+
+    inline std::size_t state_count() const { return failure.size(); }
+    inline std::size_t max_pattern_length() const { return longest_pattern; }
+
+    /// Row offset of the root, where every scan starts
+    inline uint32_t start() const { return 0; }
+
+    /// Advances the automaton over `size` bytes, counting the states entered
+    /// in `visits` (one counter per state)
+    inline uint32_t scan(const char* data, std::size_t size, uint32_t row, uint64_t* visits) const
+    {
+        const uint32_t* table = transitions.data();
+        const uint8_t* classes = byte_class.data();
+        for (std::size_t i = 0; i < size; i++) {
+            row = table[row + classes[static_cast<uint8_t>(data[i])]];
+            visits[row >> row_shift]++;
+        }
+        return row;
+    }
+
+    /// Advances the automaton without counting, to pick up the context of a
+    /// chunk that starts in the middle of the text
+    inline uint32_t skip(const char* data, std::size_t size, uint32_t row) const
+    {
+        const uint32_t* table = transitions.data();
+        const uint8_t* classes = byte_class.data();
+        for (std::size_t i = 0; i < size; i++)
+            row = table[row + classes[static_cast<uint8_t>(data[i])]];
+        return row;
+    }
+
+    /// Converts the state visits of one or more scans into the amount of
+    /// occurrences of every pattern, in the order they were given
+    std::vector<uint64_t> pattern_counts(const std::vector<uint64_t>& visits) const
+    {
+        std::vector<uint64_t> totals(visits);
+        for (std::size_t i = bfs_order.size(); i-- > 1;) {
+            uint32_t state = bfs_order[i];
+            totals[failure[state]] += totals[state];
+        }
+
+        std::vector<uint64_t> counts(terminal.size(), 0);
+        for (std::size_t index = 0; index < terminal.size(); index++) {
+            if (terminal[index] >= 0)
+                counts[index] = totals[terminal[index]];
+        }
+        return counts;
+    }
+};
@@ -0,0 +1,217 @@
+#pragma once
+
+/* Bit-parallel approximate matching. An approximate occurrence is counted once
+per text position where some match ends:
+
+    mismatches  Shift-And with one state vector per error count, the
+                pattern and the text window have the same length and differ
+                in at most k bytes (Hamming distance)
+    edits       Myers' bit-vector algorithm, the edit distance (insertions,
+                deletions and substitutions) between the pattern and some
+                substring that ends at the position is at most k
+
+Patterns longer than 64 bytes use several 64 bit words per state vector,
+carrying shifts and horizontal deltas from word to word.
+
+Both scans start from scratch on every call. A match is at most
+`match_length()` bytes long, so starting that many bytes minus one before
+the first position that counts gives the same result as having scanned the
+whole text before it.
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class MatchKind {
+    exact,
+    mismatches,
+    edits
+};
+
+struct MatchMode {
+    MatchKind kind = MatchKind::exact;
+    uint32_t max_errors = 0;
+};
+
+class ApproximateMatcher {
+    MatchKind kind;
+    uint32_t max_errors;
+    std::size_t length; // Of the pattern
+    std::size_t words; // Per state vector
+    uint64_t last_bit; // Bit of the last pattern byte in the last word
+    std::vector<uint64_t> byte_masks; // 256 x words, bit i set where pattern[i] is the byte
+
+    /// `count_mismatches` for patterns of up to 64 bytes, with the error
+    /// count known at compile time so the state stays in registers
+    template <uint32_t MAX_ERRORS>
+    uint64_t count_mismatches_word(const uint8_t* data, std::size_t size, std::size_t first_counted) const
+    {
+        uint64_t state[MAX_ERRORS + 1] = {};
+        uint64_t count = 0;
+        for (std::size_t position = 0; position < size; position++) {
+            uint64_t mask = byte_masks[data[position]];
+            for (uint32_t errors = MAX_ERRORS; errors > 0; errors--)
+                state[errors] = (((state[errors] << 1) | 1) & mask) | (state[errors - 1] << 1) | 1;
+            state[0] = ((state[0] << 1) | 1) & mask;
+            count += position >= first_counted && (state[MAX_ERRORS] & last_bit);
+        }
+        return count;
+    }
+
+    /// Counts the positions from `first_counted` on where a match ends
+    uint64_t count_mismatches(const uint8_t* data, std::size_t size, std::size_t first_counted) const
+    {
+        // state[d] has bit i set when pattern[0, i] matches the text that ends
+        // at the current position with at most d mismatches
+        thread_local std::vector<uint64_t> state;
+        state.assign((max_errors + 1) * words, 0);
+
+        uint64_t count = 0;
+        for (std::size_t position = 0; position < size; position++) {
+            const uint64_t* mask = byte_masks.data() + data[position] * words;
+
+            // Higher error counts first, they read the previous vector before it moves
+            for (std::size_t errors = max_errors + 1; errors-- > 0;) {
+                uint64_t* current = state.data() + errors * words;
+                const uint64_t* fewer = errors > 0 ? current - words : nullptr;
+                uint64_t carry = 1, fewer_carry = 1;
+                for (std::size_t word = 0; word < words; word++) {
+                    uint64_t shifted = (current[word] << 1) | carry;
+                    carry = current[word] >> 63;
+                    uint64_t next = shifted & mask[word];
+                    if (fewer) {
+                        next |= (fewer[word] << 1) | fewer_carry;
+                        fewer_carry = fewer[word] >> 63;
+                    }
+                    current[word] = next;
+                }
+            }
+
+            if (position >= first_counted && (state[max_errors * words + words - 1] & last_bit))
+                count++;
+        }
+        return count;
+    }
+
+    /// Myers' algorithm for patterns of up to 64 bytes
+    uint64_t count_edits_word(const uint8_t* data, std::size_t size, std::size_t first_counted) const
+    {
+        uint64_t pv = ~uint64_t(0), mv = 0;
+        uint64_t count = 0;
+        uint64_t score = length;
+        for (std::size_t position = 0; position < size; position++) {
+            uint64_t eq = byte_masks[data[position]];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+
+            score += (ph & last_bit) != 0;
+            score -= (mh & last_bit) != 0;
+
+            ph <<= 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            count += position >= first_counted && score <= max_errors;
+        }
+        return count;
+    }
+
+    /// Myers' algorithm in 64 bit blocks (the formulation of edlib). Vertical
+    /// deltas of the DP column are kept as positive/negative bit vectors, and
+    /// `score` tracks the last row
+    uint64_t count_edits(const uint8_t* data, std::size_t size, std::size_t first_counted) const
+    {
+        thread_local std::vector<uint64_t> positive, negative;
+        positive.assign(words, ~uint64_t(0));
+        negative.assign(words, 0);
+
+        uint64_t count = 0;
+        uint64_t score = length;
+        for (std::size_t position = 0; position < size; position++) {
+            const uint64_t* mask = byte_masks.data() + data[position] * words;
+
+            // Horizontal delta entering the top of the block. Matches may start
+            // anywhere, so the top row is all zeros
+            int carry = 0;
+            for (std::size_t word = 0; word < words; word++) {
+                uint64_t high_bit = word + 1 == words ? last_bit : uint64_t(1) << 63;
+                uint64_t pv = positive[word], mv = negative[word], eq = mask[word];
+
+                uint64_t xv = eq | mv;
+                if (carry < 0)
+                    eq |= 1;
+                uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+                uint64_t ph = mv | ~(xh | pv);
+                uint64_t mh = pv & xh;
+
+                int out = (ph & high_bit) ? 1 : (mh & high_bit) ? -1 : 0;
+                ph <<= 1;
+                mh <<= 1;
+                if (carry < 0)
+                    mh |= 1;
+                else if (carry > 0)
+                    ph |= 1;
+
+                positive[word] = mh | ~(xv | ph);
+                negative[word] = ph & xv;
+                carry = out;
+            }
+            score += carry;
+
+            if (position >= first_counted && score <= max_errors)
+                count++;
+        }
+        return count;
+    }
+
+public:
+    ApproximateMatcher(const std::string& pattern, MatchMode mode)
+        : kind(mode.kind)
+        , max_errors(mode.max_errors)
+        , length(pattern.size())
+        , words(std::max<std::size_t>(1, (pattern.size() + 63) / 64))
+        , last_bit(uint64_t(1) << ((std::max<std::size_t>(pattern.size(), 1) - 1) % 64))
+        , byte_masks(256 * words, 0)
+    {
+        for (std::size_t i = 0; i < pattern.size(); i++)
+            byte_masks[static_cast<uint8_t>(pattern[i]) * words + i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    /// Longest text a match can span
+    inline std::size_t match_length() const
+    {
+        return kind == MatchKind::edits ? length + max_errors : length;
+    }
+
+    /// Counts the positions of `data` from `first_counted` on where a match ends
+    uint64_t count(const char* data, std::size_t size, std::size_t first_counted) const
+    {
+        if (length == 0)
+            return 0;
+
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+        if (kind == MatchKind::edits)
+            return words == 1 ? count_edits_word(bytes, size, first_counted) : count_edits(bytes, size, first_counted);
+
+        if (words == 1) {
+            switch (max_errors) {
+            case 0:
+                return count_mismatches_word<0>(bytes, size, first_counted);
+            case 1:
+                return count_mismatches_word<1>(bytes, size, first_counted);
+            case 2:
+                return count_mismatches_word<2>(bytes, size, first_counted);
+            case 3:
+                return count_mismatches_word<3>(bytes, size, first_counted);
+            case 4:
+                return count_mismatches_word<4>(bytes, size, first_counted);
+            }
+        }
+        return count_mismatches(bytes, size, first_counted);
+    }
+};
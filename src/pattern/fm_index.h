@@ -0,0 +1,398 @@
+#pragma once
+
+/* FM-index of a text, to count the occurrences of a pattern in O(m) time,
+independent of the text size.
+
+Build: suffix array by prefix doubling (radix sorted, O(n log n)), then the
+Burrows-Wheeler transform of the text. The suffix array takes four arrays of
+positions, 32 bit while the shard has fewer than 2^32 rows and 64 bit past
+that, so the build peaks at about 16 bytes per text byte (32 for shards of
+4 GiB and more) plus the shard itself. The end of the text is an implicit
+sentinel smaller than every byte; its BWT row (`primary`) holds a 0 byte
+that `occurrences` discounts.
+
+Query: backward search over the pattern. Each step needs the amount of a
+byte in a prefix of the BWT, answered by a wavelet matrix over the bytes the
+shard uses (renumbered densely, so plain text needs 6 or 7 bit levels
+instead of 8). Each level is a bit vector with its rank counts interleaved
+in every cache line (one uint64 running count and 448 bits), so a rank
+costs one cache miss.
+
+Serialized shard, all fields uint64 so the mapping can be used in place:
+
+    FmShardHeader
+    levels       `level_count` x `level_words` (interleaved counts and bits)
+    overlap      the `overlap_length` bytes that follow the shard text,
+                 padded to 8 bytes
+
+An index is split in shards that cover consecutive byte ranges of the text.
+Each one also indexes the `max_pattern_length - 1` bytes after its range, so
+matches crossing the boundary are found, and the matches that fit entirely
+in those bytes (the next shard counts them) are subtracted by scanning them.
+*/
+
+#include "simd_search.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+constexpr std::size_t FM_MAX_LEVELS = 8;
+constexpr uint64_t FM_ABSENT_BYTE = UINT64_MAX;
+constexpr std::size_t FM_BITS_PER_LINE = 448; // 7 words of bits after the count
+
+struct FmShardHeader {
+    uint64_t text_begin; // Offset of the shard in the text
+    uint64_t text_length; // Bytes of the text the shard counts
+    uint64_t overlap_length; // Bytes after them that are indexed too
+    uint64_t rows; // text_length + overlap_length + 1 (the sentinel)
+    uint64_t primary; // Row of the sentinel in the BWT
+    uint64_t level_count; // Bits of the byte codes
+    uint64_t level_words; // Words of each wavelet level
+    uint64_t zeros[FM_MAX_LEVELS]; // Zero bits of each level
+    uint64_t code[256]; // Dense code of each byte, FM_ABSENT_BYTE if unused
+    uint64_t first_row[256]; // First row of the suffixes that start with each byte
+    uint64_t wavelet_start[256]; // Final wavelet position of each code's rank 0
+};
+
+/// Suffix array of `text` plus the sentinel suffix, which is always first.
+/// `Index` must hold size + 1
+template <typename Index>
+inline std::vector<Index> build_suffix_array(const uint8_t* text, std::size_t size)
+{
+    const std::size_t n = size + 1;
+    std::vector<Index> suffixes(n), rank(n), scratch(n);
+    std::vector<Index> buckets(std::max<std::size_t>(257, n) + 1);
+
+    // Sorts `scratch` by `rank` into `suffixes`, keeping the order of equal ranks
+    auto counting_sort = [&](std::size_t rank_count) {
+        std::fill(buckets.begin(), buckets.begin() + rank_count + 1, 0);
+        for (std::size_t i = 0; i < n; i++)
+            buckets[rank[scratch[i]] + 1]++;
+        for (std::size_t r = 1; r <= rank_count; r++)
+            buckets[r] += buckets[r - 1];
+        for (std::size_t i = 0; i < n; i++)
+            suffixes[buckets[rank[scratch[i]]]++] = scratch[i];
+    };
+
+    for (std::size_t i = 0; i < size; i++)
+        rank[i] = text[i] + 1;
+    rank[size] = 0;
+    for (std::size_t i = 0; i < n; i++)
+        scratch[i] = i;
+    counting_sort(257);
+
+    std::size_t rank_count = 257;
+    for (std::size_t k = 1;; k <<= 1) {
+        // Order by the rank k bytes ahead: suffixes shorter than k first (the
+        // sentinel already made them unique), then the previous order shifted
+        std::size_t next = 0;
+        for (std::size_t i = n - std::min(k, n); i < n; i++)
+            scratch[next++] = i;
+        for (std::size_t i = 0; i < n; i++) {
+            if (suffixes[i] >= k)
+                scratch[next++] = suffixes[i] - k;
+        }
+        counting_sort(rank_count);
+
+        // New ranks, equal only if both halves are equal
+        scratch[suffixes[0]] = 0;
+        Index current = 0;
+        for (std::size_t i = 1; i < n; i++) {
+            Index a = suffixes[i - 1], b = suffixes[i];
+            Index a_next = a + k < n ? rank[a + k] : std::numeric_limits<Index>::max();
+            Index b_next = b + k < n ? rank[b + k] : std::numeric_limits<Index>::max();
+            if (rank[a] != rank[b] || a_next != b_next)
+                current++;
+            scratch[b] = current;
+        }
+        rank.swap(scratch);
+        rank_count = current + 1;
+        if (rank_count == n)
+            break;
+    }
+    return suffixes;
+}
+
+/// Rank of the 1 bits before `position` in an interleaved level. Always
+/// inlined so the popcounts use the instruction set of the caller
+__attribute__((always_inline)) inline uint64_t fm_rank1(const uint64_t* level, uint64_t position)
+{
+    const uint64_t* line = level + (position / FM_BITS_PER_LINE) * 8;
+    uint64_t offset = position % FM_BITS_PER_LINE;
+    uint64_t count = line[0];
+    for (uint64_t word = 0; word < offset / 64; word++)
+        count += __builtin_popcountll(line[1 + word]);
+    if (offset % 64 != 0)
+        count += __builtin_popcountll(line[1 + offset / 64] & ((uint64_t(1) << (offset % 64)) - 1));
+    return count;
+}
+
+/// Builds the serialized shard for `text[0, length + overlap)`, counting the
+/// occurrences that start in the first `length` bytes. `begin` is only stored
+inline std::vector<uint64_t> build_fm_shard(
+    const char* text,
+    uint64_t begin,
+    uint64_t length,
+    uint64_t overlap)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text);
+    const uint64_t size = length + overlap;
+    const uint64_t rows = size + 1;
+
+    FmShardHeader header {};
+    header.text_begin = begin;
+    header.text_length = length;
+    header.overlap_length = overlap;
+    header.rows = rows;
+    header.level_words = (rows / FM_BITS_PER_LINE + 1) * 8;
+
+    uint64_t byte_counts[256] = {};
+    for (uint64_t i = 0; i < size; i++)
+        byte_counts[bytes[i]]++;
+    header.first_row[0] = 1;
+    for (std::size_t byte = 1; byte < 256; byte++)
+        header.first_row[byte] = header.first_row[byte - 1] + byte_counts[byte - 1];
+
+    uint64_t code_count = 0;
+    for (std::size_t byte = 0; byte < 256; byte++)
+        header.code[byte] = byte_counts[byte] ? code_count++ : FM_ABSENT_BYTE;
+    header.level_count = 1;
+    while ((uint64_t(1) << header.level_count) < code_count)
+        header.level_count++;
+
+    // Burrows-Wheeler transform as byte codes, the sentinel row gets code 0
+    std::vector<uint8_t> bwt(rows);
+    auto transform = [&](const auto& suffixes) {
+        for (uint64_t row = 0; row < rows; row++) {
+            if (suffixes[row] == 0) {
+                header.primary = row;
+                bwt[row] = 0;
+            } else
+                bwt[row] = header.code[bytes[suffixes[row] - 1]];
+        }
+    };
+    // 32 bit positions while they fit, they halve the memory of the build
+    if (rows <= std::numeric_limits<uint32_t>::max())
+        transform(build_suffix_array<uint32_t>(bytes, size));
+    else
+        transform(build_suffix_array<uint64_t>(bytes, size));
+
+    const std::size_t header_words = sizeof(FmShardHeader) / sizeof(uint64_t);
+    const std::size_t overlap_words = (overlap + 7) / 8;
+    std::vector<uint64_t> shard(header_words + header.level_count * header.level_words + overlap_words, 0);
+
+    // Wavelet matrix, most significant bit first. Each level stably moves
+    // the zeros before the ones for the next level
+    std::vector<uint8_t> next(rows);
+    for (std::size_t level = 0; level < header.level_count; level++) {
+        uint64_t* words = shard.data() + header_words + level * header.level_words;
+        const unsigned bit = header.level_count - 1 - level;
+
+        uint64_t ones = 0;
+        for (uint64_t row = 0; row < rows; row++) {
+            uint64_t* line = words + (row / FM_BITS_PER_LINE) * 8;
+            uint64_t offset = row % FM_BITS_PER_LINE;
+            if (offset == 0)
+                line[0] = ones;
+            if ((bwt[row] >> bit) & 1) {
+                line[1 + offset / 64] |= uint64_t(1) << (offset % 64);
+                ones++;
+            }
+        }
+        // The count of the line past the end, used by rank(rows)
+        if (rows % FM_BITS_PER_LINE == 0)
+            words[(rows / FM_BITS_PER_LINE) * 8] = ones;
+        header.zeros[level] = rows - ones;
+
+        uint64_t zero_index = 0, one_index = rows - ones;
+        for (uint64_t row = 0; row < rows; row++) {
+            if ((bwt[row] >> bit) & 1)
+                next[one_index++] = bwt[row];
+            else
+                next[zero_index++] = bwt[row];
+        }
+        bwt.swap(next);
+    }
+
+    for (uint64_t code = 0; code < code_count; code++) {
+        uint64_t position = 0;
+        for (std::size_t level = 0; level < header.level_count; level++) {
+            const uint64_t* words = shard.data() + header_words + level * header.level_words;
+            uint64_t ones = fm_rank1(words, position);
+            position = ((code >> (header.level_count - 1 - level)) & 1) ? header.zeros[level] + ones : position - ones;
+        }
+        header.wavelet_start[code] = position;
+    }
+
+    memcpy(shard.data(), &header, sizeof(header));
+    memcpy(shard.data() + header_words + header.level_count * header.level_words, text + length, overlap);
+    return shard;
+}
+
+/// Read only view of a serialized shard, usually inside a mapped index file
+class FmShard {
+    const FmShardHeader* header = nullptr;
+    const uint64_t* levels = nullptr;
+    const char* overlap = nullptr;
+
+    /// Position of `row` after following the bits of `code` down the levels
+    __attribute__((always_inline)) inline uint64_t wavelet_position(uint64_t code, uint64_t row) const
+    {
+        const uint64_t level_count = header->level_count;
+        for (std::size_t level = 0; level < level_count; level++) {
+            uint64_t ones = fm_rank1(levels + level * header->level_words, row);
+            row = ((code >> (level_count - 1 - level)) & 1) ? header->zeros[level] + ones : row - ones;
+        }
+        return row;
+    }
+
+    /// Amount of the byte with `code` in the BWT rows [0, row)
+    __attribute__((always_inline)) inline uint64_t occurrences(uint64_t code, uint64_t row) const
+    {
+        uint64_t count = wavelet_position(code, row) - header->wavelet_start[code];
+        if (code == 0 && row > header->primary)
+            count--;
+        return count;
+    }
+
+    /// Backward search: amount of suffixes that start with `pattern`
+    __attribute__((always_inline)) inline uint64_t matching_rows(const std::string& pattern) const
+    {
+        uint64_t low = 0, high = header->rows;
+        for (std::size_t i = pattern.size(); i-- > 0 && low < high;) {
+            uint8_t byte = pattern[i];
+            uint64_t code = header->code[byte];
+            if (code == FM_ABSENT_BYTE)
+                return 0;
+            low = header->first_row[byte] + occurrences(code, low);
+            high = header->first_row[byte] + occurrences(code, high);
+        }
+        return low < high ? high - low : 0;
+    }
+
+#ifdef SIMD_SEARCH_X86_KERNELS
+    /// Same search with the popcount instruction instead of the portable builtin
+    __attribute__((target("popcnt"))) uint64_t matching_rows_popcnt(const std::string& pattern) const
+    {
+        return matching_rows(pattern);
+    }
+#endif
+
+public:
+    FmShard() = default;
+
+    explicit FmShard(const uint64_t* data)
+        : header(reinterpret_cast<const FmShardHeader*>(data))
+    {
+        levels = data + sizeof(FmShardHeader) / sizeof(uint64_t);
+        overlap = reinterpret_cast<const char*>(levels + header->level_count * header->level_words);
+    }
+
+    inline uint64_t text_begin() const { return header->text_begin; }
+    inline uint64_t text_length() const { return header->text_length; }
+
+    /// Occurrences of `pattern` that start in the shard's own bytes
+    uint64_t count(const std::string& pattern) const
+    {
+        if (pattern.empty())
+            return 0;
+
+#ifdef SIMD_SEARCH_X86_KERNELS
+        uint64_t rows = cpu_features().popcnt ? matching_rows_popcnt(pattern) : matching_rows(pattern);
+#else
+        uint64_t rows = matching_rows(pattern);
+#endif
+        if (rows == 0)
+            return 0;
+        return rows - count_occurrences(overlap, header->overlap_length, pattern);
+    }
+};
+
+/* Index file: a 64 byte header, the offset of every shard (uint64) and the
+shards, each starting at a multiple of 8 bytes.
+
+    offset  size  field
+    0       8     magic "MPIFMIDX"
+    8       4     version (1)
+    12      4     shard count
+    16      8     text size
+    24      8     max pattern length
+    32      32    reserved, zero
+*/
+
+struct FmIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t shard_count;
+    uint64_t text_size;
+    uint64_t max_pattern_length;
+    uint64_t reserved[4];
+};
+
+static_assert(sizeof(FmIndexHeader) == 64, "The index file header must be 64 bytes");
+
+constexpr char FM_INDEX_MAGIC[8] = { 'M', 'P', 'I', 'F', 'M', 'I', 'D', 'X' };
+constexpr uint32_t FM_INDEX_VERSION = 1;
+
+inline FmIndexHeader make_fm_index_header(uint32_t shard_count, uint64_t text_size, uint64_t max_pattern_length)
+{
+    FmIndexHeader header {};
+    memcpy(header.magic, FM_INDEX_MAGIC, sizeof(header.magic));
+    header.version = FM_INDEX_VERSION;
+    header.shard_count = shard_count;
+    header.text_size = text_size;
+    header.max_pattern_length = max_pattern_length;
+    return header;
+}
+
+/// Counts patterns over every shard of an index file held in memory
+class FmIndex {
+    std::vector<FmShard> shards;
+    uint64_t longest_pattern = 0;
+
+public:
+    /// Validates the index at `data` (8 byte aligned) and sets up its shards.
+    /// Returns false if it isn't an index file
+    bool open(const char* data, uint64_t size)
+    {
+        if (size < sizeof(FmIndexHeader))
+            return false;
+
+        const FmIndexHeader* header = reinterpret_cast<const FmIndexHeader*>(data);
+        if (memcmp(header->magic, FM_INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != FM_INDEX_VERSION)
+            return false;
+        if (sizeof(FmIndexHeader) + header->shard_count * sizeof(uint64_t) > size)
+            return false;
+
+        const uint64_t* offsets = reinterpret_cast<const uint64_t*>(data + sizeof(FmIndexHeader));
+        shards.clear();
+        for (uint32_t shard = 0; shard < header->shard_count; shard++) {
+            if (offsets[shard] % 8 != 0 || offsets[shard] + sizeof(FmShardHeader) > size)
+                return false;
+            shards.emplace_back(reinterpret_cast<const uint64_t*>(data + offsets[shard]));
+        }
+        longest_pattern = header->max_pattern_length;
+        return true;
+    }
+
+    inline uint64_t max_pattern_length() const { return longest_pattern; }
+
+    /// Every occurrence of `pattern` in the text, overlapping ones included.
+    /// Returns false for patterns longer than the index was built for, when
+    /// matches could cross more than one shard boundary
+    bool count(const std::string& pattern, uint64_t& count) const
+    {
+        count = 0;
+        if (pattern.size() > longest_pattern && shards.size() > 1)
+            return false;
+
+        for (const FmShard& shard : shards)
+            count += shard.count(pattern);
+        return true;
+    }
+};
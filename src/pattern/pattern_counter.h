@@ -0,0 +1,130 @@
+#pragma once
+
+/* Counts the occurrences of a set of patterns over blocks of text.
+
+A single pattern, or a handful of them, is searched with the SIMD kernel of
+simd_search.h, one pass per pattern over each block while it is still in
+cache. Bigger sets go through a single Aho-Corasick pass instead, whose cost
+doesn't grow with the amount of patterns.
+
+With an approximate match mode every pattern gets its own bit-parallel
+matcher instead (approximate.h), which counts the positions where a match
+with at most k errors ends.
+
+Blocks may start with `context` bytes that were already counted (the tail of
+the previous block, or the bytes before a range of the file). Only the
+matches that end after the context are counted, so consecutive blocks that
+overlap by `max_match_length() - 1` bytes count every match exactly once.
+*/
+
+#include "aho_corasick.h"
+#include "approximate.h"
+#include "simd_search.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Largest pattern set searched with one SIMD pass per pattern
+constexpr std::size_t SIMD_SEARCH_MAX_PATTERNS = 4;
+
+class PatternCounter {
+    std::vector<std::string> patterns;
+    std::unique_ptr<AhoCorasick> automaton; // Only for sets too big for the SIMD kernel
+    std::vector<ApproximateMatcher> matchers; // Only for approximate matching
+    std::size_t longest_match = 0;
+
+public:
+    /// Counters of one scan. Each thread keeps its own and reuses it for
+    /// every block it scans
+    struct Scan {
+        std::vector<uint64_t> counts; // Per pattern, SIMD kernel and approximate matchers
+        std::vector<uint64_t> visits; // Per state, Aho-Corasick
+    };
+
+    explicit PatternCounter(const std::vector<std::string>& patterns, MatchMode mode = {})
+        : patterns(patterns)
+    {
+        if (mode.kind != MatchKind::exact) {
+            for (const std::string& pattern : patterns) {
+                matchers.emplace_back(pattern, mode);
+                longest_match = std::max(longest_match, matchers.back().match_length());
+            }
+            return;
+        }
+
+        for (const std::string& pattern : patterns)
+            longest_match = std::max(longest_match, pattern.size());
+
+        if (patterns.size() > SIMD_SEARCH_MAX_PATTERNS)
+            automaton = std::make_unique<AhoCorasick>(patterns);
+    }
+
+    /// Longest text a match can span
+    inline std::size_t max_match_length() const { return longest_match; }
+    inline const char* method() const
+    {
+        return !matchers.empty() ? "bit-parallel" : automaton ? "aho-corasick" : "simd";
+    }
+
+    Scan start_scan() const
+    {
+        Scan scan;
+        if (automaton)
+            scan.visits.assign(automaton->state_count(), 0);
+        else
+            scan.counts.assign(patterns.size(), 0);
+        return scan;
+    }
+
+    /// Counts the matches of `size` bytes of text that end after its first
+    /// `context` bytes
+    void count(Scan& scan, const char* data, std::size_t size, std::size_t context) const
+    {
+        context = std::min(context, size);
+
+        if (automaton) {
+            uint32_t row = automaton->skip(data, context, automaton->start());
+            automaton->scan(data + context, size - context, row, scan.visits.data());
+            return;
+        }
+
+        if (!matchers.empty()) {
+            for (std::size_t index = 0; index < matchers.size(); index++) {
+                std::size_t window = std::max<std::size_t>(matchers[index].match_length(), 1);
+                std::size_t skipped = context - std::min(context, window - 1);
+                scan.counts[index] += matchers[index].count(data + skipped, size - skipped, context - skipped);
+            }
+            return;
+        }
+
+        const CountOccurrencesFn kernel = count_occurrences_kernel();
+        for (std::size_t index = 0; index < patterns.size(); index++) {
+            const std::string& pattern = patterns[index];
+            if (pattern.empty())
+                continue;
+
+            // Matches of this pattern that start here end after the context
+            std::size_t skipped = context - std::min(context, pattern.size() - 1);
+            scan.counts[index] += kernel(data + skipped, size - skipped, pattern.data(), pattern.size());
+        }
+    }
+
+    /// Adds the counters of `other` to `scan`
+    void merge(Scan& scan, const Scan& other) const
+    {
+        for (std::size_t i = 0; i < scan.counts.size(); i++)
+            scan.counts[i] += other.counts[i];
+        for (std::size_t i = 0; i < scan.visits.size(); i++)
+            scan.visits[i] += other.visits[i];
+    }
+
+    /// The amount of occurrences of every pattern, in the order they were given
+    std::vector<uint64_t> pattern_counts(const Scan& scan) const
+    {
+        return automaton ? automaton->pattern_counts(scan.visits) : scan.counts;
+    }
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+/* Vectorized single pattern search ("generic SIMD" substring search).
+
+For every block of W positions the first byte of the pattern is compared
+against the text at those positions, and the last byte against the text
+m - 1 positions further. Only positions where both match are candidates, and
+only those are verified with memcmp. For patterns of 1 or 2 bytes the two
+comparisons already are the whole check, so matches are just popcounted.
+
+    sse2      W = 16
+    avx2      W = 32
+    avx512bw  W = 64
+
+Every occurrence is counted, overlapping ones included. The kernels never
+allocate and the widest one the CPU supports is chosen at runtime.
+*/
+
+#include "../common/cpu_features.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SEARCH_X86_KERNELS 1
+#endif
+
+using CountOccurrencesFn = uint64_t (*)(const char* text, std::size_t size, const char* pattern, std::size_t length);
+
+/// Counts the occurrences of `pattern` that fit completely in the text
+inline uint64_t count_occurrences_scalar(
+    const char* text,
+    std::size_t size,
+    const char* pattern,
+    std::size_t length)
+{
+    if (length == 0 || size < length)
+        return 0;
+
+    uint64_t count = 0;
+    const char first = pattern[0];
+    for (std::size_t i = 0; i + length <= size; i++) {
+        if (text[i] == first && memcmp(text + i + 1, pattern + 1, length - 1) == 0)
+            count++;
+    }
+    return count;
+}
+
+#ifdef SIMD_SEARCH_X86_KERNELS
+
+/// Counts the candidates of one block, verifying them when the pattern is
+/// longer than the two bytes already compared
+inline uint64_t count_candidates(
+    uint64_t mask,
+    const char* block,
+    const char* pattern,
+    std::size_t length)
+{
+    if (length <= 2)
+        return __builtin_popcountll(mask);
+
+    uint64_t count = 0;
+    while (mask != 0) {
+        std::size_t offset = __builtin_ctzll(mask);
+        if (memcmp(block + offset + 1, pattern + 1, length - 2) == 0)
+            count++;
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+__attribute__((target("sse2"))) inline uint64_t count_occurrences_sse2(
+    const char* text,
+    std::size_t size,
+    const char* pattern,
+    std::size_t length)
+{
+    if (length == 0 || size < length)
+        return 0;
+
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[length - 1]);
+
+    uint64_t count = 0;
+    std::size_t i = 0;
+    for (; i + length - 1 + 16 <= size; i += 16) {
+        __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + length - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(first, block_first),
+            _mm_cmpeq_epi8(last, block_last)));
+        count += count_candidates(mask, text + i, pattern, length);
+    }
+    return count + count_occurrences_scalar(text + i, size - i, pattern, length);
+}
+
+__attribute__((target("avx2"))) inline uint64_t count_occurrences_avx2(
+    const char* text,
+    std::size_t size,
+    const char* pattern,
+    std::size_t length)
+{
+    if (length == 0 || size < length)
+        return 0;
+
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[length - 1]);
+
+    uint64_t count = 0;
+    std::size_t i = 0;
+    for (; i + length - 1 + 32 <= size; i += 32) {
+        __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        __m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i + length - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(first, block_first),
+            _mm256_cmpeq_epi8(last, block_last)));
+        count += count_candidates(mask, text + i, pattern, length);
+    }
+    return count + count_occurrences_scalar(text + i, size - i, pattern, length);
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline uint64_t count_occurrences_avx512(
+    const char* text,
+    std::size_t size,
+    const char* pattern,
+    std::size_t length)
+{
+    if (length == 0 || size < length)
+        return 0;
+
+    const __m512i first = _mm512_set1_epi8(pattern[0]);
+    const __m512i last = _mm512_set1_epi8(pattern[length - 1]);
+
+    uint64_t count = 0;
+    std::size_t i = 0;
+    for (; i + length - 1 + 64 <= size; i += 64) {
+        __m512i block_first = _mm512_loadu_si512(text + i);
+        __m512i block_last = _mm512_loadu_si512(text + i + length - 1);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(first, block_first) & _mm512_cmpeq_epi8_mask(last, block_last);
+        count += count_candidates(mask, text + i, pattern, length);
+    }
+    return count + count_occurrences_scalar(text + i, size - i, pattern, length);
+}
+
+#endif
+
+/// The widest kernel supported by the running CPU, chosen once
+inline CountOccurrencesFn count_occurrences_kernel()
+{
+    static const CountOccurrencesFn kernel = [] {
+#ifdef SIMD_SEARCH_X86_KERNELS
+        const CpuFeatures& features = cpu_features();
+        if (features.avx512bw)
+            return count_occurrences_avx512;
+        if (features.avx2)
+            return count_occurrences_avx2;
+        if (features.sse2)
+            return count_occurrences_sse2;
+#endif
+        return count_occurrences_scalar;
+    }();
+    return kernel;
+}
+
+inline uint64_t count_occurrences(
+    const char* text,
+    std::size_t size,
+    const std::string& pattern)
+{
+    return count_occurrences_kernel()(text, size, pattern.data(), pattern.size());
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+/* Read ahead for inputs that can only be read once, front to back (pipes,
+stdin, or files on slow network storage).
+
+A reader thread fills a ring of large buffers while the caller scans the
+ones already filled, so reading and matching overlap instead of taking
+turns. Each buffer starts with the last `overlap` bytes of the previous one
+(its context), so matches that cross a buffer boundary are found by the
+buffer where they end; see PatternCounter::count.
+
+The reader thread never calls MPI. It runs on every core of the process,
+not on the single core ThreadPool pinned the caller to.
+*/
+
+#include "../common/thread_pool.h"
+#include "text_file.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class StreamRing {
+    struct Buffer {
+        std::vector<char> data;
+        std::size_t size = 0;
+        std::size_t context = 0;
+    };
+
+    const TextFile& file;
+    const std::size_t overlap;
+    const std::size_t read_size;
+    std::vector<Buffer> buffers;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::size_t> free_buffers;
+    std::deque<std::size_t> filled_buffers;
+    bool finished = false;
+    bool stopping = false;
+
+    std::thread reader;
+
+    void read_loop()
+    {
+        std::vector<char> tail(overlap);
+        std::size_t tail_size = 0;
+
+        while (true) {
+            std::size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stopping || !free_buffers.empty(); });
+                if (stopping)
+                    return;
+                index = free_buffers.front();
+                free_buffers.pop_front();
+            }
+
+            Buffer& buffer = buffers[index];
+            memcpy(buffer.data.data(), tail.data(), tail_size);
+            std::size_t bytes_read = file.read(buffer.data.data() + tail_size, read_size);
+            buffer.size = tail_size + bytes_read;
+            buffer.context = tail_size;
+
+            // Keeps the end of this buffer for the next one
+            tail_size = std::min(overlap, buffer.size);
+            memcpy(tail.data(), buffer.data.data() + buffer.size - tail_size, tail_size);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (bytes_read == 0) {
+                free_buffers.push_back(index);
+                finished = true;
+            } else
+                filled_buffers.push_back(index);
+            changed.notify_all();
+            if (finished)
+                return;
+        }
+    }
+
+public:
+    /// A filled buffer: `size` bytes, of which the first `context` were
+    /// already part of the previous buffer
+    struct Block {
+        const char* data;
+        std::size_t size;
+        std::size_t context;
+        std::size_t index;
+    };
+
+    /// Starts reading `file` from its current position into `buffer_count`
+    /// buffers of `read_size` new bytes each
+    StreamRing(
+        const TextFile& file,
+        std::size_t overlap,
+        std::size_t buffer_count,
+        std::size_t read_size)
+        : file(file)
+        , overlap(overlap)
+        , read_size(read_size)
+        , buffers(buffer_count)
+    {
+        for (std::size_t index = 0; index < buffer_count; index++) {
+            buffers[index].data.resize(overlap + read_size);
+            free_buffers.push_back(index);
+        }
+        reader = std::thread(&StreamRing::read_loop, this);
+        ThreadPool::instance().unpin(reader.native_handle());
+    }
+
+    ~StreamRing()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        reader.join();
+    }
+
+    StreamRing(const StreamRing&) = delete;
+    StreamRing& operator=(const StreamRing&) = delete;
+
+    /// Waits for the next filled buffer, in input order. Returns false once
+    /// the input is over
+    bool next(Block& block)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return finished || !filled_buffers.empty(); });
+        if (filled_buffers.empty())
+            return false;
+
+        std::size_t index = filled_buffers.front();
+        filled_buffers.pop_front();
+        block = { buffers[index].data.data(), buffers[index].size, buffers[index].context, index };
+        return true;
+    }
+
+    /// Hands a buffer returned by `next` back to the reader
+    void release(const Block& block)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_buffers.push_back(block.index);
+        }
+        changed.notify_all();
+    }
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+/* Read only access to the text the patterns are searched in.
+
+Regular files are memory mapped, so the matchers scan the page cache directly
+without any copy or syscall per block. The mapping is advised as sequential
+(aggressive read ahead, pages dropped behind the scan) and as a huge page
+candidate, which lowers TLB misses where the file system supports it.
+
+When the file can't be mapped (pipes, or mmap failing because the file is
+too big for the address space) `read_at` and `read` fall back to large
+block reads into a buffer owned by the caller.
+
+The path `-` stands for the standard input of the process.
+*/
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Path that reads the standard input
+constexpr const char* STDIN_PATH = "-";
+
+/// Whether `path` names a regular file, which can be mapped and read at any
+/// offset. Pipes, devices and the standard input can only be streamed
+inline bool is_regular_file(const std::string& path)
+{
+    struct stat status;
+    return path != STDIN_PATH && stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode);
+}
+
+class TextFile {
+    int descriptor = -1;
+    uint64_t file_size = 0;
+    bool regular = false;
+    const char* mapping = nullptr;
+
+public:
+    /// Opens `path`, mapping it unless `map` is false
+    explicit TextFile(const std::string& path, bool map = true)
+    {
+        descriptor = path == STDIN_PATH ? dup(STDIN_FILENO) : open(path.c_str(), O_RDONLY);
+        if (descriptor < 0)
+            return;
+
+        struct stat status;
+        if (fstat(descriptor, &status) == 0 && S_ISREG(status.st_mode)) {
+            regular = true;
+            file_size = status.st_size;
+        }
+
+        if (regular && map && file_size > 0) {
+            void* address = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if (address != MAP_FAILED) {
+                mapping = static_cast<const char*>(address);
+                madvise(address, file_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+                madvise(address, file_size, MADV_HUGEPAGE);
+#endif
+            }
+        }
+
+        if (!mapping)
+            posix_fadvise(descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    ~TextFile()
+    {
+        if (mapping)
+            munmap(const_cast<char*>(mapping), file_size);
+        if (descriptor >= 0)
+            close(descriptor);
+    }
+
+    TextFile(const TextFile&) = delete;
+    TextFile& operator=(const TextFile&) = delete;
+
+    /// For mappings read at random (an index rather than a text): drops the
+    /// sequential advice and asks for the whole file to be read in
+    void advise_random_access() const
+    {
+        if (!mapping)
+            return;
+        void* address = const_cast<char*>(mapping);
+        madvise(address, file_size, MADV_RANDOM);
+        madvise(address, file_size, MADV_WILLNEED);
+    }
+
+    inline bool is_open() const { return descriptor >= 0; }
+
+    /// Whether the size is known and `read_at` can be used (not a pipe)
+    inline bool is_seekable() const { return regular; }
+    inline bool is_mapped() const { return mapping != nullptr; }
+
+    inline uint64_t size() const { return file_size; }
+
+    /// The whole file, only when it is mapped
+    inline const char* data() const { return mapping; }
+
+    /// Reads up to `size` bytes at `offset`, retrying short reads. Returns the
+    /// amount read, less than `size` only at the end of the file or on error.
+    /// Safe to call from several threads at once
+    std::size_t read_at(char* buffer, std::size_t size, uint64_t offset) const
+    {
+        std::size_t total = 0;
+        while (total < size) {
+            ssize_t bytes_read = pread(descriptor, buffer + total, size - total, offset + total);
+            if (bytes_read < 0 && errno == EINTR)
+                continue;
+            if (bytes_read <= 0)
+                break;
+            total += bytes_read;
+        }
+        return total;
+    }
+
+    /// Reads up to `size` bytes from the current position, for files that
+    /// can't seek. Same return value as `read_at`
+    std::size_t read(char* buffer, std::size_t size) const
+    {
+        std::size_t total = 0;
+        while (total < size) {
+            ssize_t bytes_read = ::read(descriptor, buffer + total, size - total);
+            if (bytes_read < 0 && errno == EINTR)
+                continue;
+            if (bytes_read <= 0)
+                break;
+            total += bytes_read;
+        }
+        return total;
+    }
+};
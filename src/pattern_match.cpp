@@ -6,160 +6,565 @@ g++ -std=c++11 -pthread -O3 -o ejercicio2.out ../src/ejercicio2.cpp
 
 /* Command for testing results
 grep -o `pattern` `file` | wc -l
+
+Overlapping occurrences are counted too ("aa" appears twice in "aaa"), so for
+patterns that can overlap with themselves grep reports less matches.
 */
 
+#include "common/instrumentation.h"
+#include "common/mpi_utils.h"
+#include "common/options.h"
+#include "common/thread_pool.h"
+#include "pattern/fm_index.h"
+#include "pattern/pattern_counter.h"
+#include "pattern/stream_ring.h"
+#include "pattern/text_file.h"
+
+#include <algorithm>
 #include <chrono>
-#include <filesystem>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <mpi/mpi.h>
 #include <stdlib.h>
 #include <string.h>
-#include <thread>
 #include <vector>
 
 int32_t s_rank;
 int32_t s_size;
 const uint32_t s_root_rank = 0;
 
-/// The most basic pattern matching method O(len(src) * len(pattern))
-/// Returns the start index of the first match or -1 if not found
-int32_t pattern_match(
-    const std::string& src,
-    const std::string& pattern)
+/// Size of the blocks the text is scanned (and read) in
+constexpr std::size_t READ_BLOCK_SIZE = 1 << 20;
+
+/// Counts the matches that end in the bytes [begin, end) of the file. The
+/// `max_match_length - 1` bytes before `begin` are used as context, so
+/// matches that start before the range are found too, and each match is
+/// counted by exactly one range. Consecutive blocks overlap the same way.
+/// Mapped files are scanned in place, the others are read with pread
+bool scan_file_range(
+    const PatternCounter& counter,
+    const TextFile& file,
+    uint64_t begin,
+    uint64_t end,
+    PatternCounter::Scan& scan)
 {
+    const std::size_t overlap = std::max<std::size_t>(counter.max_match_length(), 1) - 1;
+    const uint64_t context = std::min<uint64_t>(begin, overlap);
+
+    if (file.is_mapped()) {
+        for (uint64_t block = begin; block < end; block += READ_BLOCK_SIZE) {
+            uint64_t block_context = block == begin ? context : overlap;
+            uint64_t block_end = std::min<uint64_t>(end, block + READ_BLOCK_SIZE);
+            counter.count(scan, file.data() + block - block_context, block_end - block + block_context, block_context);
+        }
+        return true;
+    }
 
-    for (uint32_t i = 0; i <= src.length() - pattern.size(); i++) {
-        if (!strncmp(src.c_str() + i, pattern.c_str(), pattern.size()))
-            return i;
+    // Reused by every range the thread scans
+    thread_local std::vector<char> buffer;
+    buffer.resize(std::max(buffer.size(), READ_BLOCK_SIZE + overlap));
+
+    std::size_t carried = file.read_at(buffer.data(), context, begin - context);
+    uint64_t offset = begin;
+    while (offset < end) {
+        std::size_t bytes_read = file.read_at(buffer.data() + carried, std::min<uint64_t>(READ_BLOCK_SIZE, end - offset), offset);
+        if (bytes_read == 0)
+            return false;
+
+        std::size_t size = carried + bytes_read;
+        counter.count(scan, buffer.data(), size, carried);
+        offset += bytes_read;
+
+        // Keeps the tail as the context of the next block
+        std::size_t kept = std::min(overlap, size);
+        memmove(buffer.data(), buffer.data() + size - kept, kept);
+        carried = kept;
     }
-    return -1;
+    return true;
 }
 
-/// Given an open file, counts the amount of occurrences of the given pattern
-uint32_t file_pattern_match(
-    std::shared_ptr<std::ifstream> file,
-    const std::string pattern)
+/// Size of the buffers a stream is read into, and how many are in flight
+constexpr std::size_t STREAM_BUFFER_SIZE = 8 << 20;
+constexpr std::size_t STREAM_BUFFER_COUNT = 4;
+
+/// Counts the matches of an input that is read once, front to back (a pipe).
+/// A reader thread fills the next buffers while the pool threads scan the
+/// current one, each thread a slice of it
+void scan_stream(
+    const PatternCounter& counter,
+    const TextFile& file,
+    PatternCounter::Scan& scan)
 {
+    const std::size_t overlap = std::max<std::size_t>(counter.max_match_length(), 1) - 1;
+    StreamRing ring(file, overlap, STREAM_BUFFER_COUNT, STREAM_BUFFER_SIZE);
+
+    ThreadPool& pool = ThreadPool::instance();
+    const std::size_t slice_count = pool.size();
+    std::vector<PatternCounter::Scan> slice_scans(slice_count, counter.start_scan());
+
+    StreamRing::Block block;
+    while (ring.next(block)) {
+        const std::size_t new_bytes = block.size - block.context;
+        INSTRUMENT_COUNT("bytes scanned", new_bytes);
+        pool.parallel_for(0, slice_count, 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t slice = first; slice < last; slice++) {
+                std::size_t begin = block.context + new_bytes * slice / slice_count;
+                std::size_t end = block.context + new_bytes * (slice + 1) / slice_count;
+                std::size_t context = std::min(begin, overlap);
+                counter.count(slice_scans[slice], block.data + begin - context, end - begin + context, context);
+            }
+        });
+        ring.release(block);
+    }
+
+    for (const PatternCounter::Scan& slice_scan : slice_scans)
+        counter.merge(scan, slice_scan);
+}
+
+void print_counts(
+    const std::vector<std::string>& patterns,
+    const std::vector<uint64_t>& counts)
+{
+    for (uint32_t pattern_index = 0; pattern_index < patterns.size(); pattern_index++)
+        std::cout << "Node " << s_rank << ", processed \"" << patterns[pattern_index] << "\": " << counts[pattern_index] << std::endl;
+}
 
-    char buffer[2048];
-    uint32_t remainder = 0;
-    uint32_t count = 0;
+/// Scans the bytes [begin, end) of the file, in a single pass when the pool
+/// has one thread. Otherwise the range is split in chunks that the threads
+/// scan with the same counter
+bool scan_file_parallel(
+    const PatternCounter& counter,
+    const TextFile& file,
+    uint64_t begin,
+    uint64_t end,
+    PatternCounter::Scan& scan)
+{
+    INSTRUMENT_COUNT("bytes scanned", end - begin);
+    if (ThreadPool::instance().size() == 1)
+        return scan_file_range(counter, file, begin, end, scan);
+
+    const uint64_t chunk_size = std::max<uint64_t>(READ_BLOCK_SIZE, (end - begin) / (ThreadPool::instance().size() * 4));
+    const uint64_t chunk_count = (end - begin + chunk_size - 1) / chunk_size;
+
+    std::vector<PatternCounter::Scan> chunk_scans(chunk_count);
+    std::vector<char> complete(chunk_count, 0);
+
+    ThreadPool::instance().parallel_for(0, chunk_count, 1, [&](std::size_t first, std::size_t last) {
+        for (std::size_t chunk = first; chunk < last; chunk++) {
+            uint64_t chunk_begin = begin + chunk * chunk_size;
+            chunk_scans[chunk] = counter.start_scan();
+            complete[chunk] = scan_file_range(
+                counter, file, chunk_begin, std::min(end, chunk_begin + chunk_size), chunk_scans[chunk]);
+        }
+    });
 
-    while (file->read(buffer + remainder, sizeof(buffer) - remainder) || file->gcount() > 0) {
+    for (std::size_t chunk = 0; chunk < chunk_count; chunk++) {
+        if (!complete[chunk])
+            return false;
+        counter.merge(scan, chunk_scans[chunk]);
+    }
+    return true;
+}
 
-        uint32_t bytes_read = remainder + file->gcount();
-        // Null-terminate the buffer for safe string operations
-        buffer[bytes_read] = '\0';
+/// Counts `patterns` over the whole file. Returns false if it can't be read
+bool count_patterns(
+    const std::vector<std::string>& patterns,
+    const TextFile& file,
+    MatchMode mode,
+    std::vector<uint64_t>& counts)
+{
+    if (!file.is_open())
+        return false;
 
-        std::string line(buffer);
+    PatternCounter counter(patterns, mode);
+    PatternCounter::Scan scan = counter.start_scan();
 
-        int32_t match_index = pattern_match(line, pattern);
+    if (!file.is_seekable())
+        scan_stream(counter, file, scan);
+    else if (!scan_file_parallel(counter, file, 0, file.size(), scan))
+        return false;
 
-        // The pattern was found
-        if (match_index != -1) {
-            remainder = line.size() - match_index - pattern.size();
-            count += 1;
-        }
+    counts = counter.pattern_counts(scan);
+    return true;
+}
 
-        // In case it did match, adds some remainder for patterns that
-        // lay between buffer reads. Super important!
-        else
-            remainder = pattern.size();
+/// Text split: every node counts all the patterns over its own byte range of
+/// the file, and the counts are added up on the root. Ranges overlap by
+/// `max_match_length - 1` bytes (see `scan_file_range`), so a match that
+/// crosses a boundary is counted by the node where it ends
+void count_text_range(
+    const std::vector<std::string>& patterns,
+    const TextFile& file,
+    MatchMode mode)
+{
+    if (patterns.empty())
+        return;
 
-        // Amount of chars read for finding the pattern
-        uint32_t read_chars = line.size() - remainder;
+    PatternCounter counter(patterns, mode);
+    PatternCounter::Scan scan = counter.start_scan();
 
-        memmove(buffer, line.c_str() + read_chars, remainder);
+    const uint64_t begin = file.size() * s_rank / s_size;
+    const uint64_t end = file.size() * (s_rank + 1) / s_size;
+
+    int32_t complete;
+    {
+        INSTRUMENT_PHASE("scan text", compute);
+        complete = file.is_seekable() && scan_file_parallel(counter, file, begin, end, scan);
+    }
+    std::vector<uint64_t> counts = counter.pattern_counts(scan);
+
+    std::vector<uint64_t> totals(counts.size(), 0);
+    {
+        INSTRUMENT_PHASE("reduction", communication);
+        MPI_Reduce(s_rank == s_root_rank ? MPI_IN_PLACE : &complete, &complete, 1, MPI_INT32_T, MPI_LAND, s_root_rank, MPI_COMM_WORLD);
+        MPI_Reduce(counts.data(), totals.data(), counts.size(), MPI_UINT64_T, MPI_SUM, s_root_rank, MPI_COMM_WORLD);
+    }
+
+    if (s_rank != s_root_rank)
+        return;
+    if (!complete) {
+        std::cerr << "Error reading file, splitting the text needs a regular file on every node" << std::endl;
+        return;
     }
-    return count;
+    print_counts(patterns, totals);
 }
 
-void count_single_threaded(
-    const std::vector<std::string>& patterns,
-    const std::string& pattern_match_filepath)
+/* Pattern split with dynamic scheduling.
+
+The root cuts the patterns into batches. Each batch travels packed (see
+`pack_strings`), so a long pattern doesn't pad the short ones. The first
+batch of every rank goes out with one MPI_Scatterv, and a second one right
+after, so that workers always have the next batch queued while they count.
+Every time a worker reports the counts of a batch, the root sends it another
+one, until there are none left and it gets an empty batch. Ranks that happen
+to draw expensive patterns simply take fewer batches.
+
+The root counts batches too. Between its own batches it answers the reports
+that arrived (MPI_Testsome over one MPI_Irecv per worker).
+
+How small the batches can be depends on what a batch costs. Counting with
+the text scans the whole file and builds an automaton for every batch, so
+there each rank gets a single batch, its share of the patterns, and reads
+the file once: the balance is static. With the FM-index a batch costs the
+length of its patterns whatever the size of the text, so the patterns are
+cut in INDEX_BATCHES_PER_RANK batches per rank and balanced as they finish.
+*/
+
+constexpr int TAG_BATCH = 1;
+constexpr int TAG_COUNTS = 2;
+
+/// Batches each rank holds at once: the one being counted and the next one
+constexpr std::size_t BATCHES_IN_FLIGHT = 2;
+
+/// Batches per rank when counting with the index, where small batches are cheap
+constexpr std::size_t INDEX_BATCHES_PER_RANK = 8;
+
+/// Counts a batch of patterns, returning false if it couldn't
+using BatchCounter = std::function<bool(const std::vector<std::string>& patterns, std::vector<uint64_t>& counts)>;
+
+/// Receives the next batch from the root, of unknown size
+std::vector<char> receive_batch()
 {
+    INSTRUMENT_PHASE("receive batch", communication);
+    MPI_Status status;
+    MPI_Probe(s_root_rank, TAG_BATCH, MPI_COMM_WORLD, &status);
+
+    int size;
+    MPI_Get_count(&status, MPI_CHAR, &size);
+    std::vector<char> batch(size);
+    MPI_Recv(batch.data(), size, MPI_CHAR, s_root_rank, TAG_BATCH, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    return batch;
+}
 
-    // Pattern matching for all the patterns
-    for (uint32_t pattern_index = 0; pattern_index < patterns.size(); pattern_index++) {
-        auto match_file = std::make_shared<std::ifstream>(pattern_match_filepath);
+/// Worker side: counts batches until the root sends an empty one. Reports
+/// are the counts preceded by a flag telling whether the batch was counted
+void count_scheduled_patterns(const BatchCounter& count_batch)
+{
+    std::vector<char> batch;
+    {
+        INSTRUMENT_PHASE("receive batch", communication);
+        int packed_size;
+        MPI_Scatter(nullptr, 1, MPI_INT, &packed_size, 1, MPI_INT, s_root_rank, MPI_COMM_WORLD);
+        batch.resize(packed_size);
+        MPI_Scatterv(nullptr, nullptr, nullptr, MPI_CHAR, batch.data(), packed_size, MPI_CHAR, s_root_rank, MPI_COMM_WORLD);
+    }
 
-        if (!match_file->is_open()) {
-            std::cerr << "Error opening file" << std::endl;
-            return;
+    while (!batch.empty()) {
+        std::vector<std::string> patterns = unpack_strings(batch);
+        std::vector<uint64_t> counts;
+        bool complete;
+        {
+            INSTRUMENT_PHASE("count batch", compute);
+            complete = count_batch(patterns, counts);
         }
 
-        const std::string pattern = patterns[pattern_index];
-
-        uint32_t count = file_pattern_match(
-            match_file,
-            pattern);
+        std::vector<uint64_t> report(1 + patterns.size(), 0);
+        report[0] = complete;
+        if (complete)
+            std::copy(counts.begin(), counts.end(), report.begin() + 1);
+        INSTRUMENT_COUNT("bytes sent", report.size() * sizeof(uint64_t));
+        {
+            INSTRUMENT_PHASE("send counts", communication);
+            MPI_Send(report.data(), report.size(), MPI_UINT64_T, s_root_rank, TAG_COUNTS, MPI_COMM_WORLD);
+        }
 
-        match_file->close();
-        std::cout << "Node " << s_rank << ", processed \"" << patterns[pattern_index] << "\": " << count << std::endl;
+        batch = receive_batch();
     }
 }
 
-/// @brief Returns a vector of the patterns that should be processed by the node
-std::vector<std::string> scatter_patterns(const std::vector<std::string>& all_patterns)
+/// Root side: hands out the batches of `batch_size` patterns and prints the
+/// counts of every pattern along with the node that processed it
+void schedule_patterns(
+    const std::vector<std::string>& patterns,
+    std::size_t batch_size,
+    const BatchCounter& count_batch)
 {
+    // Batches of consecutive patterns, [first, last)
+    batch_size = std::max<std::size_t>(1, batch_size);
+    std::vector<std::pair<std::size_t, std::size_t>> batches;
+    for (std::size_t first = 0; first < patterns.size(); first += batch_size)
+        batches.emplace_back(first, std::min(patterns.size(), first + batch_size));
+
+    std::vector<uint64_t> counts(patterns.size(), 0);
+    std::vector<int32_t> processed_by(patterns.size(), -1);
+
+    std::vector<std::deque<std::size_t>> queued(s_size);
+    std::size_t next_batch = 0;
+    auto pack_next = [&](int32_t rank) {
+        if (next_batch == batches.size())
+            return std::vector<char>();
+        queued[rank].push_back(next_batch);
+        auto [first, last] = batches[next_batch++];
+        return pack_strings(patterns.data() + first, patterns.data() + last);
+    };
+
+    // First batch of every rank
+    std::vector<std::vector<char>> first_batches(s_size);
+    std::vector<int> packed_sizes(s_size), displacements(s_size);
+    std::vector<char> packed;
+    for (int32_t rank = 0; rank < s_size; rank++) {
+        first_batches[rank] = pack_next(rank);
+        packed_sizes[rank] = first_batches[rank].size();
+        displacements[rank] = packed.size();
+        packed.insert(packed.end(), first_batches[rank].begin(), first_batches[rank].end());
+    }
+    int own_size;
+    INSTRUMENT_COUNT("bytes sent", packed.size());
+    {
+        INSTRUMENT_PHASE("scatter batches", communication);
+        MPI_Scatter(packed_sizes.data(), 1, MPI_INT, &own_size, 1, MPI_INT, s_root_rank, MPI_COMM_WORLD);
+        MPI_Scatterv(packed.data(), packed_sizes.data(), displacements.data(), MPI_CHAR,
+            MPI_IN_PLACE, own_size, MPI_CHAR, s_root_rank, MPI_COMM_WORLD);
+    }
 
-    uint32_t max_pattern_size = 32;
+    // Queues the second batch of the workers that got a first one, and
+    // listens for their reports. A report is always listened for before the
+    // worker is sent another batch: the worker may be blocked sending it, and
+    // once both messages are past the eager limit neither send would complete
+    std::vector<MPI_Request> requests(s_size, MPI_REQUEST_NULL);
+    std::vector<std::vector<uint64_t>> reports(s_size);
+    auto listen = [&](int32_t rank) {
+        std::size_t first = batches[queued[rank].front()].first;
+        std::size_t last = batches[queued[rank].front()].second;
+        reports[rank].assign(1 + last - first, 0);
+        MPI_Irecv(reports[rank].data(), reports[rank].size(), MPI_UINT64_T, rank, TAG_COUNTS, MPI_COMM_WORLD, &requests[rank]);
+    };
+
+    for (int32_t rank = 0; rank < s_size; rank++) {
+        if (rank == static_cast<int32_t>(s_root_rank) || queued[rank].empty())
+            continue;
+        listen(rank);
+        for (std::size_t i = 1; i < BATCHES_IN_FLIGHT; i++) {
+            std::vector<char> batch = pack_next(rank);
+            if (batch.empty())
+                break;
+            INSTRUMENT_COUNT("bytes sent", batch.size());
+            MPI_Send(batch.data(), batch.size(), MPI_CHAR, rank, TAG_BATCH, MPI_COMM_WORLD);
+        }
+    }
 
-    for (auto& pattern : all_patterns) {
-        if (pattern.size() > max_pattern_size)
-            max_pattern_size = pattern.size();
+    bool complete = true;
+    auto record = [&](int32_t rank, std::size_t batch, const uint64_t* batch_counts, bool batch_complete) {
+        complete &= batch_complete;
+        for (std::size_t index = batches[batch].first; index < batches[batch].second; index++) {
+            counts[index] = batch_counts[index - batches[batch].first];
+            processed_by[index] = rank;
+        }
+    };
+
+    // Records the reports that arrived, answering each with a new batch (or
+    // an empty one once the batches run out)
+    std::vector<int> finished(s_size);
+    std::vector<char> stopped(s_size, 0);
+    auto serve = [&](bool wait) {
+        INSTRUMENT_PHASE("serve workers", communication);
+        int finished_count;
+        if (wait)
+            MPI_Waitsome(s_size, requests.data(), &finished_count, finished.data(), MPI_STATUSES_IGNORE);
+        else
+            MPI_Testsome(s_size, requests.data(), &finished_count, finished.data(), MPI_STATUSES_IGNORE);
+        if (finished_count == MPI_UNDEFINED)
+            return false;
+
+        for (int i = 0; i < finished_count; i++) {
+            int32_t rank = finished[i];
+            std::size_t batch = queued[rank].front();
+            queued[rank].pop_front();
+            record(rank, batch, reports[rank].data() + 1, reports[rank][0]);
+            if (!queued[rank].empty())
+                listen(rank);
+
+            std::vector<char> next = pack_next(rank);
+            if (!next.empty() || !stopped[rank]) {
+                INSTRUMENT_COUNT("bytes sent", next.size());
+                MPI_Send(next.data(), next.size(), MPI_CHAR, rank, TAG_BATCH, MPI_COMM_WORLD);
+                stopped[rank] = next.empty();
+            }
+            if (requests[rank] == MPI_REQUEST_NULL && !queued[rank].empty())
+                listen(rank);
+        }
+        return true;
+    };
+
+    // Counts its own batches, answering the workers in between
+    while (!queued[s_root_rank].empty()) {
+        std::size_t batch = queued[s_root_rank].front();
+        queued[s_root_rank].pop_front();
+
+        std::vector<std::string> batch_patterns(patterns.begin() + batches[batch].first, patterns.begin() + batches[batch].second);
+        std::vector<uint64_t> batch_counts;
+        bool batch_complete;
+        {
+            INSTRUMENT_PHASE("count batch", compute);
+            batch_complete = count_batch(batch_patterns, batch_counts);
+        }
+        batch_counts.resize(batch_patterns.size(), 0);
+        record(s_root_rank, batch, batch_counts.data(), batch_complete);
+
+        serve(false);
+        pack_next(s_root_rank);
     }
 
-    // Broadcasts the total amount of patterns ---------------------------
-    uint32_t total_patterns = all_patterns.size();
-    MPI_Bcast(&total_patterns, 1, MPI_INT, s_root_rank, MPI_COMM_WORLD);
+    // Waits for the last reports
+    while (serve(true)) {
+    }
 
-    uint32_t patterns_per_process = (total_patterns + s_size - 1) / s_size; // Rounded up
+    if (!complete)
+        std::cerr << "Some node couldn't count its patterns, their counts are 0" << std::endl;
+    for (std::size_t index = 0; index < patterns.size(); index++)
+        std::cout << "Node " << processed_by[index] << ", processed \"" << patterns[index] << "\": " << counts[index] << '\n';
+    std::cout << std::flush;
+}
 
-    // Prepare the send buffer for root (flatten the strings into a char array)
-    std::vector<char> send_buffer;
-    if (s_rank == s_root_rank) {
-        send_buffer.resize(patterns_per_process * s_size * max_pattern_size, '\0'); // Null-padded buffer
+/// Default longest pattern an index answers when it has several shards
+constexpr uint64_t DEFAULT_INDEX_PATTERN_LENGTH = 256;
+
+/// Builds the FM-index of the text, one shard per rank over its byte range
+/// (see fm_index.h), and writes every shard into the index file at `index_path`
+/// with collective MPI-IO. The path has to be on a file system all the nodes share
+bool build_index(
+    const TextFile& file,
+    const std::string& index_path,
+    uint64_t max_pattern_length)
+{
+    int32_t readable = file.is_seekable();
+    MPI_Allreduce(MPI_IN_PLACE, &readable, 1, MPI_INT32_T, MPI_LAND, MPI_COMM_WORLD);
+    if (!readable) {
+        if (s_rank == s_root_rank)
+            std::cerr << "Error reading file, building an index needs a regular file on every node" << std::endl;
+        return false;
+    }
 
-        for (uint32_t i = 0; i < total_patterns; ++i) {
-            std::copy(all_patterns[i].begin(), all_patterns[i].end(),
-                send_buffer.begin() + i * max_pattern_size);
+    const double start_time = MPI_Wtime();
+    const uint64_t begin = file.size() * s_rank / s_size;
+    const uint64_t end = file.size() * (s_rank + 1) / s_size;
+    const uint64_t overlap = std::min(std::max<uint64_t>(max_pattern_length, 1) - 1, file.size() - end);
+
+    std::vector<uint64_t> shard;
+    {
+        INSTRUMENT_PHASE("build shard", compute);
+        if (file.is_mapped())
+            shard = build_fm_shard(file.data() + begin, begin, end - begin, overlap);
+        else {
+            std::vector<char> text(end - begin + overlap);
+            file.read_at(text.data(), text.size(), begin);
+            shard = build_fm_shard(text.data(), begin, end - begin, overlap);
         }
     }
+    INSTRUMENT_COUNT("bytes scanned", end - begin);
+
+    // Shards follow the header and the offset table, in rank order
+    const uint64_t shard_bytes = shard.size() * sizeof(uint64_t);
+    uint64_t offset = 0;
+    std::vector<uint64_t> offsets(s_size);
+    uint64_t index_size;
+    {
+        INSTRUMENT_PHASE("shard offsets", communication);
+        MPI_Exscan(&shard_bytes, &offset, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        if (s_rank == 0)
+            offset = 0;
+        offset += sizeof(FmIndexHeader) + s_size * sizeof(uint64_t);
+
+        MPI_Gather(&offset, 1, MPI_UINT64_T, offsets.data(), 1, MPI_UINT64_T, s_root_rank, MPI_COMM_WORLD);
+        index_size = offset + shard_bytes;
+        MPI_Bcast(&index_size, 1, MPI_UINT64_T, s_size - 1, MPI_COMM_WORLD);
+    }
 
-    // Each process will receive a buffer for its patterns
-    std::vector<char> recv_buffer(patterns_per_process * max_pattern_size, '\0');
+    INSTRUMENT_PHASE("write index", io);
+    MPI_File index;
+    int status = MPI_File_open(MPI_COMM_WORLD, index_path.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &index);
+    if (status != MPI_SUCCESS) {
+        if (s_rank == s_root_rank)
+            std::cerr << "Error creating " << index_path << std::endl;
+        return false;
+    }
+    MPI_File_set_size(index, index_size);
 
-    // Scatter the flattened patterns to all processes
-    MPI_Scatter(
-        send_buffer.data(), patterns_per_process * max_pattern_size, MPI_CHAR,
-        recv_buffer.data(), patterns_per_process * max_pattern_size, MPI_CHAR,
-        0, MPI_COMM_WORLD);
+    if (s_rank == s_root_rank) {
+        FmIndexHeader header = make_fm_index_header(s_size, file.size(), max_pattern_length);
+        MPI_File_write_at(index, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+        MPI_File_write_at(index, sizeof(header), offsets.data(), s_size, MPI_UINT64_T, MPI_STATUS_IGNORE);
+    }
+    status = MPI_File_write_at_all(index, offset, shard.data(), shard.size(), MPI_UINT64_T, MPI_STATUS_IGNORE);
+    MPI_File_close(&index);
 
-    // Reconstruct the local patterns from the received buffer
-    std::vector<std::string> local_patterns;
-    for (int i = 0; i < patterns_per_process; ++i) {
-        std::string pattern(
-            recv_buffer.begin() + i * max_pattern_size,
-            recv_buffer.begin() + (i + 1) * max_pattern_size);
-        pattern = pattern.c_str(); // Truncate any null padding
-        if (!pattern.empty()) {
-            local_patterns.push_back(pattern);
-            std::cout << "Rank " << s_rank << " received pattern: " << pattern << std::endl;
-        }
+    int32_t complete = status == MPI_SUCCESS;
+    MPI_Allreduce(MPI_IN_PLACE, &complete, 1, MPI_INT32_T, MPI_LAND, MPI_COMM_WORLD);
+    if (s_rank == s_root_rank) {
+        if (complete)
+            std::cout << "Indexed " << file.size() << " bytes in " << s_size << " shards (" << index_size << " bytes) in "
+                      << MPI_Wtime() - start_time << " s, patterns up to " << max_pattern_length << " bytes" << std::endl;
+        else
+            std::cerr << "Error writing " << index_path << std::endl;
     }
+    return complete;
+}
 
-    return local_patterns;
+/// Counts a batch with the index, spreading the patterns over the pool threads
+bool count_with_index(
+    const FmIndex& index,
+    const std::vector<std::string>& patterns,
+    std::vector<uint64_t>& counts)
+{
+    counts.assign(patterns.size(), 0);
+    std::vector<char> answered(patterns.size(), 0);
+    ThreadPool::instance().parallel_for(0, patterns.size(), 256, [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; i++)
+            answered[i] = index.count(patterns[i], counts[i]);
+    });
+    return std::all_of(answered.begin(), answered.end(), [](char value) { return value; });
 }
 
 int main(int argc, char** argv)
 {
 
-    // Initializes MPI
-    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
+    // Initializes MPI. Only the main thread calls MPI, the pool threads just compute
+    int thread_support;
+    if (MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support) != MPI_SUCCESS) {
         std::cout << "Error while initializing MPI" << std::endl;
         return 1;
     }
@@ -167,45 +572,106 @@ int main(int argc, char** argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &s_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &s_size);
 
+    if (thread_support < MPI_THREAD_FUNNELED && s_rank == s_root_rank)
+        std::cout << "Warning: the MPI library does not support MPI_THREAD_FUNNELED\n";
+
+    // Every rank receives the same arguments, so the thread count is read locally
+    const char* threads_option = take_option(argc, argv, "--threads");
+    ThreadPool::configure(threads_option ? atol(threads_option) : 1);
+    const bool split_text = take_flag(argc, argv, "--split-text");
+    const bool map_input = !take_flag(argc, argv, "--no-mmap");
+    const bool stream_input = take_flag(argc, argv, "--stream");
+    const char* build_index_option = take_option(argc, argv, "--build-index");
+    const char* index_option = take_option(argc, argv, "--index");
+    const char* max_length_option = take_option(argc, argv, "--max-pattern-length");
+    const char* mismatches_option = take_option(argc, argv, "--mismatches");
+    const char* edits_option = take_option(argc, argv, "--edits");
+    const InstrumentationOptions instrumentation = take_instrumentation_options(argc, argv);
+    INSTRUMENT_START(MPI_COMM_WORLD);
+
+    MatchMode mode;
+    if (mismatches_option)
+        mode = { MatchKind::mismatches, static_cast<uint32_t>(atol(mismatches_option)) };
+    else if (edits_option)
+        mode = { MatchKind::edits, static_cast<uint32_t>(atol(edits_option)) };
+
     std::string patterns_filepath;
     std::string pattern_match_filepath;
 
     if (s_rank == s_root_rank) {
-        if (argc != 3) {
+        const int expected_arguments = build_index_option || index_option ? 1 : 2;
+        if (argc != expected_arguments + 1) {
             std::cout << "The program expects 2 arguments. "
                       << "First the filepath that contains all the patterns, "
-                      << "and second the filepath that contains the matching file\n";
-            MPI_Finalize();
-            return 1;
+                      << "and second the filepath that contains the matching file.\n"
+                      << "By default every node scans the whole file once for an even share of the patterns.\n"
+                      << "Options:\n"
+                      << "  --threads N    threads per node, 0 uses every available core\n"
+                      << "  --split-text   every node counts all the patterns over its part of the file,\n"
+                      << "                 instead of the whole file for its share of the patterns\n"
+                      << "  --no-mmap      read the file in blocks instead of mapping it\n"
+                      << "  --stream       read the file once, ahead of the matching, for slow storage. Always\n"
+                      << "                 used for - (standard input) and pipes. Only the root counts then\n"
+                      << "  --mismatches K counts the matches with at most K substituted bytes\n"
+                      << "  --edits K      counts the matches with at most K insertions, deletions or substitutions.\n"
+                      << "                 Approximate matches are counted once per position where one ends\n"
+                      << "  --trace FILE   writes the phases of every node into FILE, as a Chrome trace\n"
+                      << "  --profile      prints the time of every phase and the imbalance between the nodes\n"
+                      << "Index modes, for many pattern files over the same matching file:\n"
+                      << "  --build-index INDEX {matching file}   builds the FM-index of the file into INDEX\n"
+                      << "  --max-pattern-length N               longest pattern the index answers (default "
+                      << DEFAULT_INDEX_PATTERN_LENGTH << ")\n"
+                      << "  --index INDEX {patterns file}        counts the patterns with the index, handing them out\n"
+                      << "                                       in small batches as the nodes finish the previous ones\n";
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if ((build_index_option || index_option) && mode.kind != MatchKind::exact) {
+            std::cout << "The index only counts exact matches, --mismatches and --edits can't be used with it" << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if (mismatches_option && edits_option) {
+            std::cout << "Only one of --mismatches and --edits can be given" << std::endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        if (build_index_option)
+            pattern_match_filepath = argv[1];
+        else if (index_option)
+            patterns_filepath = argv[1];
+        else {
+            patterns_filepath = argv[1];
+            pattern_match_filepath = argv[2];
         }
-        patterns_filepath = argv[1];
-        pattern_match_filepath = argv[2];
     }
 
     // Broadcasts the pattern matching filepath -----------------------------------------------------------
-    // Broadcast the length of the string first
-    int length = pattern_match_filepath.size();
-    MPI_Bcast(&length, 1, MPI_INT, s_root_rank, MPI_COMM_WORLD);
-
-    // Resize the string on other ranks to accommodate the incoming data
-    if (s_rank != s_root_rank)
-        pattern_match_filepath.resize(length);
+    {
+        INSTRUMENT_PHASE("broadcast", communication);
+        broadcast_string(pattern_match_filepath, s_root_rank, MPI_COMM_WORLD);
+    }
 
-    // Broadcast the actual string data (as a char array)
-    MPI_Bcast(&pattern_match_filepath[0], length, MPI_CHAR, s_root_rank, MPI_COMM_WORLD);
+    if (build_index_option) {
+        TextFile text(pattern_match_filepath, map_input);
+        uint64_t max_pattern_length = max_length_option ? atoll(max_length_option) : DEFAULT_INDEX_PATTERN_LENGTH;
+        bool built = build_index(text, build_index_option, max_pattern_length);
+        instrumentation.report(s_root_rank, MPI_COMM_WORLD);
+        MPI_Finalize();
+        return built ? 0 : 1;
+    }
 
     // Now all ranks have `pattern_match_filepath`
-    std::cout << "Rank " << s_rank << " received filepath: " << pattern_match_filepath << std::endl;
+    if (!index_option)
+        std::cout << "Rank " << s_rank << " received filepath: " << pattern_match_filepath << std::endl;
 
     /// Reads the patterns ----------------------------------------------
     std::vector<std::string> patterns;
 
     if (s_rank == s_root_rank) {
+        INSTRUMENT_PHASE("read patterns", io);
         auto patterns_file = std::ifstream(patterns_filepath);
 
         if (!patterns_file.is_open()) {
             std::cerr << "Error opening file" << std::endl;
-            return 1;
+            MPI_Abort(MPI_COMM_WORLD, 1);
         }
 
         std::string line;
@@ -216,12 +682,74 @@ int main(int argc, char** argv)
         patterns_file.close();
     }
 
-    /// Gets the patterns that the node should process
-    std::vector<std::string> local_patterns = scatter_patterns(patterns);
+    // Inputs that can only be read once are streamed by the root, which
+    // counts every pattern in that single pass
+    int32_t streaming = 0;
+    if (s_rank == s_root_rank && !index_option)
+        streaming = stream_input || !is_regular_file(pattern_match_filepath);
+    MPI_Bcast(&streaming, 1, MPI_INT32_T, s_root_rank, MPI_COMM_WORLD);
+
+    if (streaming) {
+        if (s_rank == s_root_rank) {
+            TextFile text(pattern_match_filepath, false);
+            if (!text.is_open())
+                std::cerr << "Error opening file" << std::endl;
+            else if (!patterns.empty()) {
+                PatternCounter counter(patterns, mode);
+                PatternCounter::Scan scan = counter.start_scan();
+                {
+                    INSTRUMENT_PHASE("scan stream", compute);
+                    scan_stream(counter, text, scan);
+                }
+                print_counts(patterns, counter.pattern_counts(scan));
+            }
+        }
+    } else if (index_option) {
+        // Every node maps the whole index and answers its batches with it
+        TextFile index_file(index_option);
+        index_file.advise_random_access();
+        FmIndex index;
+        int32_t opened;
+        {
+            INSTRUMENT_PHASE("open index", io);
+            opened = index_file.is_mapped() && index.open(index_file.data(), index_file.size());
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &opened, 1, MPI_INT32_T, MPI_LAND, MPI_COMM_WORLD);
+        if (!opened) {
+            if (s_rank == s_root_rank)
+                std::cerr << index_option << " is not an index file" << std::endl;
+            MPI_Finalize();
+            return 1;
+        }
 
-    // Processes the patterns
-    count_single_threaded(local_patterns, pattern_match_filepath);
+        BatchCounter count_batch = [&](const std::vector<std::string>& batch, std::vector<uint64_t>& counts) {
+            return count_with_index(index, batch, counts);
+        };
+        if (s_rank == s_root_rank)
+            schedule_patterns(patterns, patterns.size() / (s_size * INDEX_BATCHES_PER_RANK), count_batch);
+        else
+            count_scheduled_patterns(count_batch);
+    } else if (split_text) {
+        // Every node needs all the patterns
+        TextFile text(pattern_match_filepath, map_input);
+        {
+            INSTRUMENT_PHASE("broadcast patterns", communication);
+            broadcast_strings(patterns, s_root_rank, MPI_COMM_WORLD);
+        }
+        count_text_range(patterns, text, mode);
+    } else {
+        TextFile text(pattern_match_filepath, map_input);
+        BatchCounter count_batch = [&](const std::vector<std::string>& batch, std::vector<uint64_t>& counts) {
+            return count_patterns(batch, text, mode, counts);
+        };
+        // Every batch is a pass over the whole file, so one batch per rank
+        if (s_rank == s_root_rank)
+            schedule_patterns(patterns, (patterns.size() + s_size - 1) / s_size, count_batch);
+        else
+            count_scheduled_patterns(count_batch);
+    }
 
+    instrumentation.report(s_root_rank, MPI_COMM_WORLD);
     if (MPI_Finalize() != MPI_SUCCESS) {
         std::cout << "Error finalizing MPI" << std::endl;
         return 1;
@@ -0,0 +1,151 @@
+#pragma once
+
+/* Deterministic Miller-Rabin for 64 bit numbers.
+
+Numbers with a factor up to 53 are settled by trial division (a multiply by
+the modular inverse and a compare for each, no division), which rejects
+about 85% of random odd inputs before any exponentiation. The rest run
+Miller-Rabin with a base set known to have no strong pseudoprimes below
+its bound: {2, 7, 61} below 2^32 and the 7 bases of Jim Sinclair for every
+64 bit number.
+
+Modular products use Montgomery form (R = 2^64): one 64x64->128 multiply
+for the product and two more for the reduction, instead of a 128 bit
+division.
+*/
+
+#include <cstddef>
+#include <cstdint>
+
+/// Odd primes tried by division before Miller-Rabin
+constexpr uint32_t MILLER_RABIN_SMALL_PRIMES[] = { 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53 };
+constexpr uint64_t MILLER_RABIN_SMALL_PRIME_SQUARE = 59 * 59;
+
+constexpr uint64_t MILLER_RABIN_BASES_32[] = { 2, 7, 61 };
+constexpr uint64_t MILLER_RABIN_BASES_64[] = { 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+
+/// Inverse of an odd number mod 2^64. Newton's iteration doubles the correct
+/// low bits each step, and the number is its own inverse mod 8
+constexpr uint64_t inverse_mod_2_64(uint64_t odd)
+{
+    uint64_t x = odd;
+    for (int i = 0; i < 5; i++)
+        x *= 2 - odd * x;
+    return x;
+}
+
+/// Arithmetic modulo an odd number, in Montgomery form
+class Montgomery {
+    uint64_t modulus;
+    uint64_t inverse; // -1 / modulus mod 2^64
+    uint64_t r2; // 2^128 mod modulus
+
+public:
+    explicit Montgomery(uint64_t modulus)
+        : modulus(modulus)
+    {
+        inverse = -inverse_mod_2_64(modulus);
+        uint64_t r = -modulus % modulus;
+        r2 = static_cast<uint64_t>(static_cast<unsigned __int128>(r) * r % modulus);
+    }
+
+    /// t / 2^64 mod modulus, for t < modulus * 2^64
+    inline uint64_t reduce(unsigned __int128 t) const
+    {
+        uint64_t m = static_cast<uint64_t>(t) * inverse;
+        unsigned __int128 sum = t + static_cast<unsigned __int128>(m) * modulus;
+        // The low 64 bits of sum are zero, its carry out is lost in the 128 bit add
+        bool carry = sum < t;
+        uint64_t result = static_cast<uint64_t>(sum >> 64);
+        if (carry || result >= modulus)
+            result -= modulus;
+        return result;
+    }
+
+    inline uint64_t to_form(uint64_t x) const { return reduce(static_cast<unsigned __int128>(x) * r2); }
+    inline uint64_t from_form(uint64_t x) const { return reduce(x); }
+    inline uint64_t one() const { return to_form(1); }
+    inline uint64_t multiply(uint64_t a, uint64_t b) const { return reduce(static_cast<unsigned __int128>(a) * b); }
+
+    uint64_t power(uint64_t base, uint64_t exponent) const
+    {
+        uint64_t result = one();
+        while (exponent) {
+            if (exponent & 1)
+                result = multiply(result, base);
+            base = multiply(base, base);
+            exponent >>= 1;
+        }
+        return result;
+    }
+};
+
+/// Whether `n` is a strong probable prime to `base`, with n - 1 = d * 2^s
+inline bool miller_rabin_round(const Montgomery& mont, uint64_t n, uint64_t base, uint64_t d, uint32_t s)
+{
+    base %= n;
+    if (base == 0)
+        return true;
+
+    const uint64_t one = mont.one();
+    const uint64_t minus_one = mont.to_form(n - 1);
+    uint64_t x = mont.power(mont.to_form(base), d);
+    if (x == one || x == minus_one)
+        return true;
+    for (uint32_t i = 1; i < s; i++) {
+        x = mont.multiply(x, x);
+        if (x == minus_one)
+            return true;
+    }
+    return false;
+}
+
+/// Whether `n` is divisible by the odd `divisor`: multiplying by its inverse
+/// maps the multiples, and only them, to [0, (2^64 - 1) / divisor]
+inline bool divisible(uint64_t n, uint64_t divisor)
+{
+    return n * inverse_mod_2_64(divisor) <= UINT64_MAX / divisor;
+}
+
+inline bool is_prime(uint64_t n)
+{
+    if (n < 2)
+        return false;
+    if (n % 2 == 0)
+        return n == 2;
+
+    for (uint64_t prime : MILLER_RABIN_SMALL_PRIMES) {
+        if (divisible(n, prime))
+            return n == prime;
+    }
+    if (n < MILLER_RABIN_SMALL_PRIME_SQUARE)
+        return true;
+
+    uint64_t d = n - 1;
+    uint32_t s = __builtin_ctzll(d);
+    d >>= s;
+
+    const Montgomery mont(n);
+    if (n < (uint64_t(1) << 32)) {
+        for (uint64_t base : MILLER_RABIN_BASES_32)
+            if (!miller_rabin_round(mont, n, base, d, s))
+                return false;
+        return true;
+    }
+    for (uint64_t base : MILLER_RABIN_BASES_64)
+        if (!miller_rabin_round(mont, n, base, d, s))
+            return false;
+    return true;
+}
+
+/// Tests `count` numbers, setting bit i of `bitmap` (bit i % 8 of byte i / 8)
+/// when numbers[i] is prime. The bitmap needs (count + 7) / 8 bytes
+inline void test_primality(const uint64_t* numbers, std::size_t count, uint8_t* bitmap)
+{
+    for (std::size_t byte = 0; byte * 8 < count; byte++) {
+        uint8_t bits = 0;
+        for (std::size_t bit = 0; bit < 8 && byte * 8 + bit < count; bit++)
+            bits |= static_cast<uint8_t>(is_prime(numbers[byte * 8 + bit])) << bit;
+        bitmap[byte] = bits;
+    }
+}
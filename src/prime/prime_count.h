@@ -0,0 +1,266 @@
+#pragma once
+
+/* Prime counting without enumerating the primes: the Meissel-Lehmer method
+in the form of Lagarias, Miller and Odlyzko, O(x^(2/3) log x) time.
+
+With y = cbrt(x) and a = pi(y):
+
+    pi(x) = phi(x, a) + a - 1 - P2(x, a)
+
+phi(x, a) counts the numbers up to x with no prime factor up to y. Unrolling
+phi(u, b) = phi(u, b - 1) - phi(u / p_b, b - 1) from phi(x, a), and stopping
+at the terms phi(x / n, b) with n > y, leaves
+
+    ordinary leaves  mu(n) * (x / n) for the squarefree n <= y
+    special leaves   -mu(m) * phi(x / (m * p), b) for the squarefree m <= y
+                     < m * p, with every prime factor of m above p = p_(b+1)
+
+P2(x, a) = sum over the primes y < p <= sqrt(x) of pi(x / p) - pi(p) + 1,
+and pi(x / p) = phi(x / p, a) + a - 1 since x / p < p_(a+1)^2.
+
+Every phi(u, b) left has u < x / y, so [0, x / y) is sieved in segments
+(odd numbers only, the state after crossing off 2). The primes up to y are
+crossed off one at a time and, in between, the leaves of the current prime
+that fall in the segment are answered from a Fenwick tree of the bit counts.
+phi(u, b) is the count up to u in the segment plus the amount of numbers
+before the segment not divisible by the first b primes.
+
+Ranges of the sieve are independent but for those prefixes, so each part
+(a rank, and a thread within it) counts its own range as if it started at 0
+and keeps, per b, the sum of the signs of its leaves and the count of its
+numbers not divisible by the first b primes. Adding the parts in order fixes
+each one with the counts of the parts before it (see CountPart::offset).
+
+Memory: the primes up to sqrt(x), the Mobius function and least prime
+factors up to y, and one segment per thread.
+*/
+
+#include "sieve.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Below this pi(x) comes straight from a plain sieve
+constexpr uint64_t PRIME_COUNT_DIRECT_LIMIT = 10000;
+constexpr uint64_t PRIME_COUNT_SEGMENT_WORDS = 8192;
+/// Numbers covered by a segment, odd numbers only
+constexpr uint64_t PRIME_COUNT_SEGMENT_SPAN = PRIME_COUNT_SEGMENT_WORDS * 128;
+
+/// floor(cbrt(n)), exact for every 64 bit n
+inline uint64_t integer_cbrt(uint64_t n)
+{
+    uint64_t root = static_cast<uint64_t>(std::cbrt(static_cast<double>(n)));
+    while (root > 0 && root * root * root > n)
+        root--;
+    while ((root + 1) * (root + 1) * (root + 1) <= n)
+        root++;
+    return root;
+}
+
+/// The result of counting a range of the sieve, before the counts of the
+/// ranges before it are known
+struct CountPart {
+    int64_t sum = 0;
+    std::vector<int64_t> signs; // Per b, sum of the signs of the leaves answered at b
+    std::vector<uint64_t> counts; // Per b, numbers of the range not divisible by the first b primes
+
+    explicit CountPart(std::size_t levels = 0)
+        : signs(levels)
+        , counts(levels)
+    {
+    }
+
+    /// Accounts for the `prefix` counts of every number before the range
+    void offset(const std::vector<uint64_t>& prefix)
+    {
+        for (std::size_t b = 0; b < signs.size(); b++)
+            sum += signs[b] * static_cast<int64_t>(prefix[b]);
+    }
+
+    /// Adds `next`, the part that follows this one
+    void append(CountPart next)
+    {
+        next.offset(counts);
+        sum += next.sum;
+        for (std::size_t b = 0; b < signs.size(); b++) {
+            signs[b] += next.signs[b];
+            counts[b] += next.counts[b];
+        }
+    }
+};
+
+class PrimeCounter {
+    uint64_t x;
+    uint64_t y;
+    uint64_t a; // pi(y)
+    uint64_t end; // Of the sieved range, every leaf is below it
+    std::vector<uint32_t> primes; // Up to sqrt(x)
+    std::vector<int8_t> mobius; // Up to y
+    std::vector<uint32_t> least_factor; // Up to y
+
+    /// Fenwick tree over the bit counts of the segment words
+    struct Fenwick {
+        std::vector<int32_t> tree;
+
+        void build(const uint64_t* words, std::size_t count)
+        {
+            tree.assign(count + 1, 0);
+            for (std::size_t i = 1; i <= count; i++) {
+                tree[i] += __builtin_popcountll(words[i - 1]);
+                std::size_t parent = i + (i & -i);
+                if (parent <= count)
+                    tree[parent] += tree[i];
+            }
+        }
+
+        inline void decrement(std::size_t word)
+        {
+            for (std::size_t i = word + 1; i < tree.size(); i += i & -i)
+                tree[i]--;
+        }
+
+        /// Sum of the counts of the first `words` words
+        inline int64_t prefix(std::size_t words) const
+        {
+            int64_t sum = 0;
+            for (std::size_t i = words; i > 0; i -= i & -i)
+                sum += tree[i];
+            return sum;
+        }
+    };
+
+    /// Set bits among the first `bit_count` bits of the segment
+    static inline int64_t count_bits(const Fenwick& fenwick, const uint64_t* words, uint64_t bit_count)
+    {
+        int64_t count = fenwick.prefix(bit_count / 64);
+        if (bit_count % 64)
+            count += __builtin_popcountll(words[bit_count / 64] & ((uint64_t(1) << (bit_count % 64)) - 1));
+        return count;
+    }
+
+public:
+    explicit PrimeCounter(uint64_t x)
+        : x(x)
+        , y(integer_cbrt(x))
+        , end(x / (y + 1) + 1)
+        , primes(small_primes(integer_sqrt(x)))
+        , mobius(y + 1, 1)
+        , least_factor(y + 1, 0)
+    {
+        a = std::upper_bound(primes.begin(), primes.end(), y) - primes.begin();
+
+        for (uint64_t prime : primes) {
+            if (prime > y)
+                break;
+            for (uint64_t multiple = prime; multiple <= y; multiple += prime) {
+                mobius[multiple] = -mobius[multiple];
+                if (least_factor[multiple] == 0)
+                    least_factor[multiple] = prime;
+            }
+            for (uint64_t multiple = prime * prime; multiple <= y; multiple += prime * prime)
+                mobius[multiple] = 0;
+        }
+    }
+
+    /// Whether pi(x) is computed directly, without the sieve parts
+    inline bool is_direct() const { return x < PRIME_COUNT_DIRECT_LIMIT; }
+    /// End of the range that `count_range` parts must cover, from 0
+    inline uint64_t sieve_end() const { return is_direct() ? 0 : end; }
+    /// Length of the vectors of a CountPart
+    inline std::size_t level_count() const { return a + 1; }
+
+    /// The terms that don't need the sieve: the ordinary leaves, the special
+    /// leaves of p = 2 (phi(u, 0) = u) and the constants of P2
+    int64_t direct_terms() const
+    {
+        if (is_direct())
+            return small_primes(x).size();
+
+        int64_t sum = static_cast<int64_t>(a) - 1;
+        for (uint64_t n = 1; n <= y; n++)
+            sum += mobius[n] * static_cast<int64_t>(x / n);
+        for (uint64_t m = y / 2 + 1; m <= y; m++) {
+            if (mobius[m] != 0 && (m == 1 || least_factor[m] > 2))
+                sum -= mobius[m] * static_cast<int64_t>(x / (2 * m));
+        }
+
+        // What -P2 adds besides the phi(x / p, a): pi(p) - a for each of the
+        // K primes y < p <= sqrt(x), K (K + 1) / 2 in total
+        int64_t above = static_cast<int64_t>(primes.size() - a);
+        sum += above * (above + 1) / 2;
+        return sum;
+    }
+
+    /// Counts the leaves in [begin, finish) of the sieved range, `begin` even
+    CountPart count_range(uint64_t begin, uint64_t finish) const
+    {
+        CountPart part(level_count());
+        finish = std::min(finish, end);
+        if (begin >= finish)
+            return part;
+
+        std::vector<uint64_t> words(PRIME_COUNT_SEGMENT_WORDS);
+        Fenwick fenwick;
+
+        for (uint64_t low = begin; low < finish; low += PRIME_COUNT_SEGMENT_SPAN) {
+            const uint64_t high = std::min(finish, low + PRIME_COUNT_SEGMENT_SPAN);
+            const uint64_t bit_count = (high - low) / 2;
+            const uint64_t word_count = (bit_count + 63) / 64;
+
+            // Odd numbers of [low, high), the multiples of 2 are already out
+            std::fill(words.begin(), words.begin() + word_count, ~uint64_t(0));
+            if (bit_count % 64)
+                words[word_count - 1] = (uint64_t(1) << (bit_count % 64)) - 1;
+            fenwick.build(words.data(), word_count);
+
+            const uint64_t first_quotient = low > 0 ? x / low : UINT64_MAX;
+            const uint64_t last_quotient = x / high;
+
+            for (uint64_t b = 1; b <= a; b++) {
+                if (b < a) {
+                    // Special leaves of p = p_(b+1) with x / (m * p) in the segment
+                    const uint64_t prime = primes[b];
+                    uint64_t m_first = std::max(y / prime, last_quotient / prime) + 1;
+                    uint64_t m_last = std::min(y, first_quotient / prime);
+                    for (uint64_t m = m_first; m <= m_last; m++) {
+                        if (mobius[m] == 0 || (m > 1 && least_factor[m] <= prime))
+                            continue;
+                        uint64_t u = x / (m * prime);
+                        int64_t phi = count_bits(fenwick, words.data(), (u - low + 1) / 2) + part.counts[b];
+                        part.sum -= mobius[m] * phi;
+                        part.signs[b] -= mobius[m];
+                    }
+                } else {
+                    // pi(x / p) of P2, for the primes y < p <= sqrt(x) with x / p in the segment
+                    auto first = std::upper_bound(primes.begin() + a, primes.end(), last_quotient);
+                    for (auto prime = first; prime != primes.end() && *prime <= first_quotient; ++prime) {
+                        uint64_t u = x / *prime;
+                        part.sum -= count_bits(fenwick, words.data(), (u - low + 1) / 2) + part.counts[b];
+                        part.signs[b] -= 1;
+                    }
+                }
+
+                part.counts[b] += fenwick.prefix(word_count);
+                if (b == a)
+                    break;
+
+                // Crosses off the odd multiples of p_(b+1)
+                const uint64_t prime = primes[b];
+                uint64_t multiple = (low + prime) / prime * prime;
+                if (multiple % 2 == 0)
+                    multiple += prime;
+                for (uint64_t bit = (multiple - low - 1) / 2; bit < bit_count; bit += prime) {
+                    uint64_t mask = uint64_t(1) << (bit % 64);
+                    if (words[bit / 64] & mask) {
+                        words[bit / 64] &= ~mask;
+                        fenwick.decrement(bit / 64);
+                    }
+                }
+            }
+        }
+        return part;
+    }
+};
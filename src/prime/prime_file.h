@@ -0,0 +1,203 @@
+#pragma once
+
+/* Prime files, written in parallel with MPI-IO.
+
+The primes of [0, range end) are stored in increasing order as the gaps
+between consecutive primes, each one a LEB128 varint (7 bits per byte, low
+bits first, the high bit set on every byte but the last). The first gap is
+counted from 0. Gaps stay below 128 up to the hundreds of millions and
+rarely need a second byte after that, so a prime costs about one byte
+instead of eight.
+
+    offset  size  field
+    0       8     magic "MPIPRIME"
+    8       4     version (1)
+    12      4     encoding (1 = varint gaps)
+    16      8     amount of primes
+    24      8     range end (exclusive)
+    32      8     largest prime, 0 when there are none
+    40      8     bytes of gaps, right after the header
+    48      16    reserved, zero
+
+Every rank encodes the primes of its own range and writes them at the offset
+given by an exclusive scan of the encoded sizes, so no rank ever holds more
+than its own primes.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mpi/mpi.h>
+#include <string>
+#include <vector>
+
+enum PrimeFileEncoding : uint32_t {
+    PRIME_ENCODING_VARINT_GAPS = 1
+};
+
+struct PrimeFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t encoding;
+    uint64_t count;
+    uint64_t range_end;
+    uint64_t largest;
+    uint64_t gap_bytes;
+    uint8_t reserved[16];
+};
+
+static_assert(sizeof(PrimeFileHeader) == 64, "The prime file header must be 64 bytes");
+
+constexpr char PRIME_FILE_MAGIC[8] = { 'M', 'P', 'I', 'P', 'R', 'I', 'M', 'E' };
+constexpr uint32_t PRIME_FILE_VERSION = 1;
+
+/// Largest amount of bytes passed to a single MPI-IO call, whose counts are `int`
+constexpr uint64_t PRIME_FILE_WRITE_BYTES = uint64_t(1) << 30;
+
+inline void append_varint(std::vector<uint8_t>& bytes, uint64_t value)
+{
+    while (value >= 0x80) {
+        bytes.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<uint8_t>(value));
+}
+
+/// Decodes the varint at `data`, advancing it. Returns false if it runs past `end`
+inline bool read_varint(const uint8_t*& data, const uint8_t* end, uint64_t& value)
+{
+    value = 0;
+    for (uint32_t shift = 0; data < end && shift < 64; shift += 7) {
+        uint8_t byte = *data++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/// Consecutive primes in gap encoding. The gap of the first one isn't known
+/// until the primes before it are, so it is kept apart
+class PrimeGaps {
+    uint64_t prime_count = 0;
+    uint64_t first_prime = 0;
+    uint64_t last_prime = 0;
+    std::vector<uint8_t> gaps; // From the first prime on
+
+public:
+    inline uint64_t count() const { return prime_count; }
+    inline uint64_t first() const { return first_prime; }
+    inline uint64_t last() const { return last_prime; }
+
+    /// Adds a prime larger than every one before it
+    void push(uint64_t prime)
+    {
+        if (prime_count == 0)
+            first_prime = prime;
+        else
+            append_varint(gaps, prime - last_prime);
+        last_prime = prime;
+        prime_count++;
+    }
+
+    /// Adds the primes of `other`, which are all larger than these
+    void append(const PrimeGaps& other)
+    {
+        if (other.prime_count == 0)
+            return;
+        if (prime_count == 0) {
+            *this = other;
+            return;
+        }
+        append_varint(gaps, other.first_prime - last_prime);
+        gaps.insert(gaps.end(), other.gaps.begin(), other.gaps.end());
+        last_prime = other.last_prime;
+        prime_count += other.prime_count;
+    }
+
+    /// The encoding of every prime, the first one as a gap from `previous`
+    std::vector<uint8_t> encode(uint64_t previous) const
+    {
+        std::vector<uint8_t> bytes;
+        if (prime_count == 0)
+            return bytes;
+        bytes.reserve(gaps.size() + 10);
+        append_varint(bytes, first_prime - previous);
+        bytes.insert(bytes.end(), gaps.begin(), gaps.end());
+        return bytes;
+    }
+};
+
+/// Writes the primes of [0, range_end) into `path`, each rank of `comm`
+/// giving the primes of its own range in rank order. Collective, returns
+/// whether every rank wrote its part
+inline bool write_prime_file(
+    const std::string& path,
+    const PrimeGaps& primes,
+    uint64_t range_end,
+    MPI_Comm comm,
+    int root = 0)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+
+    // The first gap of a rank starts at the last prime of the ranks before it
+    uint64_t previous = 0;
+    uint64_t last = primes.last();
+    MPI_Exscan(&last, &previous, 1, MPI_UINT64_T, MPI_MAX, comm);
+    if (rank == 0)
+        previous = 0;
+
+    const std::vector<uint8_t> bytes = primes.encode(previous);
+    const uint64_t byte_count = bytes.size();
+    uint64_t offset = 0;
+    MPI_Exscan(&byte_count, &offset, 1, MPI_UINT64_T, MPI_SUM, comm);
+    if (rank == 0)
+        offset = 0;
+
+    uint64_t totals[2] = { primes.count(), byte_count };
+    MPI_Allreduce(MPI_IN_PLACE, totals, 2, MPI_UINT64_T, MPI_SUM, comm);
+    uint64_t largest = last;
+    MPI_Reduce(rank == root ? MPI_IN_PLACE : &largest, &largest, 1, MPI_UINT64_T, MPI_MAX, root, comm);
+
+    MPI_File file;
+    int status = MPI_File_open(comm, path.c_str(), MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &file);
+    if (status != MPI_SUCCESS)
+        return false;
+
+    MPI_File_set_size(file, sizeof(PrimeFileHeader) + totals[1]);
+
+    if (rank == root) {
+        PrimeFileHeader header = {};
+        memcpy(header.magic, PRIME_FILE_MAGIC, sizeof(header.magic));
+        header.version = PRIME_FILE_VERSION;
+        header.encoding = PRIME_ENCODING_VARINT_GAPS;
+        header.count = totals[0];
+        header.range_end = range_end;
+        header.largest = largest;
+        header.gap_bytes = totals[1];
+        MPI_File_write_at(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+
+    // Every rank makes the same amount of collective calls, the ones with
+    // less to write pass empty pieces
+    uint64_t pieces = (byte_count + PRIME_FILE_WRITE_BYTES - 1) / PRIME_FILE_WRITE_BYTES;
+    MPI_Allreduce(MPI_IN_PLACE, &pieces, 1, MPI_UINT64_T, MPI_MAX, comm);
+    int32_t complete = 1;
+    for (uint64_t piece = 0; piece < pieces; piece++) {
+        uint64_t begin = std::min(byte_count, piece * PRIME_FILE_WRITE_BYTES);
+        uint64_t end = std::min(byte_count, begin + PRIME_FILE_WRITE_BYTES);
+        status = MPI_File_write_at_all(
+            file,
+            sizeof(PrimeFileHeader) + offset + begin,
+            bytes.data() + begin,
+            static_cast<int>(end - begin),
+            MPI_BYTE,
+            MPI_STATUS_IGNORE);
+        complete &= status == MPI_SUCCESS;
+    }
+    MPI_File_close(&file);
+
+    MPI_Allreduce(MPI_IN_PLACE, &complete, 1, MPI_INT32_T, MPI_LAND, comm);
+    return complete;
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+/* Segmented sieve of Eratosthenes.
+
+The base primes up to sqrt(end) are sieved once. Ranges are then sieved one
+segment at a time, each segment a bitmap small enough to stay in the L1 data
+cache while every base prime crosses off its multiples.
+
+Only odd numbers are stored: bit i of a segment that starts at `low` (a
+multiple of 128) stands for low + 2i + 1, so a 64 bit word covers 128
+numbers. The multiples of 3, 5 and 7 aren't crossed off one by one: their
+pattern repeats every 105 words (a 2·3·5·7 wheel), so every segment starts
+as a copy of it and only the base primes from 11 on are sieved.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/// Bytes of a segment bitmap, sized for the L1 data cache
+constexpr std::size_t SIEVE_SEGMENT_BYTES = 32 * 1024;
+constexpr uint64_t SIEVE_SEGMENT_WORDS = SIEVE_SEGMENT_BYTES / sizeof(uint64_t);
+/// Numbers covered by a bitmap word, odd numbers only
+constexpr uint64_t SIEVE_WORD_SPAN = 128;
+constexpr uint64_t SIEVE_SEGMENT_SPAN = SIEVE_SEGMENT_WORDS * SIEVE_WORD_SPAN;
+/// Words after which the multiples of 3, 5 and 7 repeat
+constexpr uint64_t SIEVE_WHEEL_WORDS = 3 * 5 * 7;
+
+/// floor(sqrt(n)), exact for every 64 bit n
+inline uint64_t integer_sqrt(uint64_t n)
+{
+    uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(n)));
+    while (root * root > n)
+        root--;
+    while (root < UINT32_MAX && (root + 1) * (root + 1) <= n)
+        root++;
+    return root;
+}
+
+/// Primes up to `limit`, with a plain sieve
+inline std::vector<uint32_t> small_primes(uint32_t limit)
+{
+    std::vector<uint32_t> primes;
+    if (limit < 2)
+        return primes;
+
+    std::vector<bool> composite(limit + 1);
+    for (uint64_t n = 2; n <= limit; n++) {
+        if (composite[n])
+            continue;
+        primes.push_back(n);
+        for (uint64_t multiple = n * n; multiple <= limit; multiple += n)
+            composite[multiple] = true;
+    }
+    return primes;
+}
+
+class SegmentedSieve {
+    std::vector<uint32_t> primes; // Base primes from 11 up to sqrt(end)
+    std::vector<uint64_t> wheel; // Odd numbers not divisible by 3, 5 or 7, a segment longer than the period
+
+    /// Clears the bits [first, last) of `words`
+    static void clear_bits(uint64_t* words, uint64_t first, uint64_t last)
+    {
+        for (; first < last && first % 64 != 0; first++)
+            words[first / 64] &= ~(uint64_t(1) << (first % 64));
+        for (; first + 64 <= last; first += 64)
+            words[first / 64] = 0;
+        for (; first < last; first++)
+            words[first / 64] &= ~(uint64_t(1) << (first % 64));
+    }
+
+public:
+    /// Prepares the base primes to sieve any range below `end`
+    explicit SegmentedSieve(uint64_t end)
+        : wheel(SIEVE_WHEEL_WORDS + SIEVE_SEGMENT_WORDS, ~uint64_t(0))
+    {
+        for (uint32_t prime : small_primes(integer_sqrt(end)))
+            if (prime > 7)
+                primes.push_back(prime);
+
+        for (uint64_t bit = 0; bit < wheel.size() * 64; bit++) {
+            uint64_t n = 2 * bit + 1;
+            if (n % 3 == 0 || n % 5 == 0 || n % 7 == 0)
+                wheel[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+        }
+    }
+
+    /// Sieves the odd numbers of [start, end), which must be below the end
+    /// given to the constructor. For each segment calls
+    /// `visit(low, words, word_count)`, where bit i of `words` is set if
+    /// low + 2i + 1 is a prime of the range
+    template <typename Visit>
+    void sieve(uint64_t start, uint64_t end, Visit&& visit) const
+    {
+        if (start >= end)
+            return;
+
+        std::vector<uint64_t> words(SIEVE_SEGMENT_WORDS);
+        std::vector<uint64_t> next(primes.size()); // Bit of the next multiple of each started prime
+        std::size_t started = 0;
+
+        uint64_t low = start / SIEVE_WORD_SPAN * SIEVE_WORD_SPAN;
+        while (true) {
+            uint64_t high = end - low > SIEVE_SEGMENT_SPAN ? low + SIEVE_SEGMENT_SPAN : end;
+            uint64_t word_count = (high - low + SIEVE_WORD_SPAN - 1) / SIEVE_WORD_SPAN;
+            uint64_t bit_count = word_count * 64;
+
+            memcpy(words.data(), wheel.data() + (low / SIEVE_WORD_SPAN) % SIEVE_WHEEL_WORDS, word_count * sizeof(uint64_t));
+
+            for (std::size_t index = 0; index < primes.size(); index++) {
+                uint64_t prime = primes[index];
+                if (prime * prime >= high)
+                    break;
+
+                // Smaller multiples have a smaller prime factor
+                if (index == started) {
+                    uint64_t first = std::max(prime * prime, (low + prime - 1) / prime * prime);
+                    if (first % 2 == 0)
+                        first += prime;
+                    next[index] = (first - low - 1) / 2;
+                    started++;
+                }
+
+                uint64_t bit = next[index];
+                for (; bit < bit_count; bit += prime)
+                    words[bit / 64] &= ~(uint64_t(1) << (bit % 64));
+                next[index] = bit - bit_count;
+            }
+
+            // 1 isn't prime, and the wheel crossed off 3, 5 and 7 themselves
+            if (low == 0)
+                words[0] = (words[0] & ~uint64_t(1)) | 0xe;
+
+            clear_bits(words.data(), 0, (std::max(start, low) - low) / 2);
+            clear_bits(words.data(), (high - low) / 2, bit_count);
+            visit(low, static_cast<const uint64_t*>(words.data()), word_count);
+
+            if (high == end)
+                return;
+            low = high;
+        }
+    }
+
+    /// The amount of primes in [start, end)
+    uint64_t count(uint64_t start, uint64_t end) const
+    {
+        uint64_t count = start <= 2 && 2 < end;
+        sieve(start, end, [&](uint64_t, const uint64_t* words, uint64_t word_count) {
+            for (uint64_t word = 0; word < word_count; word++)
+                count += __builtin_popcountll(words[word]);
+        });
+        return count;
+    }
+
+    /// Calls `visit(prime)` for every prime of [start, end), in increasing order
+    template <typename Visit>
+    void for_each_prime(uint64_t start, uint64_t end, Visit&& visit) const
+    {
+        if (start <= 2 && 2 < end)
+            visit(uint64_t(2));
+        sieve(start, end, [&](uint64_t low, const uint64_t* words, uint64_t word_count) {
+            for (uint64_t word = 0; word < word_count; word++) {
+                for (uint64_t bits = words[word]; bits != 0; bits &= bits - 1)
+                    visit(low + 2 * (word * 64 + __builtin_ctzll(bits)) + 1);
+            }
+        });
+    }
+
+    /// Appends the primes of [start, end) to `result`, in increasing order
+    void append_primes(uint64_t start, uint64_t end, std::vector<uint64_t>& result) const
+    {
+        for_each_prime(start, end, [&](uint64_t prime) { result.push_back(prime); });
+    }
+};
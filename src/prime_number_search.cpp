@@ -4,36 +4,383 @@ cd build
 g++ -std=c++11 -pthread -O3 -o ejercicio4.out ../src/ejercicio4.cpp
 */
 
+#include "common/instrumentation.h"
+#include "common/options.h"
+#include "common/reduction.h"
+#include "common/thread_pool.h"
+#include "prime/miller_rabin.h"
+#include "prime/prime_count.h"
+#include "prime/prime_file.h"
+#include "prime/sieve.h"
+
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
-#include <math.h>
 #include <mpi/mpi.h>
-#include <mutex>
-#include <thread>
+#include <string>
 #include <vector>
 
-bool is_prime(uint64_t n)
+/// Largest primes kept by every search, to display the largest of the range
+constexpr std::size_t LARGEST_PRIMES_KEPT = 10;
+
+/// What a search keeps of the primes it finds: how many there are, the
+/// largest ones, and every one of them gap encoded when they are written out
+struct FoundPrimes {
+    uint64_t count = 0;
+    std::vector<uint64_t> largest; // Increasing, at most LARGEST_PRIMES_KEPT
+    PrimeGaps encoded;
+
+    /// Adds the primes of `other`, which are all larger than these
+    void append(const FoundPrimes& other)
+    {
+        count += other.count;
+        encoded.append(other.encoded);
+        largest.insert(largest.end(), other.largest.begin(), other.largest.end());
+        if (largest.size() > LARGEST_PRIMES_KEPT)
+            largest.erase(largest.begin(), largest.end() - LARGEST_PRIMES_KEPT);
+    }
+};
+
+FoundPrimes find_primes_ranged(
+    const SegmentedSieve& sieve,
+    uint64_t start,
+    uint64_t end,
+    bool encode)
+{
+    FoundPrimes found;
+    uint64_t recent[LARGEST_PRIMES_KEPT];
+    sieve.for_each_prime(start, end, [&](uint64_t prime) {
+        recent[found.count % LARGEST_PRIMES_KEPT] = prime;
+        found.count++;
+        if (encode)
+            found.encoded.push(prime);
+    });
+
+    // The last primes pushed, oldest first
+    const uint64_t kept = std::min<uint64_t>(found.count, LARGEST_PRIMES_KEPT);
+    for (uint64_t i = found.count - kept; i < found.count; i++)
+        found.largest.push_back(recent[i % LARGEST_PRIMES_KEPT]);
+    return found;
+}
+
+/// Splits [start, end) in chunks of whole segments that the threads of the
+/// pool sieve
+FoundPrimes find_primes_ranged_multithread(
+    const SegmentedSieve& sieve,
+    uint64_t start,
+    uint64_t end,
+    bool encode)
+{
+    if (start >= end)
+        return {};
+
+    ThreadPool& pool = ThreadPool::instance();
+    const uint64_t segment_count = (end - start + SIEVE_SEGMENT_SPAN - 1) / SIEVE_SEGMENT_SPAN;
+    const uint64_t chunk_size = std::max<uint64_t>(1, segment_count / (pool.size() * 4)) * SIEVE_SEGMENT_SPAN;
+    const uint64_t chunk_count = (end - start + chunk_size - 1) / chunk_size;
+
+    std::vector<FoundPrimes> chunk_primes(chunk_count);
+    pool.parallel_for(0, chunk_count, 1, [&](std::size_t first, std::size_t last) {
+        for (std::size_t chunk = first; chunk < last; chunk++) {
+            uint64_t chunk_start = start + chunk * chunk_size;
+            chunk_primes[chunk] = find_primes_ranged(sieve, chunk_start, std::min(end, chunk_start + chunk_size), encode);
+        }
+    });
+
+    // Appends in chunk order, so the primes stay sorted
+    FoundPrimes found;
+    for (const FoundPrimes& primes : chunk_primes)
+        found.append(primes);
+    return found;
+}
+
+/// Reads the whitespace separated decimal numbers of `path`
+bool read_numbers(const char* path, std::vector<uint64_t>& numbers)
 {
-    if (n < 2)
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
         return false;
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    const char* position = text.c_str();
+    while (true) {
+        while (isspace(static_cast<unsigned char>(*position)))
+            position++;
+        if (*position == '\0')
+            return true;
+        if (!isdigit(static_cast<unsigned char>(*position)))
+            return false;
 
-    for (uint64_t i = 2; i <= std::sqrt(n); i++) {
-        if (n % i == 0)
+        char* number_end;
+        errno = 0;
+        numbers.push_back(strtoull(position, &number_end, 10));
+        if (errno == ERANGE)
             return false;
+        position = number_end;
+    }
+}
+
+/// Tests the numbers of `path` for primality. The root reads them and every
+/// rank tests a slice of whole bitmap bytes (8 numbers) over its threads. The
+/// root gathers the bitmap, bit i % 8 of byte i / 8 set when the i-th number
+/// is prime, and writes it into `output_path` or prints the primes
+bool test_numbers_file(const char* path, const char* output_path, int rank, int size, int root_rank)
+{
+    std::vector<uint64_t> numbers;
+    int32_t readable;
+    {
+        INSTRUMENT_PHASE("read numbers", io);
+        readable = rank != root_rank || read_numbers(path, numbers);
+    }
+    MPI_Bcast(&readable, 1, MPI_INT32_T, root_rank, MPI_COMM_WORLD);
+    if (!readable) {
+        if (rank == root_rank)
+            std::cerr << "Error reading " << path << ", it must only hold decimal 64 bit numbers" << std::endl;
+        return false;
     }
+
+    uint64_t total = numbers.size();
+    MPI_Bcast(&total, 1, MPI_UINT64_T, root_rank, MPI_COMM_WORLD);
+
+    const uint64_t bitmap_bytes = (total + 7) / 8;
+    std::vector<int32_t> counts(size), displacements(size), byte_counts(size), byte_displacements(size);
+    for (int i = 0; i < size; i++) {
+        uint64_t first = bitmap_bytes * i / size;
+        uint64_t last = bitmap_bytes * (i + 1) / size;
+        byte_displacements[i] = first;
+        byte_counts[i] = last - first;
+        displacements[i] = first * 8;
+        counts[i] = std::min(total, last * 8) - first * 8;
+    }
+
+    std::vector<uint64_t> local_numbers(counts[rank]);
+    {
+        INSTRUMENT_PHASE("scatter numbers", communication);
+        MPI_Scatterv(
+            numbers.data(),
+            counts.data(),
+            displacements.data(),
+            MPI_UINT64_T,
+            local_numbers.data(),
+            counts[rank],
+            MPI_UINT64_T,
+            root_rank,
+            MPI_COMM_WORLD);
+    }
+
+    const double start_time = MPI_Wtime();
+    std::vector<uint8_t> local_bitmap(byte_counts[rank]);
+    {
+        INSTRUMENT_PHASE("test numbers", compute);
+        ThreadPool::instance().parallel_for(0, local_bitmap.size(), 1024, [&](std::size_t first, std::size_t last) {
+            std::size_t number_count = std::min(local_numbers.size(), last * 8) - first * 8;
+            test_primality(local_numbers.data() + first * 8, number_count, local_bitmap.data() + first);
+        });
+    }
+    INSTRUMENT_COUNT("numbers tested", local_numbers.size());
+    double elapsed = MPI_Wtime() - start_time;
+    MPI_Reduce(rank == root_rank ? MPI_IN_PLACE : &elapsed, &elapsed, 1, MPI_DOUBLE, MPI_MAX, root_rank, MPI_COMM_WORLD);
+
+    std::vector<uint8_t> bitmap(rank == root_rank ? bitmap_bytes : 0);
+    INSTRUMENT_COUNT("bytes sent", local_bitmap.size());
+    {
+        INSTRUMENT_PHASE("gather bitmap", communication);
+        MPI_Gatherv(
+            local_bitmap.data(),
+            local_bitmap.size(),
+            MPI_UINT8_T,
+            bitmap.data(),
+            byte_counts.data(),
+            byte_displacements.data(),
+            MPI_UINT8_T,
+            root_rank,
+            MPI_COMM_WORLD);
+    }
+
+    if (rank != root_rank)
+        return true;
+
+    uint64_t prime_count = 0;
+    for (uint8_t bits : bitmap)
+        prime_count += __builtin_popcount(bits);
+    std::cout << "Tested " << total << " numbers in " << elapsed << " s (" << total / std::max(elapsed, 1e-9) / 1e6
+              << " M/s), " << prime_count << " are prime" << std::endl;
+
+    INSTRUMENT_PHASE("write output", io);
+    if (output_path) {
+        std::ofstream output(output_path, std::ios::binary);
+        output.write(reinterpret_cast<const char*>(bitmap.data()), bitmap.size());
+        if (!output) {
+            std::cerr << "Error writing " << output_path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    for (uint64_t i = 0; i < total; i++) {
+        if (bitmap[i / 8] & (1 << (i % 8)))
+            std::cout << numbers[i] << "\n";
+    }
+    std::cout << std::flush;
     return true;
 }
 
-std::vector<uint64_t> find_primes_ranged(
-    uint64_t start,
-    uint64_t end)
+/// pi(x) with the Meissel-Lehmer counter. Every rank counts its part of the
+/// counter's sieve, split again in chunks of whole segments for its threads,
+/// and the parts are joined with a prefix scan of their counts. The result
+/// is only valid on the root
+uint64_t count_primes(uint64_t x, int rank, int size, int root_rank)
 {
-    std::vector<uint64_t> prime_nums;
-    for (uint64_t n = start; n < end; n++) {
-        if (is_prime(n))
-            prime_nums.push_back(n);
+    const PrimeCounter counter(x);
+    const uint64_t sieve_end = counter.sieve_end();
+    const uint64_t begin = sieve_end * rank / size / 2 * 2;
+    const uint64_t end = rank + 1 == size ? sieve_end : sieve_end * (rank + 1) / size / 2 * 2;
+
+    ThreadPool& pool = ThreadPool::instance();
+    const uint64_t segment_count = (end - begin + PRIME_COUNT_SEGMENT_SPAN - 1) / PRIME_COUNT_SEGMENT_SPAN;
+    const uint64_t chunk_size = std::max<uint64_t>(1, segment_count / (pool.size() * 4)) * PRIME_COUNT_SEGMENT_SPAN;
+    const uint64_t chunk_count = (end - begin + chunk_size - 1) / chunk_size;
+
+    CountPart part(counter.level_count());
+    {
+        INSTRUMENT_PHASE("count sieve", compute);
+        std::vector<CountPart> chunk_parts(chunk_count);
+        pool.parallel_for(0, chunk_count, 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t chunk = first; chunk < last; chunk++) {
+                uint64_t chunk_begin = begin + chunk * chunk_size;
+                chunk_parts[chunk] = counter.count_range(chunk_begin, std::min(end, chunk_begin + chunk_size));
+            }
+        });
+
+        for (CountPart& chunk_part : chunk_parts)
+            part.append(std::move(chunk_part));
+    }
+    INSTRUMENT_COUNT("numbers sieved", end - begin);
+
+    // Counts of the numbers of the ranks before this one
+    std::vector<uint64_t> prefix(counter.level_count());
+    {
+        INSTRUMENT_PHASE("prefix scan", communication);
+        MPI_Exscan(part.counts.data(), prefix.data(), prefix.size(), MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
     }
-    return prime_nums;
+    if (rank != 0)
+        part.offset(prefix);
+
+    INSTRUMENT_PHASE("reduction", communication);
+    return reduce_sum(part.sum, root_rank, MPI_COMM_WORLD) + counter.direct_terms();
+}
+
+/// Numbers of a top-K window, each rank takes every `size`-th window going down
+constexpr uint64_t TOP_WINDOW_SIZE = 1 << 14;
+
+/// The `k` largest primes below `max_num`, increasing, on the root (fewer if
+/// there aren't as many). The ranks test interleaved windows downward from
+/// `max_num` with Miller-Rabin, one window per rank and round. After every
+/// round the amount of primes found so far is added up with a non-blocking
+/// all-reduce, which completes while the next round is tested: once the
+/// rounds finished before hold k primes, every larger prime is known and
+/// all the ranks stop after the same round
+std::vector<uint64_t> find_largest_primes(uint64_t max_num, uint64_t k, int rank, int size, int root_rank)
+{
+    ThreadPool& pool = ThreadPool::instance();
+    const uint64_t window_count = max_num / TOP_WINDOW_SIZE + (max_num % TOP_WINDOW_SIZE != 0);
+    const uint64_t round_count = (window_count + size - 1) / size;
+
+    std::vector<uint64_t> found;
+    uint64_t found_count = 0;
+    uint64_t sent_count = 0; // Send buffer of the pending all-reduce, untouched until it completes
+    uint64_t global_count = 0;
+    MPI_Request request = MPI_REQUEST_NULL;
+
+    for (uint64_t round = 0; round < round_count && k > 0; round++) {
+        const uint64_t window = round * size + rank;
+        if (window < window_count) {
+            const uint64_t high = max_num - window * TOP_WINDOW_SIZE;
+            const uint64_t low = high - std::min(high, TOP_WINDOW_SIZE);
+
+            const uint64_t chunk_size = std::max<uint64_t>(256, TOP_WINDOW_SIZE / (pool.size() * 4));
+            const uint64_t chunk_count = (high - low + chunk_size - 1) / chunk_size;
+            std::vector<std::vector<uint64_t>> chunk_primes(chunk_count);
+            INSTRUMENT_PHASE("test window", compute);
+            INSTRUMENT_COUNT("numbers tested", high - low);
+            pool.parallel_for(0, chunk_count, 1, [&](std::size_t first, std::size_t last) {
+                for (std::size_t chunk = first; chunk < last; chunk++) {
+                    uint64_t chunk_low = low + chunk * chunk_size;
+                    for (uint64_t n = chunk_low; n < std::min(high, chunk_low + chunk_size); n++) {
+                        if (is_prime(n))
+                            chunk_primes[chunk].push_back(n);
+                    }
+                }
+            });
+            for (const auto& primes : chunk_primes) {
+                found.insert(found.end(), primes.begin(), primes.end());
+                found_count += primes.size();
+            }
+        }
+
+        // The rounds before this one are complete everywhere once their count arrives
+        if (request != MPI_REQUEST_NULL) {
+            INSTRUMENT_PHASE("wait count", communication);
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+            if (global_count >= k)
+                break;
+        }
+        sent_count = found_count;
+        MPI_Iallreduce(&sent_count, &global_count, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD, &request);
+    }
+    if (request != MPI_REQUEST_NULL) {
+        INSTRUMENT_PHASE("wait count", communication);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+    }
+
+    // Only the k largest of every rank can be among the k largest overall
+    std::sort(found.begin(), found.end());
+    if (found.size() > k)
+        found.erase(found.begin(), found.end() - k);
+
+    INSTRUMENT_PHASE("gather largest", communication);
+    int32_t kept = found.size();
+    std::vector<int32_t> counts(size), displacements(size);
+    MPI_Gather(&kept, 1, MPI_INT32_T, counts.data(), 1, MPI_INT32_T, root_rank, MPI_COMM_WORLD);
+    uint64_t total = 0;
+    for (int i = 0; i < size; i++) {
+        displacements[i] = total;
+        total += counts[i];
+    }
+
+    std::vector<uint64_t> largest(rank == root_rank ? total : 0);
+    MPI_Gatherv(
+        found.data(),
+        kept,
+        MPI_UINT64_T,
+        largest.data(),
+        counts.data(),
+        displacements.data(),
+        MPI_UINT64_T,
+        root_rank,
+        MPI_COMM_WORLD);
+
+    std::sort(largest.begin(), largest.end());
+    if (largest.size() > k)
+        largest.erase(largest.begin(), largest.end() - k);
+    return largest;
+}
+
+/// Prints the last `display_count` numbers of the increasing `primes`, the
+/// largest first
+void print_largest(const std::vector<uint64_t>& primes, uint64_t display_count)
+{
+    display_count = std::min<uint64_t>(display_count, primes.size());
+    std::cout << "Largest " << display_count << " numbers: [";
+    for (uint64_t i = 0; i < display_count; i++) {
+        std::cout << primes[primes.size() - i - 1];
+        if (i + 1 < display_count)
+            std::cout << ", ";
+    }
+    std::cout << "]" << std::endl;
 }
 
 template <typename T>
@@ -53,9 +400,10 @@ void print_vector(const std::vector<T>& vec)
 int main(int argc, char** argv)
 {
 
-    // Initializes MPI
+    // Initializes MPI. Only the main thread calls MPI, the pool threads just compute
     // ----------------------------------------------------------------------
-    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) {
+    int thread_support;
+    if (MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support) != MPI_SUCCESS) {
         std::cout << "Error while initializing MPI" << std::endl;
         return 1;
     }
@@ -64,44 +412,126 @@ int main(int argc, char** argv)
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+    if (thread_support < MPI_THREAD_FUNNELED && rank == 0)
+        std::cout << "Warning: the MPI library does not support MPI_THREAD_FUNNELED\n";
+
+    // Every rank receives the same arguments, so the thread count is read locally
+    const char* threads_option = take_option(argc, argv, "--threads");
+    ThreadPool::configure(threads_option ? atol(threads_option) : 1);
+    const char* output_option = take_option(argc, argv, "--output");
+    const char* test_option = take_option(argc, argv, "--test");
+    const bool count_only = take_flag(argc, argv, "--count");
+    const char* top_option = take_option(argc, argv, "--top");
+    const InstrumentationOptions instrumentation = take_instrumentation_options(argc, argv);
+    INSTRUMENT_START(MPI_COMM_WORLD);
+
     int root_rank = 0;
     uint64_t max_num = 0;
     if (rank == root_rank) {
-        if (argc != 2) {
-            std::cout << "The program expects 1 arguments, the maximum number tested\n";
+        if (argc != (test_option ? 1 : 2) || (count_only && (test_option || output_option))
+            || (top_option && (count_only || test_option || output_option))) {
+            std::cout << "The program expects 1 arguments, the maximum number tested. Options:\n"
+                      << "  --threads N    threads per node, 0 uses every available core\n"
+                      << "  --output FILE  writes every prime found into FILE, gap encoded (see prime/prime_file.h).\n"
+                      << "                 Each node writes its own part, FILE must be on a shared filesystem\n"
+                      << "  --test FILE    instead of a range, tests the whitespace separated numbers of FILE with\n"
+                      << "                 Miller-Rabin and prints the primes. With --output the result is written\n"
+                      << "                 there as a bitmap, one bit per number (bit i % 8 of byte i / 8)\n"
+                      << "  --count        only counts the primes, with the Meissel-Lehmer method instead of\n"
+                      << "                 the sieve. Can't be used with --output or --test\n"
+                      << "  --top K        only finds the K largest primes, searching down from the number.\n"
+                      << "                 Can't be used with the other modes\n"
+                      << "  --trace FILE   writes the phases of every node into FILE, as a Chrome trace\n"
+                      << "  --profile      prints the time of every phase and the imbalance between the nodes\n";
             MPI_Finalize();
             return 1;
         }
 
-        max_num = atol(argv[1]);
-        std::cout << "Finding numbers in range [0, " << max_num << "]" << std::endl;
+        if (!test_option) {
+            max_num = strtoull(argv[1], nullptr, 10);
+            std::cout << "Finding numbers in range [0, " << max_num << "]" << std::endl;
+        }
+    }
+
+    if (test_option) {
+        bool tested = test_numbers_file(test_option, output_option, rank, size, root_rank);
+        instrumentation.report(root_rank, MPI_COMM_WORLD);
+        MPI_Finalize();
+        return tested ? 0 : 1;
     }
 
     // Broadcasts the maximum number
-    MPI_Bcast(&max_num, 1, MPI_LONG_LONG_INT, root_rank, MPI_COMM_WORLD);
+    {
+        INSTRUMENT_PHASE("broadcast", communication);
+        MPI_Bcast(&max_num, 1, MPI_UINT64_T, root_rank, MPI_COMM_WORLD);
+    }
 
-    // Calculates the range [start, end) for the node
+    // Calculates the range [start, end) for the node. With more ranks than
+    // numbers the last ones get an empty range at max_num
     uint64_t numbers_per_node = (max_num + size - 1) / size;
-    uint64_t start_num = rank * numbers_per_node;
-    uint64_t end_num = (rank + 1) * numbers_per_node;
+    uint64_t start_num = std::min(rank * numbers_per_node, max_num);
+    uint64_t end_num = std::min((rank + 1) * numbers_per_node, max_num);
 
     if (rank == size - 1)
         end_num = max_num;
 
-    std::vector<uint64_t> prime_numbers = find_primes_ranged(start_num, end_num);
+    if (top_option) {
+        const double start_time = MPI_Wtime();
+        std::vector<uint64_t> largest = find_largest_primes(max_num, atoll(top_option), rank, size, root_rank);
+        if (rank == root_rank) {
+            print_largest(largest, largest.size());
+            std::cout << "Found in " << MPI_Wtime() - start_time << " s" << std::endl;
+        }
+        instrumentation.report(root_rank, MPI_COMM_WORLD);
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (count_only) {
+        const double start_time = MPI_Wtime();
+        uint64_t prime_count = max_num > 0 ? count_primes(max_num - 1, rank, size, root_rank) : 0;
+        if (rank == root_rank)
+            std::cout << "Found " << prime_count << " primes in " << MPI_Wtime() - start_time << " s" << std::endl;
+        instrumentation.report(root_rank, MPI_COMM_WORLD);
+        MPI_Finalize();
+        return 0;
+    }
+
+    // Every rank sieves its own base primes, up to the square root of its range end
+    FoundPrimes prime_numbers;
+    {
+        INSTRUMENT_PHASE("sieve", compute);
+        SegmentedSieve sieve(end_num);
+        prime_numbers = find_primes_ranged_multithread(sieve, start_num, end_num, output_option != nullptr);
+    }
+    INSTRUMENT_COUNT("numbers tested", end_num - std::min(start_num, end_num));
+
+    // Writes the primes, every node its own part of the file ------------------------------------
+    if (output_option) {
+        INSTRUMENT_PHASE("write primes", io);
+        bool written = write_prime_file(output_option, prime_numbers.encoded, max_num, MPI_COMM_WORLD, root_rank);
+        if (rank == root_rank) {
+            if (written)
+                std::cout << "Primes written to " << output_option << std::endl;
+            else
+                std::cerr << "Error writing " << output_option << std::endl;
+        }
+    }
 
     // Gathers the count of prime numbers found each node ----------------------------------------
-    uint64_t prime_number_count_per_node[size];
-    uint64_t prime_number_count = prime_numbers.size();
-    MPI_Gather(
-        &prime_number_count,
-        1,
-        MPI_LONG_LONG,
-        prime_number_count_per_node,
-        1,
-        MPI_LONG_LONG,
-        root_rank,
-        MPI_COMM_WORLD);
+    std::vector<uint64_t> prime_number_count_per_node(rank == root_rank ? size : 0);
+    {
+        INSTRUMENT_PHASE("gather counts", communication);
+        MPI_Gather(
+            &prime_numbers.count,
+            1,
+            MPI_UINT64_T,
+            prime_number_count_per_node.data(),
+            1,
+            MPI_UINT64_T,
+            root_rank,
+            MPI_COMM_WORLD);
+    }
 
     if (root_rank == rank) {
         for (uint32_t i = 0; i < size; i++) {
@@ -109,7 +539,7 @@ int main(int argc, char** argv)
         }
     }
 
-    // Setup data to use Gather vary and gather all the found prime numbers ----------------------
+    // Setup data to use Gather vary and gather the largest prime numbers of every node -----------
     std::vector<int32_t> recv_counts(size); // How many numbers each process will send
     std::vector<int32_t> displacements(size); // Offsets of where to place the data
     uint64_t all_prime_numbers_count = 0;
@@ -117,45 +547,40 @@ int main(int argc, char** argv)
     if (rank == root_rank) {
         uint64_t offset = 0;
         for (uint32_t i = 0; i < size; i++) {
-            recv_counts[i] = prime_number_count_per_node[i];
+            recv_counts[i] = std::min<uint64_t>(prime_number_count_per_node[i], LARGEST_PRIMES_KEPT);
             displacements[i] = offset;
-            offset += prime_number_count_per_node[i];
+            offset += recv_counts[i];
         }
 
         all_prime_numbers_count = offset;
     }
 
-    // Gathers the prime numbers of all the nodes ------------------------------------------------
-    // Creates a vector with the required capacity to hold all the prime numbers
+    // Gathers the largest prime numbers of all the nodes, the root never holds the rest ---------
     std::vector<uint64_t> all_prime_numbers(all_prime_numbers_count);
 
     // Gathering in this way ensures that the vector `all_prime_numbers` is sorted, since
     // the ranges are sorted by the rank
-    MPI_Gatherv(
-        prime_numbers.data(),
-        prime_number_count,
-        MPI_LONG_LONG,
-        all_prime_numbers.data(),
-        (const int32_t*)recv_counts.data(),
-        (const int32_t*)displacements.data(),
-        MPI_LONG_LONG,
-        root_rank,
-        MPI_COMM_WORLD);
+    INSTRUMENT_COUNT("bytes sent", prime_numbers.largest.size() * sizeof(uint64_t));
+    {
+        INSTRUMENT_PHASE("gather largest", communication);
+        MPI_Gatherv(
+            prime_numbers.largest.data(),
+            prime_numbers.largest.size(),
+            MPI_UINT64_T,
+            all_prime_numbers.data(),
+            (const int32_t*)recv_counts.data(),
+            (const int32_t*)displacements.data(),
+            MPI_UINT64_T,
+            root_rank,
+            MPI_COMM_WORLD);
+    }
 
     // print_vector(all_prime_numbers);
 
     // Displays results
-    if (rank == root_rank) {
-        uint8_t display_count = 10;
-        std::cout << "Largest " << display_count << " numbers: [";
-        for (uint8_t i = 0; i < display_count; i++) {
-            auto ptr = all_prime_numbers.end() - i - 1;
-            std::cout << *ptr;
-            if (i + 1 < display_count)
-                std::cout << ", ";
-        }
-        std::cout << "]" << std::endl;
-    }
+    if (rank == root_rank)
+        print_largest(all_prime_numbers, LARGEST_PRIMES_KEPT);
+    instrumentation.report(root_rank, MPI_COMM_WORLD);
     if (MPI_Finalize() != MPI_SUCCESS) {
         std::cout << "Error finalizing MPI" << std::endl;
         return 1;